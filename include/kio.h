@@ -17,6 +17,9 @@ kout_t* kout_open(FILE *fp, char *obuf, size_t obufsize);
 FILE *kout_getfp(kout_t *pkout);
 int kout_putc(kout_t *pkout, int ch);
 int kout_printf(kout_t *pkout, const char *format, ...);
+int kout_write(kout_t *pkout, const void *buf, size_t size);
+const char *kout_data(kout_t *pkout, size_t *psize);
+int kout_reset(kout_t *pkout);
 int kout_close(kout_t *pkout, char **pbuf, size_t *psize);
 
 #endif // __KIO_H__
\ No newline at end of file
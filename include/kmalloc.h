@@ -15,4 +15,13 @@ void *ksrealloc(void *ptr, size_t size);
 void ksfree(void *ptr);
 char *ksstrdup(const char *s);
 
+// Allocations made by the calling thread are added to the installed tally.
+typedef struct kmalloc_tally {
+  size_t kmt_count;
+  size_t kmt_bytes;
+} kmalloc_tally_t;
+
+// Install tally (or none with NULL) and return the previous one.
+kmalloc_tally_t *kmalloc_tally(kmalloc_tally_t *tally);
+
 #endif
\ No newline at end of file
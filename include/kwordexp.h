@@ -1,6 +1,7 @@
 #ifndef __KWORDEXP_H__
 #define __KWORDEXP_H__
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -8,7 +9,23 @@ typedef struct kwordexp kwordexp_t;
 typedef int (*kwordexp_setenv_t)(void *data, const char *key, char *value,
                                  int overwrite);
 typedef int (*kwordexp_getenv_t)(void *data, const char *key, char **pvalue);
+typedef int (*kwordexp_getenvv_t)(void *data, const char **keys,
+                                  char **pvalues, size_t count);
 typedef int (*kwordexp_exec_t)(void *data, char **argv, FILE *ofp);
+typedef int (*kwordexp_glob_t)(void *data, const char *path);
+typedef int (*kwordexp_word_t)(void *data, const char *word, size_t len);
+typedef struct kwordexp_dir kwordexp_dir_t;
+typedef struct kwordexp_pattern kwordexp_pattern_t;
+typedef struct kwordexp_env kwordexp_env_t;
+typedef struct kwordexp_cache kwordexp_cache_t;
+typedef struct kwordexp_info kwordexp_info_t;
+typedef struct kwordexp_stats kwordexp_stats_t;
+typedef struct kwordexp_words kwordexp_words_t;
+typedef struct kwordexp_shcache kwordexp_shcache_t;
+typedef void (*kwordexp_slow_t)(void *data, const char *input, size_t len,
+                                const kwordexp_stats_t *stats);
+typedef int (*kwordexp_readdir_t)(void *data, const char *path,
+                                  const char *prefix, kwordexp_dir_t *dir);
 
 struct kwordexp {
   char **kwe_wordv;
@@ -22,17 +39,86 @@ struct kwordexp {
   int kwe_last_status;
   pid_t kwe_last_bgpid;
   const char *kwe_last_arg;
+  // members added later go below, so the ones above keep their offsets
+  // the words under KWRDE_COMPACT; kwe_wordv is then left NULL until
+  // kwordexp_wordv() builds it
+  kwordexp_words_t *kwe_words;
+  kwordexp_getenvv_t kwe_getenvv;
+  kwordexp_env_t *kwe_env;
+  kwordexp_glob_t kwe_glob;
+  size_t kwe_glob_max;
+  // nesting limit of $(...) and ${...}; 0 means the built-in default.
+  // Deeper input fails with errno set to ELOOP.
+  size_t kwe_depth_max;
+  kwordexp_readdir_t kwe_readdir;
+  kwordexp_cache_t *kwe_cache;
+  // command output and directory listings shared between processes
+  kwordexp_shcache_t *kwe_shcache;
+  kwordexp_word_t kwe_word;
+  // filled by each call when set
+  kwordexp_stats_t *kwe_stats;
+  // called after an expansion that took kwe_slow_ns or longer
+  kwordexp_slow_t kwe_slow;
+  uint64_t kwe_slow_ns;
+};
+
+// Times are CLOCK_MONOTONIC nanoseconds. kws_parse_ns is the part of
+// kws_total_ns not spent in getenv callbacks, globbing or commands.
+struct kwordexp_stats {
+  size_t kws_bytes;
+  size_t kws_words;
+  size_t kws_lookups;
+  size_t kws_globs;
+  size_t kws_matches;
+  size_t kws_execs;
+  // command output read back, before trailing newlines are dropped
+  size_t kws_readbytes;
+  // allocations made by the calling thread
+  size_t kws_allocs;
+  size_t kws_allocbytes;
+  uint64_t kws_total_ns;
+  uint64_t kws_parse_ns;
+  uint64_t kws_getenv_ns;
+  uint64_t kws_glob_ns;
+  uint64_t kws_exec_ns;
+};
+
+struct kwordexp_info {
+  int kwi_flags;
+  // bit n is set when $n is referenced
+  unsigned kwi_argmask;
+  char **kwi_varv;
+  size_t kwi_varc;
 };
 
 int kwordexp(const char *ibuf, kwordexp_t *we, int flags)
     __attribute__((warn_unused_result, nonnull(1, 2)));
 int kfwordexp(FILE *ifp, kwordexp_t *we, int flags)
     __attribute__((warn_unused_result, nonnull(1, 2)));
+// Expand the len bytes at ibuf, which need not be NUL-terminated.
+int kwordexp_n(const char *ibuf, size_t len, kwordexp_t *we, int flags)
+    __attribute__((warn_unused_result, nonnull(1, 3)));
 void kwordfree(kwordexp_t *we) __attribute__((nonnull(1)));
 
 void kwordexp_init(kwordexp_t *we, char **argv, size_t argc)
     __attribute__((nonnull(1, 2)));
 
+// Expand into buf as NUL-terminated words starting at offsets[i]. Returns 1
+// with the required sizes in *psize and *pwordc when buf or offsets is too
+// small.
+int kwordexp_into(const char *ibuf, char *buf, size_t cap, size_t *offsets,
+                  size_t maxwords, kwordexp_t *we, int flags, size_t *psize,
+                  size_t *pwordc)
+    __attribute__((warn_unused_result, nonnull(1, 6, 8, 9)));
+
+// Expand and write each word followed by sep to fd.
+int kwordexp_write(int fd, const char *ibuf, int sep, kwordexp_t *we,
+                   int flags) __attribute__((warn_unused_result, nonnull(2, 4)));
+
+int kwordexp_analyze(const char *ibuf, kwordexp_info_t *info)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+void kwordexp_info_free(kwordexp_info_t *info) __attribute__((nonnull(1)));
+
 int kwordexp_setenv_default(void *data, const char *key, char *value,
                             int overwrite)
     __attribute__((weak, warn_unused_result, nonnull(2, 3)));
@@ -43,8 +129,81 @@ int kwordexp_getenv_default(void *data, const char *key, char **pvalue)
 int kwordexp_exec_default(void *data, char **argv, FILE *ofp)
     __attribute__((weak, warn_unused_result, nonnull(2, 3)));
 
+int kwordexp_dir_add(kwordexp_dir_t *dir, const char *name, int isdir)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwordexp_globcache_flush(void);
+void kwordexp_homecache_flush(void);
+
+kwordexp_pattern_t *kwordexp_pattern_compile(const char *pattern, int flags)
+    __attribute__((warn_unused_result, nonnull(1)));
+int kwordexp_pattern_match(const kwordexp_pattern_t *pattern, const char *s,
+                           size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+void kwordexp_pattern_free(kwordexp_pattern_t *pattern)
+    __attribute__((nonnull(1)));
+
+kwordexp_env_t *kwordexp_env_snapshot(void)
+    __attribute__((warn_unused_result));
+kwordexp_env_t *kwordexp_env_new(kwordexp_env_t *base)
+    __attribute__((warn_unused_result));
+int kwordexp_env_set(kwordexp_env_t *env, const char *key, const char *value)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+int kwordexp_env_unset(kwordexp_env_t *env, const char *key)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+const char *kwordexp_env_get(const kwordexp_env_t *env, const char *key)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+void kwordexp_env_free(kwordexp_env_t *env);
+
+kwordexp_cache_t *kwordexp_cache_new(size_t max)
+    __attribute__((warn_unused_result));
+void kwordexp_cache_invalidate(kwordexp_cache_t *cache, const char *name)
+    __attribute__((nonnull(1)));
+void kwordexp_cache_free(kwordexp_cache_t *cache) __attribute__((nonnull(1)));
+
+// Metrics are collected from the start, timed with CLOCK_MONOTONIC_COARSE
+// so that they can stay on; kwordexp_metrics_enable(0) stops them.
+void kwordexp_metrics_enable(int on);
+int kwordexp_metrics_dump(FILE *fp) __attribute__((nonnull(1)));
+
+const char *kwordexp_word_name(const kwordexp_t *we, size_t i, size_t *prefix)
+    __attribute__((nonnull(1, 3)));
+const char *kwordexp_word_prefix(const kwordexp_t *we, size_t prefix,
+                                 size_t *len) __attribute__((nonnull(1)));
+size_t kwordexp_word_path(const kwordexp_t *we, size_t i, char *buf,
+                          size_t cap) __attribute__((nonnull(1)));
+char **kwordexp_wordv(kwordexp_t *we)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+kwordexp_shcache_t *kwordexp_shcache_open(const char *name, size_t size,
+                                          uint64_t ttl_ns)
+    __attribute__((warn_unused_result));
+void kwordexp_shcache_close(kwordexp_shcache_t *cache)
+    __attribute__((nonnull(1)));
+
 
 #define KWRDE_SHOWERR 0x01
 #define KWRDE_UNDEF 0x02
+#define KWRDE_GLOBCACHE 0x04
+#define KWRDE_NOSORT 0x08
+#define KWRDE_GLOBSTAR 0x10
+#define KWRDE_PARALLEL 0x20
+#define KWRDE_NOCMD 0x40
+#define KWRDE_NOGLOB 0x80
+#define KWRDE_SPLITONLY 0x100
+#define KWRDE_COMPACT 0x200
+
+#define KWRDE_PATTERN_PERIOD 0x01
+
+#define KWRDI_CMDSUB 0x01
+#define KWRDI_ARITH 0x02
+#define KWRDI_GLOB 0x04
+#define KWRDI_BRACE 0x08
+#define KWRDI_TILDE 0x10
+#define KWRDI_ASSIGN 0x20
+// $?, $!, $$, $_ or $-
+#define KWRDI_SPECIAL 0x40
+// $@, $* or $#
+#define KWRDI_ARGS 0x80
 
 #endif
\ No newline at end of file
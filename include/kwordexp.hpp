@@ -0,0 +1,254 @@
+#ifndef __KWORDEXP_HPP__
+#define __KWORDEXP_HPP__
+
+extern "C" {
+#include "kwordexp.h"
+}
+
+#include <cerrno>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kwe {
+
+// The words of one expansion, stored back to back in a single buffer. Each
+// word is followed by a NUL, so data() of every element is a C string.
+class words {
+public:
+  class iterator {
+  public:
+    using iterator_concept = std::random_access_iterator_tag;
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::string_view;
+
+    iterator() noexcept = default;
+    iterator(const words *pw, std::size_t i) noexcept : pw_(pw), i_(i) {}
+
+    std::string_view operator*() const noexcept { return (*pw_)[i_]; }
+    std::string_view operator[](difference_type n) const noexcept {
+      return (*pw_)[i_ + n];
+    }
+    iterator &operator++() noexcept {
+      ++i_;
+      return *this;
+    }
+    iterator operator++(int) noexcept { return {pw_, i_++}; }
+    iterator &operator--() noexcept {
+      --i_;
+      return *this;
+    }
+    iterator operator--(int) noexcept { return {pw_, i_--}; }
+    iterator &operator+=(difference_type n) noexcept {
+      i_ += n;
+      return *this;
+    }
+    iterator &operator-=(difference_type n) noexcept {
+      i_ -= n;
+      return *this;
+    }
+    friend iterator operator+(iterator it, difference_type n) noexcept {
+      return it += n;
+    }
+    friend iterator operator+(difference_type n, iterator it) noexcept {
+      return it += n;
+    }
+    friend iterator operator-(iterator it, difference_type n) noexcept {
+      return it -= n;
+    }
+    friend difference_type operator-(const iterator &a,
+                                     const iterator &b) noexcept {
+      return static_cast<difference_type>(a.i_) -
+             static_cast<difference_type>(b.i_);
+    }
+    friend bool operator==(const iterator &a, const iterator &b) noexcept {
+      return a.i_ == b.i_;
+    }
+    friend auto operator<=>(const iterator &a, const iterator &b) noexcept {
+      return a.i_ <=> b.i_;
+    }
+
+  private:
+    const words *pw_ = nullptr;
+    std::size_t i_ = 0;
+  };
+
+  explicit words(std::pmr::memory_resource *mr =
+                     std::pmr::get_default_resource()) noexcept
+      : buf_(mr), offv_(mr) {}
+  words(words &&) noexcept = default;
+  words &operator=(words &&) = default;
+  words(const words &) = delete;
+  words &operator=(const words &) = delete;
+
+  std::size_t size() const noexcept { return offv_.size(); }
+  bool empty() const noexcept { return offv_.empty(); }
+  iterator begin() const noexcept { return {this, 0}; }
+  iterator end() const noexcept { return {this, size()}; }
+
+  std::string_view operator[](std::size_t i) const noexcept {
+    std::size_t end = i + 1 < offv_.size() ? offv_[i + 1] : buf_.size();
+    return {buf_.data() + offv_[i], end - offv_[i] - 1};
+  }
+
+  void clear() noexcept {
+    buf_.clear();
+    offv_.clear();
+  }
+
+  std::pmr::memory_resource *resource() const noexcept {
+    return buf_.get_allocator().resource();
+  }
+
+private:
+  friend class expander;
+
+  void push(std::string_view word) {
+    offv_.push_back(buf_.size());
+    buf_.insert(buf_.end(), word.begin(), word.end());
+    buf_.push_back('\0');
+  }
+
+  std::pmr::vector<char> buf_;
+  std::pmr::vector<std::size_t> offv_;
+};
+
+// Expands words into a kwe::words. Callbacks are called through a
+// per-type trampoline and a pointer to the callable, which must outlive the
+// expander. An exception thrown by a callback ends the expansion and is
+// rethrown from expand(). An expander is not meant to be used by several
+// threads at once.
+class expander {
+public:
+  expander(char **argv, std::size_t argc) noexcept {
+    kwordexp_init(&we_, argv, argc);
+  }
+  expander(const expander &) = delete;
+  expander &operator=(const expander &) = delete;
+  ~expander() { kwordfree(&we_); }
+
+  // fn(const char *key, char **pvalue) -> int
+  template <class F> expander &on_getenv(F &fn) noexcept {
+    getenv_ = std::addressof(fn);
+    we_.kwe_getenv = &getenv_thunk<F>;
+    return *this;
+  }
+
+  // fn(const char *key, char *value, int overwrite) -> int
+  template <class F> expander &on_setenv(F &fn) noexcept {
+    setenv_ = std::addressof(fn);
+    we_.kwe_setenv = &setenv_thunk<F>;
+    return *this;
+  }
+
+  // fn(char **argv, FILE *ofp) -> int
+  template <class F> expander &on_exec(F &fn) noexcept {
+    exec_ = std::addressof(fn);
+    we_.kwe_exec = &exec_thunk<F>;
+    return *this;
+  }
+
+  // fn(std::string_view input, const kwordexp_stats_t &stats), after each
+  // expansion that took threshold_ns or longer
+  template <class F>
+  expander &on_slow(F &fn, std::uint64_t threshold_ns) noexcept {
+    slow_ = std::addressof(fn);
+    we_.kwe_slow = &slow_thunk<F>;
+    we_.kwe_slow_ns = threshold_ns;
+    return *this;
+  }
+
+  // Options without a callback, such as kwe_env or kwe_depth_max, are set
+  // here directly; kwe_word and kwe_data belong to the expander.
+  kwordexp_t &get() noexcept { return we_; }
+
+  // Returns 0, or -1 with errno set as for kwordexp().
+  int expand(std::string_view input, words &out, int flags = 0) {
+    out.clear();
+    out_ = &out;
+    error_ = nullptr;
+    we_.kwe_word = &word_thunk;
+    we_.kwe_data = this;
+    const char *ibuf = input.data() != nullptr ? input.data() : "";
+    int ret = kwordexp_n(ibuf, input.size(), &we_, flags);
+    we_.kwe_word = nullptr;
+    out_ = nullptr;
+    if (error_ != nullptr)
+      std::rethrow_exception(std::exchange(error_, nullptr));
+    return ret;
+  }
+
+private:
+  template <class T, class... Args>
+  static int call(void *data, void *expander::*slot, Args... args) noexcept {
+    expander *pe = static_cast<expander *>(data);
+    try {
+      return (*static_cast<T *>(pe->*slot))(args...);
+    } catch (...) {
+      pe->error_ = std::current_exception();
+      errno = ECANCELED;
+      return -1;
+    }
+  }
+
+  template <class F>
+  static int getenv_thunk(void *data, const char *key, char **pvalue) {
+    return call<F>(data, &expander::getenv_, key, pvalue);
+  }
+
+  template <class F>
+  static int setenv_thunk(void *data, const char *key, char *value,
+                          int overwrite) {
+    return call<F>(data, &expander::setenv_, key, value, overwrite);
+  }
+
+  template <class F>
+  static int exec_thunk(void *data, char **argv, FILE *ofp) {
+    return call<F>(data, &expander::exec_, argv, ofp);
+  }
+
+  template <class F>
+  static void slow_thunk(void *data, const char *input, std::size_t len,
+                         const kwordexp_stats_t *stats) {
+    expander *pe = static_cast<expander *>(data);
+    try {
+      (*static_cast<F *>(pe->slow_))(std::string_view(input, len), *stats);
+    } catch (...) {
+      // the expansion is over; keep the first error
+      if (pe->error_ == nullptr)
+        pe->error_ = std::current_exception();
+    }
+  }
+
+  static int word_thunk(void *data, const char *word, std::size_t len) {
+    expander *pe = static_cast<expander *>(data);
+    try {
+      pe->out_->push({word, len});
+      return 0;
+    } catch (...) {
+      // a nonzero return stops the expansion
+      pe->error_ = std::current_exception();
+      return 1;
+    }
+  }
+
+  kwordexp_t we_;
+  words *out_ = nullptr;
+  void *getenv_ = nullptr;
+  void *setenv_ = nullptr;
+  void *exec_ = nullptr;
+  void *slow_ = nullptr;
+  std::exception_ptr error_;
+};
+
+} // namespace kwe
+
+#endif
@@ -1,7 +1,9 @@
+#define _GNU_SOURCE
 #include "kio_internal.h"
 #include "kmalloc_internal.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 kin_t *kin_open(FILE *fp, const char *ibuf, size_t ibufsize) {
   kin_t *pkin = (kin_t *)kmalloc(sizeof(kin_t));
@@ -82,62 +84,154 @@ kout_t *kout_open(FILE *fp, char *obuf, size_t obufsize) {
     return NULL;
 
   pkout->kout_ofp = fp;
+  pkout->kout_bfp = NULL;
   pkout->kout_obuf = obuf;
-  pkout->kout_obufsize = obufsize;
+  pkout->kout_obuflen = 0;
+  pkout->kout_obufsize = obuf != NULL ? obufsize : 0;
   return pkout;
 }
 
+static int kout_reserve(kout_t *pkout, size_t size) {
+  size_t need = pkout->kout_obuflen + size + 1;
+  if (need <= pkout->kout_obufsize)
+    return 0;
+  size_t obufsize = pkout->kout_obufsize > 0 ? pkout->kout_obufsize : 64;
+  while (obufsize < need)
+    obufsize *= 2;
+  char *obuf = ksrealloc(pkout->kout_obuf, obufsize);
+  if (obuf == NULL)
+    return EOF;
+  pkout->kout_obuf = obuf;
+  pkout->kout_obufsize = obufsize;
+  return 0;
+}
+
+static int kout_append(kout_t *pkout, const void *buf, size_t size) {
+  if (kout_reserve(pkout, size) == EOF)
+    return EOF;
+  memcpy(pkout->kout_obuf + pkout->kout_obuflen, buf, size);
+  pkout->kout_obuflen += size;
+  pkout->kout_obuf[pkout->kout_obuflen] = '\0';
+  return 0;
+}
+
+static ssize_t kout_bfp_write(void *cookie, const char *buf, size_t size) {
+  if (kout_append(cookie, buf, size) == EOF)
+    return -1;
+  return size;
+}
+
+// Stream writes must land before anything appended directly to the buffer.
+static int kout_sync(kout_t *pkout) {
+  if (pkout->kout_bfp != NULL)
+    return fflush(pkout->kout_bfp);
+  return 0;
+}
+
 FILE *kout_getfp(kout_t *pkout) {
-  if (pkout->kout_ofp == NULL) {
-    FILE *ofp = open_memstream(&pkout->kout_obuf, &pkout->kout_obufsize);
-    if (ofp == NULL) {
+  if (pkout->kout_ofp != NULL)
+    return pkout->kout_ofp;
+  if (pkout->kout_bfp == NULL) {
+    cookie_io_functions_t io = {.write = kout_bfp_write};
+    FILE *bfp = fopencookie(pkout, "w", io);
+    if (bfp == NULL)
       return NULL;
-    }
-    pkout->kout_ofp = ofp;
+    pkout->kout_bfp = bfp;
   }
-  return pkout->kout_ofp;
+  return pkout->kout_bfp;
 }
 
 int kout_putc(kout_t *pkout, int ch) {
-  if (pkout->kout_ofp == NULL) {
-    FILE *ofp = kout_getfp(pkout);
-    if (ofp == NULL) {
-      return EOF;
-    }
-  }
-  return fputc(ch, pkout->kout_ofp);
+  if (pkout->kout_ofp != NULL)
+    return fputc(ch, pkout->kout_ofp);
+  if (kout_sync(pkout) == EOF)
+    return EOF;
+  if (pkout->kout_obuflen + 1 >= pkout->kout_obufsize &&
+      kout_reserve(pkout, 1) == EOF)
+    return EOF;
+  pkout->kout_obuf[pkout->kout_obuflen++] = ch;
+  pkout->kout_obuf[pkout->kout_obuflen] = '\0';
+  return ch & 0xff;
 }
 
 int kout_printf(kout_t *pkout, const char *format, ...) {
-  if (pkout->kout_ofp == NULL) {
-    FILE *ofp = kout_getfp(pkout);
-    if (ofp == NULL) {
-      return EOF;
-    }
-    pkout->kout_ofp = ofp;
-  }
   va_list ap;
+  if (pkout->kout_ofp != NULL) {
+    va_start(ap, format);
+    int ret = vfprintf(pkout->kout_ofp, format, ap);
+    va_end(ap);
+    return ret;
+  }
+  if (kout_sync(pkout) == EOF)
+    return EOF;
+  size_t avail = pkout->kout_obufsize - pkout->kout_obuflen;
+  char *obuf = avail > 0 ? pkout->kout_obuf + pkout->kout_obuflen : NULL;
   va_start(ap, format);
-  int ret = vfprintf(pkout->kout_ofp, format, ap);
+  int ret = vsnprintf(obuf, avail, format, ap);
   va_end(ap);
+  if (ret < 0)
+    return EOF;
+  if ((size_t)ret >= avail) {
+    if (kout_reserve(pkout, ret) == EOF)
+      return EOF;
+    va_start(ap, format);
+    ret = vsnprintf(pkout->kout_obuf + pkout->kout_obuflen, ret + 1, format,
+                    ap);
+    va_end(ap);
+    if (ret < 0)
+      return EOF;
+  }
+  pkout->kout_obuflen += ret;
   return ret;
 }
 
+int kout_write(kout_t *pkout, const void *buf, size_t size) {
+  if (pkout->kout_ofp != NULL)
+    return fwrite(buf, 1, size, pkout->kout_ofp) == size ? 0 : EOF;
+  if (kout_sync(pkout) == EOF)
+    return EOF;
+  return kout_append(pkout, buf, size);
+}
+
+const char *kout_data(kout_t *pkout, size_t *psize) {
+  if (kout_sync(pkout) == EOF)
+    return NULL;
+  if (psize != NULL)
+    *psize = pkout->kout_obuflen;
+  return pkout->kout_obuf != NULL ? pkout->kout_obuf : "";
+}
+
+int kout_reset(kout_t *pkout) {
+  if (kout_sync(pkout) == EOF)
+    return EOF;
+  pkout->kout_obuflen = 0;
+  if (pkout->kout_obuf != NULL)
+    pkout->kout_obuf[0] = '\0';
+  return 0;
+}
+
 int kout_close(kout_t *pkout, char **pbuf, size_t *psize) {
+  // a stream passed to kout_open belongs to the kout, as it always has
   if (pkout->kout_ofp != NULL) {
     int ret = fclose(pkout->kout_ofp);
+    pkout->kout_ofp = NULL;
     if (ret == EOF)
       return EOF;
-    pkout->kout_ofp = NULL;
-    if (psize != NULL)
-      *psize = pkout->kout_obufsize;
-
-    if (pbuf != NULL)
-      *pbuf = pkout->kout_obuf;
-    else
-      ksfree(pkout->kout_obuf);
   }
+  if (pkout->kout_bfp != NULL) {
+    int ret = fclose(pkout->kout_bfp);
+    pkout->kout_bfp = NULL;
+    if (ret == EOF)
+      return EOF;
+  }
+  if (psize != NULL)
+    *psize = pkout->kout_obuflen;
+  if (pbuf != NULL)
+    *pbuf = pkout->kout_obuf;
+  else if (pkout->kout_obuf != NULL)
+    ksfree(pkout->kout_obuf);
   pkout->kout_obuf = NULL;
+  pkout->kout_obuflen = 0;
   pkout->kout_obufsize = 0;
   return 0;
-}
\ No newline at end of file
+}
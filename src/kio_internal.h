@@ -16,7 +16,9 @@ struct kin {
 
 struct kout {
   FILE *kout_ofp;
+  FILE *kout_bfp;
   char *kout_obuf;
+  size_t kout_obuflen;
   size_t kout_obufsize;
 };
 
@@ -65,5 +67,13 @@ int kout_putc(kout_t *pkout, int ch)
 int kout_printf(kout_t *pkout, const char *format, ...)
     __attribute__((warn_unused_result, nonnull(1, 2), format(printf, 2, 3)));
 
+int kout_write(kout_t *pkout, const void *buf, size_t size)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+const char *kout_data(kout_t *pkout, size_t *psize)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kout_reset(kout_t *pkout) __attribute__((warn_unused_result, nonnull(1)));
+
 int kout_close(kout_t *pkout, char **pbuf, size_t *psize)
     __attribute__((warn_unused_result, nonnull(1)));
\ No newline at end of file
@@ -2,20 +2,49 @@
 #include <gc.h>
 #include <string.h>
 
+static __thread kmalloc_tally_t *kmalloc_ptally;
+
+kmalloc_tally_t *kmalloc_tally(kmalloc_tally_t *tally) {
+  kmalloc_tally_t *prev = kmalloc_ptally;
+  kmalloc_ptally = tally;
+  return prev;
+}
+
+static inline void kmalloc_count(size_t size) {
+  kmalloc_tally_t *ptally = kmalloc_ptally;
+  if (ptally != NULL) {
+    ptally->kmt_count++;
+    ptally->kmt_bytes += size;
+  }
+}
+
 // Memory allocation functions
 
-void *kmalloc(size_t size) { return GC_malloc(size); }
-void *kmalloc_atomic(size_t size) { return GC_malloc_atomic(size); }
-void *krealloc(void *ptr, size_t size) { return GC_realloc(ptr, size); }
+void *kmalloc(size_t size) {
+  kmalloc_count(size);
+  return GC_malloc(size);
+}
+void *kmalloc_atomic(size_t size) {
+  kmalloc_count(size);
+  return GC_malloc_atomic(size);
+}
+void *krealloc(void *ptr, size_t size) {
+  kmalloc_count(size);
+  return GC_realloc(ptr, size);
+}
 void kfree(void *ptr) { (void)ptr; }
-char *kstrdup(const char *s) { return GC_strdup(s); }
+char *kstrdup(const char *s) {
+  kmalloc_count(strlen(s) + 1);
+  return GC_strdup(s);
+}
 
 #ifdef REPLACE_SYSTEM_ALLOC
 // REPLACE SYSTEM ALLOC
-void *malloc(size_t size) { return kmalloc(size); }
-void *realloc(void *ptr, size_t size) { return krealloc(ptr, size); }
+// these bypass the tally, so ks* allocations are counted once
+void *malloc(size_t size) { return GC_malloc(size); }
+void *realloc(void *ptr, size_t size) { return GC_realloc(ptr, size); }
 void free(void *ptr) { (void)ptr; }
-void *calloc(size_t nmemb, size_t size) { return kmalloc(nmemb * size); }
+void *calloc(size_t nmemb, size_t size) { return GC_malloc(nmemb * size); }
 #else
 // USE SYSTEM ALLOC
 void *malloc(size_t size);
@@ -26,8 +55,20 @@ void *calloc(size_t nmemb, size_t size);
 
 // Memory allocation functions
 
-void *ksmalloc(size_t size) { return malloc(size); }
-void *ksmalloc_atomic(size_t size) { return malloc(size); }
-void *ksrealloc(void *ptr, size_t size) { return realloc(ptr, size); }
+void *ksmalloc(size_t size) {
+  kmalloc_count(size);
+  return malloc(size);
+}
+void *ksmalloc_atomic(size_t size) {
+  kmalloc_count(size);
+  return malloc(size);
+}
+void *ksrealloc(void *ptr, size_t size) {
+  kmalloc_count(size);
+  return realloc(ptr, size);
+}
 void ksfree(void *ptr) { free(ptr); }
-char *ksstrdup(const char *s) { return strdup(s); }
\ No newline at end of file
+char *ksstrdup(const char *s) {
+  kmalloc_count(strlen(s) + 1);
+  return strdup(s);
+}
\ No newline at end of file
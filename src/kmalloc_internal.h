@@ -18,4 +18,6 @@ void *ksmalloc_atomic(size_t size) __attribute__((warn_unused_result));
 void *ksrealloc(void *ptr, size_t size)
     __attribute__((warn_unused_result));
 void ksfree(void *ptr) __attribute__((nonnull(1)));
-char *ksstrdup(const char *s) __attribute__((warn_unused_result));
\ No newline at end of file
+char *ksstrdup(const char *s) __attribute__((warn_unused_result));
+
+kmalloc_tally_t *kmalloc_tally(kmalloc_tally_t *tally);
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 int kwei_isspace(int ch, const char *ifs) {
@@ -22,8 +23,98 @@ int kwei_isspace(int ch, const char *ifs) {
   return 0;
 }
 
-kwordexp_internal_t kwei_init(kwordexp_t *pkwe, kin_t *pkin, kout_t *pkout,
-                              int flags) {
+int kwei_ismeta(int ch) {
+  switch (ch) {
+  case '\\':
+  case '*':
+  case '?':
+  case '[':
+  case ']':
+  case '{':
+  case '}':
+  case ',':
+  case '~':
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+kwei_status_t kwei_put_literal(kwordexp_internal_t *pkwei, const char *value,
+                               size_t len) {
+  pkwei->kwei_has_arg = 1;
+  const char *end = value + len;
+  while (value < end) {
+    const char *p = value;
+    while (p < end && !kwei_ismeta((unsigned char)*p))
+      p++;
+    int ret = kout_write(pkwei->kwei_pout, value, p - value);
+    if (ret != EOF && p < end) {
+      // keep pattern characters from being taken as active ones later
+      pkwei->kwei_has_escape = 1;
+      ret = kout_putc(pkwei->kwei_pout, '\\');
+      if (ret != EOF)
+        ret = kout_putc(pkwei->kwei_pout, *p++);
+    }
+    if (ret == EOF) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    value = p;
+  }
+  return KSSUCCESS;
+}
+
+// ----------------------------------------------------------------
+// Statistics
+// ----------------------------------------------------------------
+
+// The metrics alone make do with the coarse clock, which costs a memory read
+// rather than a hardware counter read; kwe_stats and kwe_slow get the exact
+// one.
+static uint64_t kwei_clock_now(int exact) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(exact ? CLOCK_MONOTONIC : CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  (void)exact;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t kwei_stats_now(void) { return kwei_clock_now(1); }
+
+// Reset pstats and start tallying the allocations of this thread. Returns
+// the tally that was installed before.
+static kmalloc_tally_t *kwei_stats_begin(kwordexp_stats_t *pstats,
+                                         kmalloc_tally_t *ptally) {
+  memset(pstats, 0, sizeof(*pstats));
+  ptally->kmt_count = 0;
+  ptally->kmt_bytes = 0;
+  return kmalloc_tally(ptally);
+}
+
+static void kwei_stats_end(kwordexp_stats_t *pstats, kmalloc_tally_t *ptally,
+                           kmalloc_tally_t *pprev, uint64_t elapsed) {
+  kmalloc_tally(pprev);
+  if (pprev != NULL) {
+    pprev->kmt_count += ptally->kmt_count;
+    pprev->kmt_bytes += ptally->kmt_bytes;
+  }
+  pstats->kws_allocs = ptally->kmt_count;
+  pstats->kws_allocbytes = ptally->kmt_bytes;
+  pstats->kws_total_ns = elapsed;
+  uint64_t spent =
+      pstats->kws_getenv_ns + pstats->kws_glob_ns + pstats->kws_exec_ns;
+  pstats->kws_parse_ns =
+      pstats->kws_total_ns > spent ? pstats->kws_total_ns - spent : 0;
+}
+
+static kwordexp_internal_t kwei_init_state(kwordexp_t *pkwe, kin_t *pkin,
+                                           kout_t *pkout, int flags) {
   kwordexp_internal_t kwei;
   kwei.kwei_pwe = pkwe;
   kwei.kwei_pin = pkin;
@@ -31,28 +122,176 @@ kwordexp_internal_t kwei_init(kwordexp_t *pkwe, kin_t *pkin, kout_t *pkout,
   kwei.kwei_flags = flags;
   kwei.kwei_has_arg = 0;
   kwei.kwei_has_pattern = 0;
+  kwei.kwei_has_brace = 0;
+  kwei.kwei_has_escape = 0;
+  kwei.kwei_nbrace = 0;
   kwei.kwei_errno = 0;
   kwei.kwei_errex = KENONE;
   kwei.kwei_status = KSSUCCESS;
+  kwei.kwei_quoted = 0;
+  kwei.kwei_ifsdelim = 0;
+  kwei.kwei_term = 0;
+  kwei.kwei_rawword = 0;
+  kwei.kwei_dquote = 0;
+  kwei.kwei_brace_level = 0;
+  kwei.kwei_bracket_level = 0;
+  kwei.kwei_paren_level = 0;
+  kwei.kwei_wordcap = pkwe->kwe_wordv != NULL ? pkwe->kwe_wordc + 1 : 0;
+  kwei.kwei_vars = NULL;
+  kwei.kwei_deps = NULL;
+  kwei.kwei_info = NULL;
+  kwei.kwei_into = NULL;
+  kwei.kwei_sink = NULL;
+  kwei.kwei_sinkdata = NULL;
+  kwei.kwei_scratch = NULL;
+  kwei.kwei_scratchsize = 0;
+  kwei.kwei_outbytes = 0;
+  kwei.kwei_frames = NULL;
+  kwei.kwei_depth = 0;
+  return kwei;
+}
+
+kwordexp_internal_t kwei_init(kwordexp_t *pkwe, kin_t *pkin, kout_t *pkout,
+                              int flags, const kwei_vars_t *pvars) {
+  kwordexp_internal_t kwei = kwei_init_state(pkwe, pkin, pkout, flags);
+  kwei.kwei_vars = pvars;
   char *ifs;
   kwei_status_t kstat = kwei_getenv(&kwei, "IFS", &ifs);
   if (kstat != KSSUCCESS || ifs == NULL)
     ifs = " \f\n\r\t\v";
   kwei.kwei_ifs = ifs;
+  memset(kwei.kwei_ifsmap, 0, sizeof(kwei.kwei_ifsmap));
+  for (const unsigned char *p = (const unsigned char *)ifs; *p != '\0'; p++)
+    kwei.kwei_ifsmap[*p] = isspace(*p) ? KWEI_IFS_SPACE : KWEI_IFS_DELIM;
+  return kwei;
+}
+
+// Nested parsers share the input, IFS and resolved variables of the parent.
+kwordexp_internal_t kwei_init_sub(const kwordexp_internal_t *pparent,
+                                  kwordexp_t *pkwe, kout_t *pkout) {
+  kwordexp_internal_t kwei = kwei_init_state(
+      pkwe, pparent->kwei_pin, pkout, pparent->kwei_flags);
+  kwei.kwei_vars = pparent->kwei_vars;
+  kwei.kwei_deps = pparent->kwei_deps;
+  kwei.kwei_info = pparent->kwei_info;
+  kwei.kwei_frames = pparent->kwei_frames;
+  kwei.kwei_depth = pparent->kwei_depth + 1;
+  kwei.kwei_ifs = pparent->kwei_ifs;
+  memcpy(kwei.kwei_ifsmap, pparent->kwei_ifsmap, sizeof(kwei.kwei_ifsmap));
   return kwei;
 }
 
+static void kwei_frames_init(kwei_frames_t *pkf, const kwordexp_t *pkwe) {
+  pkf->kwf_framev = NULL;
+  pkf->kwf_framec = 0;
+  pkf->kwf_max = pkwe->kwe_depth_max > 0 ? pkwe->kwe_depth_max : KWEI_DEPTH_MAX;
+}
+
+static void kwei_frames_free(kwei_frames_t *pkf) {
+  for (size_t i = 0; i < pkf->kwf_framec; i++) {
+    kwei_frame_t *pframe = pkf->kwf_framev[i];
+    if (pframe == NULL)
+      continue;
+    int ret = kout_close(pframe->kf_out, NULL, NULL);
+    (void)ret;
+    ksfree(pframe);
+  }
+  if (pkf->kwf_framev != NULL)
+    ksfree(pkf->kwf_framev);
+}
+
+// Set up the parser nested one level below pkwei in the frame of that
+// depth, which is reused by the next parser there. The caller either runs
+// it with kwei_parse or returns KSNEST to have its own kwei_parse run it.
+static kwei_frame_t *kwei_frame_push(kwordexp_internal_t *pkwei,
+                                     kwei_frame_kind_t kind) {
+  kwei_frames_t *pkf = pkwei->kwei_frames;
+  size_t depth = pkwei->kwei_depth;
+  if (depth >= pkf->kwf_max) {
+    pkwei->kwei_errno = ELOOP;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return NULL;
+  }
+  if (depth >= pkf->kwf_framec) {
+    size_t framec = pkf->kwf_framec > 0 ? pkf->kwf_framec * 2 : 8;
+    if (framec > pkf->kwf_max)
+      framec = pkf->kwf_max;
+    kwei_frame_t **framev =
+        ksrealloc(pkf->kwf_framev, framec * sizeof(kwei_frame_t *));
+    if (framev == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return NULL;
+    }
+    for (size_t i = pkf->kwf_framec; i < framec; i++)
+      framev[i] = NULL;
+    pkf->kwf_framev = framev;
+    pkf->kwf_framec = framec;
+  }
+  kwei_frame_t *pframe = pkf->kwf_framev[depth];
+  if (pframe == NULL) {
+    pframe = ksmalloc(sizeof(kwei_frame_t));
+    if (pframe == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return NULL;
+    }
+    pframe->kf_out = kout_open(NULL, NULL, 0);
+    if (pframe->kf_out == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      ksfree(pframe);
+      return NULL;
+    }
+    pkf->kwf_framev[depth] = pframe;
+  }
+  if (kout_reset(pframe->kf_out) == EOF) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return NULL;
+  }
+  kwe_init(&pframe->kf_we, pkwei->kwei_pwe->kwe_argv,
+           pkwei->kwei_pwe->kwe_argc);
+  kwe_copy(&pframe->kf_we, pkwei->kwei_pwe);
+  pframe->kf_wei = kwei_init_sub(pkwei, &pframe->kf_we, pframe->kf_out);
+  pframe->kf_wei.kwei_term = kind == KWEI_FRAME_CMDSUB ? ')' : '}';
+  pframe->kf_parent = pkwei;
+  pframe->kf_kind = kind;
+  pframe->kf_name = NULL;
+  pframe->kf_op = 0;
+  pframe->kf_longest = 0;
+  return pframe;
+}
+
 void kwe_init(kwordexp_t *pkwe, char **argv, size_t argc) {
   pkwe->kwe_wordv = NULL;
   pkwe->kwe_wordc = 0;
+  pkwe->kwe_words = NULL;
   pkwe->kwe_argv = argv;
   pkwe->kwe_argc = argc;
   pkwe->kwe_last_status = 0;
   pkwe->kwe_last_bgpid = 0;
   pkwe->kwe_last_arg = NULL;
   pkwe->kwe_exec = NULL;
+  pkwe->kwe_glob = NULL;
+  pkwe->kwe_glob_max = 0;
+  pkwe->kwe_depth_max = 0;
+  pkwe->kwe_readdir = NULL;
+  pkwe->kwe_word = NULL;
+  pkwe->kwe_stats = NULL;
+  pkwe->kwe_slow = NULL;
+  pkwe->kwe_slow_ns = 0;
+  pkwe->kwe_cache = NULL;
+  pkwe->kwe_shcache = NULL;
   pkwe->kwe_getenv = NULL;
+  pkwe->kwe_getenvv = NULL;
   pkwe->kwe_setenv = NULL;
+  pkwe->kwe_env = NULL;
   pkwe->kwe_data = NULL;
 }
 
@@ -63,8 +302,20 @@ void kwe_copy(kwordexp_t *pkwe, const kwordexp_t *pother) {
   pkwe->kwe_last_bgpid = pother->kwe_last_bgpid;
   pkwe->kwe_last_arg = pother->kwe_last_arg;
   pkwe->kwe_exec = pother->kwe_exec;
+  pkwe->kwe_glob = pother->kwe_glob;
+  pkwe->kwe_glob_max = pother->kwe_glob_max;
+  pkwe->kwe_depth_max = pother->kwe_depth_max;
+  pkwe->kwe_readdir = pother->kwe_readdir;
+  pkwe->kwe_word = pother->kwe_word;
+  pkwe->kwe_stats = pother->kwe_stats;
+  pkwe->kwe_slow = pother->kwe_slow;
+  pkwe->kwe_slow_ns = pother->kwe_slow_ns;
+  pkwe->kwe_cache = pother->kwe_cache;
+  pkwe->kwe_shcache = pother->kwe_shcache;
   pkwe->kwe_getenv = pother->kwe_getenv;
+  pkwe->kwe_getenvv = pother->kwe_getenvv;
   pkwe->kwe_setenv = pother->kwe_setenv;
+  pkwe->kwe_env = pother->kwe_env;
   pkwe->kwe_data = pother->kwe_data;
 }
 
@@ -73,6 +324,230 @@ void kwe_free(kwordexp_t *pkwe) {
     kfree(pkwe->kwe_wordv);
     pkwe->kwe_wordv = NULL;
   }
+  if (pkwe->kwe_words != NULL) {
+    kwei_words_free(pkwe->kwe_words);
+    pkwe->kwe_words = NULL;
+  }
+}
+
+// Store a word into the caller's buffer, or only count it once the buffer
+// is full so that the caller learns the size it needs.
+static void kwei_into_put(kwei_into_t *pki, const char *word, size_t len,
+                          int unescape) {
+  size_t off = pki->kwi_len;
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (unescape && word[i] == '\\' && i + 1 < len)
+      i++;
+    if (off + n < pki->kwi_cap)
+      pki->kwi_buf[off + n] = word[i];
+    n++;
+  }
+  if (off + n < pki->kwi_cap)
+    pki->kwi_buf[off + n] = '\0';
+  pki->kwi_len = off + n + 1;
+  if (pki->kwi_wordc < pki->kwi_maxwords)
+    pki->kwi_offv[pki->kwi_wordc] = off;
+  pki->kwi_wordc++;
+}
+
+// Hand a finished word to the sink. Words that need a copy go through one
+// scratch buffer reused for the whole expansion.
+static kwei_status_t kwei_stream_put(kwordexp_internal_t *pkwei,
+                                     const char *word, size_t len, int copy,
+                                     int unescape) {
+  if (copy) {
+    if (len + 1 > pkwei->kwei_scratchsize) {
+      char *scratch = ksrealloc(pkwei->kwei_scratch, len + 1);
+      if (scratch == NULL) {
+        pkwei->kwei_errno = errno;
+        pkwei->kwei_errex = KESYSTEM;
+        pkwei->kwei_status = KSERROR;
+        return KSERROR;
+      }
+      pkwei->kwei_scratch = scratch;
+      pkwei->kwei_scratchsize = len + 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (unescape && word[i] == '\\' && i + 1 < len)
+        i++;
+      pkwei->kwei_scratch[n++] = word[i];
+    }
+    pkwei->kwei_scratch[n] = '\0';
+    word = pkwei->kwei_scratch;
+    len = n;
+  }
+  if (pkwei->kwei_pwe->kwe_stats != NULL)
+    pkwei->kwei_pwe->kwe_stats->kws_words++;
+  pkwei->kwei_outbytes += len + 1;
+  return pkwei->kwei_sink(pkwei, word, len);
+}
+
+kwei_status_t kwei_sink_word(kwordexp_internal_t *pkwei, const char *word,
+                             size_t len) {
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  return pkwe->kwe_word(pkwe->kwe_data, word, len) != 0 ? KSSTOP : KSSUCCESS;
+}
+
+// KWRDE_COMPACT: the word goes into the kwordexp_words_t
+static kwei_status_t kwei_words_put(kwordexp_internal_t *pkwei,
+                                    const char *word, size_t len) {
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  if (kwei_words_add(pkwe->kwe_words, word, len) != 0) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  pkwe->kwe_wordc++;
+  return KSSUCCESS;
+}
+
+kwei_status_t kwei_append_word(kwordexp_internal_t *pkwei, char *word) {
+  if (pkwei->kwei_into != NULL) {
+    kwei_into_put(pkwei->kwei_into, word, strlen(word), 0);
+    return KSSUCCESS;
+  }
+  if (pkwei->kwei_sink != NULL)
+    return kwei_stream_put(pkwei, word, strlen(word), 0, 0);
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  if (pkwe->kwe_words != NULL)
+    return kwei_words_put(pkwei, word, strlen(word));
+  size_t wordc = pkwe->kwe_wordc;
+  if (wordc + 2 > pkwei->kwei_wordcap) {
+    size_t wordcap = pkwei->kwei_wordcap > 4 ? pkwei->kwei_wordcap * 2 : 8;
+    char **wordv = krealloc(pkwe->kwe_wordv, wordcap * sizeof(char *));
+    if (wordv == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    pkwe->kwe_wordv = wordv;
+    pkwei->kwei_wordcap = wordcap;
+  }
+  pkwe->kwe_wordv[wordc] = word;
+  pkwe->kwe_wordv[wordc + 1] = NULL;
+  pkwe->kwe_wordc = wordc + 1;
+  return KSSUCCESS;
+}
+
+kwei_status_t kwei_add_word(kwordexp_internal_t *pkwei, const char *word,
+                           size_t len) {
+  if (pkwei->kwei_into != NULL) {
+    kwei_into_put(pkwei->kwei_into, word, len, 0);
+    return KSSUCCESS;
+  }
+  if (pkwei->kwei_sink != NULL)
+    return kwei_stream_put(pkwei, word, len, 1, 0);
+  if (pkwei->kwei_pwe->kwe_words != NULL)
+    return kwei_words_put(pkwei, word, len);
+  char *copy = kmalloc_atomic(len + 1);
+  if (copy == NULL) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  memcpy(copy, word, len);
+  copy[len] = '\0';
+  return kwei_append_word(pkwei, copy);
+}
+
+kwei_status_t kwei_add_word_unescape(kwordexp_internal_t *pkwei,
+                                    const char *word, size_t len) {
+  if (pkwei->kwei_into != NULL) {
+    kwei_into_put(pkwei->kwei_into, word, len, 1);
+    return KSSUCCESS;
+  }
+  if (pkwei->kwei_sink != NULL)
+    return kwei_stream_put(pkwei, word, len, 1, 1);
+  char *copy = kmalloc_atomic(len + 1);
+  if (copy == NULL) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (word[i] == '\\' && i + 1 < len)
+      i++;
+    copy[n++] = word[i];
+  }
+  copy[n] = '\0';
+  return kwei_append_word(pkwei, copy);
+}
+
+// Length of the leading run of value that contains no IFS character.
+static size_t kwei_ifs_span(kwordexp_internal_t *pkwei, const char *value,
+                            const char *end) {
+  size_t n = 0;
+  while (value + n < end) {
+    n += strcspn(value + n, pkwei->kwei_ifs);
+    if (value + n >= end || value[n] != '\0')
+      break;
+    n++;
+  }
+  return value + n < end ? n : (size_t)(end - value);
+}
+
+kwei_status_t kwei_put_value(kwordexp_internal_t *pkwei, const char *value,
+                             size_t len) {
+  if (pkwei->kwei_quoted || pkwei->kwei_ifs[0] == '\0') {
+    if (len == 0)
+      return KSSUCCESS;
+    return kwei_put_literal(pkwei, value, len);
+  }
+
+  const char *end = value + len;
+  while (value < end) {
+    size_t n = kwei_ifs_span(pkwei, value, end);
+    int term = pkwei->kwei_has_arg;
+    if (n > 0) {
+      if (!pkwei->kwei_has_arg && value + n < end) {
+        // a whole field: bypass the output stream
+        kwei_status_t kstat = kwei_add_word(pkwei, value, n);
+        if (kstat != KSSUCCESS)
+          return kstat;
+        term = 1;
+      } else {
+        kwei_status_t kstat = kwei_put_literal(pkwei, value, n);
+        if (kstat != KSSUCCESS)
+          return kstat;
+        term = 1;
+      }
+      value += n;
+      if (value >= end)
+        break;
+    }
+
+    int ifsdelim = pkwei->kwei_ifsdelim;
+    if (pkwei->kwei_has_arg) {
+      kwei_status_t kstat = kwei_push_word(pkwei);
+      if (kstat != KSSUCCESS)
+        return kstat;
+    }
+    if (pkwei->kwei_ifsmap[(unsigned char)*value] & KWEI_IFS_SPACE) {
+      pkwei->kwei_ifsdelim = term || ifsdelim;
+    } else {
+      if (!term && !ifsdelim) {
+        kwei_status_t kstat = kwei_add_word(pkwei, "", 0);
+        if (kstat != KSSUCCESS)
+          return kstat;
+      }
+      pkwei->kwei_ifsdelim = 0;
+    }
+    value++;
+  }
+  return KSSUCCESS;
+}
+
+kwei_status_t kwei_put_string(kwordexp_internal_t *pkwei, const char *value) {
+  if (value == NULL)
+    return KSSUCCESS;
+  return kwei_put_value(pkwei, value, strlen(value));
 }
 
 kwei_status_t kwei_parse_squote(kwordexp_internal_t *pkwei) {
@@ -95,24 +570,157 @@ kwei_status_t kwei_parse_squote(kwordexp_internal_t *pkwei) {
       return KSSUCCESS;
 
     default: {
-      int ret = kout_putc(pkwei->kwei_pout, ch);
-      if (ret == -1) {
-        pkwei->kwei_errno = errno;
-        pkwei->kwei_errex = KESYSTEM;
-        pkwei->kwei_status = KSERROR;
-        return KSERROR;
-      }
+      char c = ch;
+      kwei_status_t kstat = kwei_put_literal(pkwei, &c, 1);
+      if (kstat != KSSUCCESS)
+        return kstat;
     }
     }
   }
 }
 
+// ----------------------------------------------------------------
+// Analysis: record what an expansion would touch instead of doing it
+// ----------------------------------------------------------------
+
+static void kwei_info_set(kwordexp_internal_t *pkwei, int flag) {
+  if (pkwei->kwei_info != NULL)
+    pkwei->kwei_info->kwi_flags |= flag;
+}
+
+static kwei_status_t kwei_info_var(kwordexp_internal_t *pkwei,
+                                   const char *name) {
+  kwordexp_info_t *pinfo = pkwei->kwei_info;
+  for (size_t i = 0; i < pinfo->kwi_varc; i++)
+    if (strcmp(pinfo->kwi_varv[i], name) == 0)
+      return KSSUCCESS;
+  char **varv =
+      krealloc(pinfo->kwi_varv, (pinfo->kwi_varc + 2) * sizeof(char *));
+  char *copy = varv != NULL ? kstrdup(name) : NULL;
+  if (copy == NULL) {
+    if (varv != NULL)
+      pinfo->kwi_varv = varv;
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  varv[pinfo->kwi_varc++] = copy;
+  varv[pinfo->kwi_varc] = NULL;
+  pinfo->kwi_varv = varv;
+  return KSSUCCESS;
+}
+
+static int kwei_vars_cmp(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Collect the names referenced as $NAME or ${NAME in ibuf, plus IFS, and
+// resolve them with a single kwe_getenvv call. Names that are missed here,
+// such as bare names in arithmetic, still go through kwei_getenv one by one.
+static int kwei_vars_load(kwordexp_t *pkwe, const char *ibuf, size_t len,
+                          kwei_vars_t *pvars) {
+  const char *end = ibuf + len;
+  char *blob = kmalloc_atomic(len + sizeof("IFS"));
+  const char **keyv = kmalloc((len / 2 + 2) * sizeof(const char *));
+  if (blob == NULL || keyv == NULL)
+    return -1;
+  size_t count = 0;
+  memcpy(blob, "IFS", sizeof("IFS"));
+  keyv[count++] = blob;
+  char *p = blob + sizeof("IFS");
+  for (const char *q = memchr(ibuf, '$', len); q != NULL;
+       q = memchr(q, '$', end - q)) {
+    q++;
+    if (q < end && *q == '{')
+      q++;
+    if (q == end || (!isalpha((unsigned char)*q) && *q != '_'))
+      continue;
+    keyv[count++] = p;
+    while (q < end && (isalnum((unsigned char)*q) || *q == '_'))
+      *p++ = *q++;
+    *p++ = '\0';
+  }
+  qsort(keyv, count, sizeof(const char *), kwei_vars_cmp);
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++)
+    if (n == 0 || strcmp(keyv[n - 1], keyv[i]) != 0)
+      keyv[n++] = keyv[i];
+  char **valuev = kmalloc(n * sizeof(char *));
+  if (valuev == NULL)
+    return -1;
+  memset(valuev, 0, n * sizeof(char *));
+  uint64_t start = pkwe->kwe_stats != NULL ? kwei_stats_now() : 0;
+  int ret = pkwe->kwe_getenvv(pkwe->kwe_data, keyv, valuev, n);
+  if (pkwe->kwe_stats != NULL)
+    pkwe->kwe_stats->kws_getenv_ns += kwei_stats_now() - start;
+  if (ret < 0)
+    return -1;
+  pvars->kwv_count = n;
+  pvars->kwv_keyv = keyv;
+  pvars->kwv_valuev = valuev;
+  return 0;
+}
+
 kwei_status_t kwei_getenv(kwordexp_internal_t *pkwei, const char *key,
                           char **pvalue) {
+  if (pkwei->kwei_info != NULL) {
+    // a nonzero placeholder keeps arithmetic such as $((1/X)) from failing
+    *pvalue = "1";
+    return kwei_info_var(pkwei, key);
+  }
+  kwei_deps_var(pkwei, key);
+  KWEI_PROBE1(lookup, key);
+  kwordexp_stats_t *pstats = pkwei->kwei_pwe->kwe_stats;
+  if (pstats != NULL)
+    pstats->kws_lookups++;
+  const kwei_vars_t *pvars = pkwei->kwei_vars;
+  if (pvars != NULL) {
+    const char **pkey = bsearch(&key, pvars->kwv_keyv, pvars->kwv_count,
+                                sizeof(const char *), kwei_vars_cmp);
+    if (pkey != NULL) {
+      *pvalue = pvars->kwv_valuev[pkey - pvars->kwv_keyv];
+      return KSSUCCESS;
+    }
+  }
   kwordexp_getenv_t getenv = pkwei->kwei_pwe->kwe_getenv;
+  if (getenv == NULL && pkwei->kwei_pwe->kwe_env != NULL) {
+    *pvalue = (char *)kwordexp_env_get(pkwei->kwei_pwe->kwe_env, key);
+    return KSSUCCESS;
+  }
   if (getenv == NULL)
     getenv = kwordexp_getenv_default;
+  uint64_t start = pstats != NULL ? kwei_stats_now() : 0;
   int ret = getenv(pkwei->kwei_pwe->kwe_data, key, pvalue);
+  if (pstats != NULL)
+    pstats->kws_getenv_ns += kwei_stats_now() - start;
+  if (ret < 0) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  return KSSUCCESS;
+}
+
+kwei_status_t kwei_setenv(kwordexp_internal_t *pkwei, const char *key,
+                          char *value, int overwrite) {
+  if (pkwei->kwei_info != NULL) {
+    kwei_info_set(pkwei, KWRDI_ASSIGN);
+    return KSSUCCESS;
+  }
+  // assignments are side effects that a cached result would skip
+  kwei_deps_volatile(pkwei);
+  kwordexp_setenv_t setenv = pkwei->kwei_pwe->kwe_setenv;
+  kwordexp_env_t *env = pkwei->kwei_pwe->kwe_env;
+  int ret;
+  if (setenv == NULL && env != NULL)
+    ret = !overwrite && kwordexp_env_get(env, key) != NULL
+              ? 0
+              : kwordexp_env_set(env, key, value);
+  else
+    ret = (setenv != NULL ? setenv : kwordexp_setenv_default)(
+        pkwei->kwei_pwe->kwe_data, key, value, overwrite);
   if (ret < 0) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
@@ -123,13 +731,29 @@ kwei_status_t kwei_getenv(kwordexp_internal_t *pkwei, const char *key,
 }
 
 kwei_status_t kwei_exec(kwordexp_internal_t *pkwei, char **argv, FILE *ofp) {
+  if (pkwei->kwei_info != NULL) {
+    kwei_info_set(pkwei, KWRDI_CMDSUB);
+    return KSSUCCESS;
+  }
+  kwei_deps_volatile(pkwei);
   kwordexp_exec_t exec = pkwei->kwei_pwe->kwe_exec;
   void *data = pkwei->kwei_pwe->kwe_data;
   if (exec == NULL) {
     exec = kwordexp_exec_default;
     data = pkwei;
   }
+  kwordexp_stats_t *pstats = pkwei->kwei_pwe->kwe_stats;
+  int timed = pstats != NULL || kwei_metrics_enabled();
+  KWEI_PROBE1(exec__start, argv[0]);
+  uint64_t start = timed ? kwei_clock_now(pstats != NULL) : 0;
   int ret = exec(data, argv, ofp);
+  uint64_t elapsed = timed ? kwei_clock_now(pstats != NULL) - start : 0;
+  KWEI_PROBE3(exec__done, argv[0], ret, elapsed);
+  kwei_metrics_record(KWEI_METRIC_CMDSUB, elapsed);
+  if (pstats != NULL) {
+    pstats->kws_execs++;
+    pstats->kws_exec_ns += elapsed;
+  }
   if (ret < 0) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
@@ -140,27 +764,30 @@ kwei_status_t kwei_exec(kwordexp_internal_t *pkwei, char **argv, FILE *ofp) {
   return KSSUCCESS;
 }
 
-kwei_status_t kwei_parse_var_paren(kwordexp_internal_t *pkwei) {
-  kout_t *pkout_cmd = kout_open(NULL, NULL, 0);
-  if (pkout_cmd == NULL) {
-    pkwei->kwei_errno = errno;
-    pkwei->kwei_errex = KESYSTEM;
-    pkwei->kwei_status = KSERROR;
-    return KSERROR;
-  }
-  kwordexp_t kwe_cmd;
-  kwe_init(&kwe_cmd, pkwei->kwei_pwe->kwe_argv, pkwei->kwei_pwe->kwe_argc);
-  kwe_copy(&kwe_cmd, pkwei->kwei_pwe);
-  kwordexp_internal_t kwei_cmd =
-      kwei_init(&kwe_cmd, pkwei->kwei_pin, pkout_cmd, pkwei->kwei_flags);
-  kwei_status_t kstat = kwei_parse(&kwei_cmd);
-  if (kstat != KSSUCCESS) {
-    int ret = kout_close(pkout_cmd, NULL, NULL);
-    (void)ret;
-    kwe_free(&kwe_cmd);
-    return kstat;
-  }
+// The shared cache key of a command: its words, each NUL-terminated
+static char *kwei_cmd_key(char **argv, size_t *plen) {
+  size_t len = 0;
+  for (char **parg = argv; *parg != NULL; parg++)
+    len += strlen(*parg) + 1;
+  char *key = ksmalloc(len);
+  if (key == NULL)
+    return NULL;
+  char *p = key;
+  for (char **parg = argv; *parg != NULL; parg++)
+    p = stpcpy(p, *parg) + 1;
+  *plen = len;
+  return key;
+}
 
+// Run the command whose words the parser in pframe has collected. *poutput
+// is left pointing at its output without trailing newlines, which stays
+// valid until the next parser nested at the same depth.
+static kwei_status_t kwei_cmdsub_end(kwordexp_internal_t *pkwei,
+                                     kwei_frame_t *pframe,
+                                     const char **poutput, size_t *plen) {
+  *poutput = "";
+  *plen = 0;
+  kwordexp_t *pkwe_cmd = &pframe->kf_we;
   int ch = kin_getc_while(pkwei->kwei_pin, kwei_isspace, pkwei->kwei_ifs);
 
   if (ch == EOF) {
@@ -175,48 +802,386 @@ kwei_status_t kwei_parse_var_paren(kwordexp_internal_t *pkwei) {
   if (ch != ')') {
     pkwei->kwei_errex = KESYNTAX;
     pkwei->kwei_status = KSERROR;
-    int ret = kout_close(pkout_cmd, NULL, NULL);
-    (void)ret;
-    kwe_free(&kwe_cmd);
+    kwe_free(pkwe_cmd);
     return KSERROR;
   }
 
-  FILE *ofp = kout_getfp(pkwei->kwei_pout);
+  if (pkwe_cmd->kwe_wordc == 0) {
+    kwordfree(pkwe_cmd);
+    return KSSUCCESS;
+  }
+
+  // the command words are no longer needed; reuse the buffer for its output
+  kout_t *pkout_cmd = pframe->kf_out;
+  int ret = kout_reset(pkout_cmd);
+  FILE *ofp = ret == EOF ? NULL : kout_getfp(pkout_cmd);
   if (ofp == NULL) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
     pkwei->kwei_status = KSERROR;
-    int ret = kout_close(pkout_cmd, NULL, NULL);
-    (void)ret;
-    kwe_free(&kwe_cmd);
+    kwe_free(pkwe_cmd);
     return KSERROR;
   }
-  kstat = kwei_exec(pkwei, kwei_cmd.kwei_pwe->kwe_wordv, ofp);
-  int ret = kout_close(pkout_cmd, NULL, NULL);
-  (void)ret;
-  kwordfree(&kwe_cmd);
+
+  kwei_status_t kstat = KSSUCCESS;
+  kwordexp_shcache_t *pshc =
+      pkwei->kwei_info == NULL ? pkwei->kwei_pwe->kwe_shcache : NULL;
+  size_t keylen = 0;
+  char *key = pshc != NULL ? kwei_cmd_key(pkwe_cmd->kwe_wordv, &keylen) : NULL;
+  char *cached = NULL;
+  size_t len;
+  if (key != NULL) {
+    int64_t status;
+    cached =
+        kwei_shcache_get(pshc, KWEI_SHCACHE_CMD, key, keylen, &len, &status);
+    if (cached != NULL) {
+      kwei_deps_volatile(pkwei);
+      pkwei->kwei_pwe->kwe_last_status = status;
+      if (fwrite(cached, 1, len, ofp) != len) {
+        pkwei->kwei_errno = errno;
+        pkwei->kwei_errex = KESYSTEM;
+        pkwei->kwei_status = KSERROR;
+        kstat = KSERROR;
+      }
+    }
+  }
+  if (cached == NULL)
+    kstat = kwei_exec(pkwei, pkwe_cmd->kwe_wordv, ofp);
+  if (kstat == KSSUCCESS) {
+    const char *output = kout_data(pkout_cmd, &len);
+    if (output == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      kstat = KSERROR;
+    } else {
+      if (pkwei->kwei_pwe->kwe_stats != NULL)
+        pkwei->kwei_pwe->kwe_stats->kws_readbytes += len;
+      if (key != NULL && cached == NULL)
+        kwei_shcache_put(pshc, KWEI_SHCACHE_CMD, key, keylen, output, len,
+                         pkwei->kwei_pwe->kwe_last_status);
+      while (len > 0 && output[len - 1] == '\n')
+        len--;
+      *poutput = output;
+      *plen = len;
+    }
+  }
+  if (cached != NULL)
+    ksfree(cached);
+  if (key != NULL)
+    ksfree(key);
+  kwordfree(pkwe_cmd);
   return kstat;
 }
 
-kwei_status_t kwei_parse_var_brace(kwordexp_internal_t *pkwei) {
-  kout_t *pkout_varname = kout_open(NULL, NULL, 0);
-  if (pkout_varname == NULL) {
+// Run the command substitution whose "$(" has been read and wait for its
+// output, for callers that cannot return KSNEST.
+static kwei_status_t kwei_cmdsub(kwordexp_internal_t *pkwei,
+                                 const char **poutput, size_t *plen) {
+  *poutput = "";
+  *plen = 0;
+  kwei_frame_t *pframe = kwei_frame_push(pkwei, KWEI_FRAME_CMDSUB);
+  if (pframe == NULL)
+    return KSERROR;
+  kwei_status_t kstat = kwei_parse(&pframe->kf_wei);
+  if (kstat != KSSUCCESS) {
+    pkwei->kwei_errno = pframe->kf_wei.kwei_errno;
+    pkwei->kwei_errex = pframe->kf_wei.kwei_errex;
+    pkwei->kwei_status = KSERROR;
+    kwe_free(&pframe->kf_we);
+    return kstat;
+  }
+  return kwei_cmdsub_end(pkwei, pframe, poutput, plen);
+}
+
+kwei_status_t kwei_parse_var_paren(kwordexp_internal_t *pkwei) {
+  return kwei_frame_push(pkwei, KWEI_FRAME_CMDSUB) != NULL ? KSNEST : KSERROR;
+}
+
+static kwei_status_t kwei_arith_append(kwordexp_internal_t *pkwei,
+                                       char **pexpr, size_t *pexprsize,
+                                       char *sbuf, size_t len,
+                                       const char *s, size_t n) {
+  if (len + n + 1 > *pexprsize) {
+    size_t exprsize = *pexprsize * 2;
+    while (len + n + 1 > exprsize)
+      exprsize *= 2;
+    char *nexpr = ksrealloc(*pexpr == sbuf ? NULL : *pexpr, exprsize);
+    if (nexpr == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    if (*pexpr == sbuf)
+      memcpy(nexpr, sbuf, len);
+    *pexpr = nexpr;
+    *pexprsize = exprsize;
+  }
+  memcpy(*pexpr + len, s, n);
+  return KSSUCCESS;
+}
+
+// Read the expression of a "$((" up to the closing "))" and evaluate it.
+// $(...) and $((...)) inside are expanded first, as the shell does; nest
+// counts the $((...)) enclosing this one.
+static kwei_status_t kwei_arith_run(kwordexp_internal_t *pkwei, size_t nest,
+                                    intmax_t *pval) {
+  if (pkwei->kwei_depth + nest >= pkwei->kwei_frames->kwf_max) {
+    pkwei->kwei_errno = ELOOP;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  char sbuf[256];
+  char *expr = sbuf;
+  size_t exprsize = sizeof(sbuf);
+  size_t len = 0;
+  int depth = 0;
+  kwei_status_t kstat = KSSUCCESS;
+  while (1) {
+    int ch = kin_getc(pkwei->kwei_pin);
+    if (ch == EOF) {
+      if (kin_error(pkwei->kwei_pin)) {
+        pkwei->kwei_errno = errno;
+        pkwei->kwei_errex = KESYSTEM;
+      } else {
+        pkwei->kwei_errex = KESYNTAX;
+      }
+      pkwei->kwei_status = KSERROR;
+      kstat = KSERROR;
+      break;
+    }
+    if (ch == ')' && depth == 0) {
+      ch = kin_getc(pkwei->kwei_pin);
+      if (ch != ')') {
+        pkwei->kwei_errex = KESYNTAX;
+        pkwei->kwei_status = KSERROR;
+        kstat = KSERROR;
+      }
+      break;
+    }
+    if (ch == '$') {
+      int next = kin_getc(pkwei->kwei_pin);
+      if (next == '(') {
+        next = kin_getc(pkwei->kwei_pin);
+        const char *value;
+        size_t n;
+        char buf[sizeof(intmax_t) * 3 + 2];
+        if (next == '(') {
+          intmax_t val;
+          kstat = kwei_arith_run(pkwei, nest + 1, &val);
+          value = buf;
+          n = kstat == KSSUCCESS ? (size_t)snprintf(buf, sizeof(buf), "%jd",
+                                                    val)
+                                 : 0;
+        } else if (pkwei->kwei_flags & KWRDE_NOCMD) {
+          pkwei->kwei_errex = KECMDSUB;
+          pkwei->kwei_status = KSERROR;
+          kstat = KSERROR;
+        } else if (next != EOF && kin_ungetc(pkwei->kwei_pin, next) == EOF) {
+          pkwei->kwei_errno = errno;
+          pkwei->kwei_errex = KESYSTEM;
+          pkwei->kwei_status = KSERROR;
+          kstat = KSERROR;
+        } else {
+          kstat = kwei_cmdsub(pkwei, &value, &n);
+        }
+        if (kstat == KSSUCCESS)
+          kstat = kwei_arith_append(pkwei, &expr, &exprsize, sbuf, len,
+                                    value, n);
+        if (kstat != KSSUCCESS)
+          break;
+        len += n;
+        continue;
+      }
+      if (next != EOF && kin_ungetc(pkwei->kwei_pin, next) == EOF) {
+        pkwei->kwei_errno = errno;
+        pkwei->kwei_errex = KESYSTEM;
+        pkwei->kwei_status = KSERROR;
+        kstat = KSERROR;
+        break;
+      }
+    }
+    if (ch == '(')
+      depth++;
+    if (ch == ')')
+      depth--;
+    char c = ch;
+    kstat = kwei_arith_append(pkwei, &expr, &exprsize, sbuf, len, &c, 1);
+    if (kstat != KSSUCCESS)
+      break;
+    len++;
+  }
+  if (kstat == KSSUCCESS) {
+    expr[len] = '\0';
+    kstat = kwei_arith_eval(pkwei, expr, pval);
+  }
+  if (expr != sbuf)
+    ksfree(expr);
+  return kstat;
+}
+
+kwei_status_t kwei_parse_var_arith(kwordexp_internal_t *pkwei) {
+  kwei_info_set(pkwei, KWRDI_ARITH);
+  intmax_t val = 0;
+  kwei_status_t kstat = kwei_arith_run(pkwei, 0, &val);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  char buf[sizeof(intmax_t) * 3 + 2];
+  return kwei_put_value(pkwei, buf, snprintf(buf, sizeof(buf), "%jd", val));
+}
+
+// ${name#pat}, ${name##pat}, ${name%pat}, ${name%%pat}: turn the frame
+// pushed for the ${ into the parser of the pattern.
+static kwei_status_t kwei_var_strip(kwordexp_internal_t *pkwei,
+                                    kwei_frame_t *pframe, const char *name,
+                                    int op) {
+  int ch = kin_getc(pkwei->kwei_pin);
+  int longest = ch == op;
+  if (!longest && ch != EOF && kin_ungetc(pkwei->kwei_pin, ch) == EOF) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
     pkwei->kwei_status = KSERROR;
     return KSERROR;
   }
-  kwordexp_t kwe_varname = *pkwei->kwei_pwe; // TODO: change
-  kwe_varname.kwe_wordv = NULL;
-  kwe_varname.kwe_wordc = 0;
-  kwordexp_internal_t kwei_varname = kwei_init(
-      &kwe_varname, pkwei->kwei_pin, pkout_varname, pkwei->kwei_flags);
-  kwei_status_t kstat = kwei_parse(&kwei_varname);
-  if (kstat != KSSUCCESS) {
-    int ret = kout_close(pkout_varname, NULL, NULL);
-    (void)ret;
+  // drop the name, which went into the same buffer
+  if (kout_reset(pframe->kf_out) == EOF) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  pframe->kf_kind = KWEI_FRAME_STRIP;
+  pframe->kf_name = name;
+  pframe->kf_op = op;
+  pframe->kf_longest = longest;
+  pframe->kf_wei.kwei_quoted = 1;
+  // keep the escaped form: it is what the pattern compiler reads
+  pframe->kf_wei.kwei_rawword = 1;
+  return KSNEST;
+}
+
+// Strip the shortest or longest match of the pattern parsed in pframe from
+// either end of the value of the variable.
+static kwei_status_t kwei_var_strip_end(kwordexp_internal_t *pkwei,
+                                        kwei_frame_t *pframe) {
+  kwordexp_t *pkwe_pat = &pframe->kf_we;
+  int ch = kin_getc(pkwei->kwei_pin);
+  if (ch != '}') {
+    pkwei->kwei_errex = KESYNTAX;
+    pkwei->kwei_status = KSERROR;
+    kwe_free(pkwe_pat);
+    return KSERROR;
+  }
+
+  size_t patlen = pkwe_pat->kwe_wordc;
+  for (size_t i = 0; i < pkwe_pat->kwe_wordc; i++)
+    patlen += strlen(pkwe_pat->kwe_wordv[i]);
+  char *pat = kmalloc_atomic(patlen + 1);
+  if (pat == NULL) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    kwe_free(pkwe_pat);
+    return KSERROR;
+  }
+  // words the pattern was split into are joined back with single spaces
+  char *p = pat;
+  for (size_t i = 0; i < pkwe_pat->kwe_wordc; i++) {
+    if (i > 0)
+      *p++ = ' ';
+    p = stpcpy(p, pkwe_pat->kwe_wordv[i]);
+  }
+  *p = '\0';
+  kwe_free(pkwe_pat);
+
+  char *value;
+  kwei_status_t kstat = kwei_getenv(pkwei, pframe->kf_name, &value);
+  if (kstat != KSSUCCESS)
     return kstat;
+  if (value == NULL) {
+    if (pkwei->kwei_flags & KWRDE_UNDEF) {
+      pkwei->kwei_errex = KEUNDEF;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    return KSSUCCESS;
   }
+  kwordexp_pattern_t *pkp = kwordexp_pattern_compile(pat, 0);
+  if (pkp == NULL) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  int op = pframe->kf_op;
+  int longest = pframe->kf_longest;
+  size_t len = strlen(value);
+  size_t start = 0, end = len;
+  for (size_t i = 0; i <= len; i++) {
+    if (op == '#') {
+      size_t n = longest ? len - i : i;
+      if (kwordexp_pattern_match(pkp, value, n)) {
+        start = n;
+        break;
+      }
+    } else {
+      size_t n = longest ? i : len - i;
+      if (kwordexp_pattern_match(pkp, value + n, len - n)) {
+        end = n;
+        break;
+      }
+    }
+  }
+  kwordexp_pattern_free(pkp);
+  return kwei_put_value(pkwei, value + start, end - start);
+}
+
+kwei_status_t kwei_parse_var_brace(kwordexp_internal_t *pkwei) {
+  kwei_frame_t *pframe = kwei_frame_push(pkwei, KWEI_FRAME_VAR);
+  if (pframe == NULL)
+    return KSERROR;
+  // a plain name may be followed by a pattern operator
+  kout_t *pkout_varname = pframe->kf_out;
+  size_t namelen = 0;
+  int ch;
+  while ((ch = kin_getc(pkwei->kwei_pin)) != EOF &&
+         (isalnum(ch) || ch == '_')) {
+    if (kout_putc(pkout_varname, ch) == EOF) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    namelen++;
+  }
+  if (namelen > 0 && (ch == '#' || ch == '%')) {
+    const char *name = kout_data(pkout_varname, &namelen);
+    char *copy = name != NULL ? kstrdup(name) : NULL;
+    if (copy == NULL) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    return kwei_var_strip(pkwei, pframe, copy, ch);
+  }
+  if (ch != EOF && kin_ungetc(pkwei->kwei_pin, ch) == EOF) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  // the name read so far starts the word of the nested parser
+  pframe->kf_wei.kwei_has_arg = namelen > 0;
+  return KSNEST;
+}
+
+// Look up the variable whose name the parser in pframe has collected.
+static kwei_status_t kwei_var_brace_end(kwordexp_internal_t *pkwei,
+                                        kwei_frame_t *pframe) {
+  kwordexp_t *pkwe_varname = &pframe->kf_we;
   int ch = kin_getc_while(pkwei->kwei_pin, kwei_isspace, pkwei->kwei_ifs);
 
   if (ch == EOF) {
@@ -231,140 +1196,190 @@ kwei_status_t kwei_parse_var_brace(kwordexp_internal_t *pkwei) {
   if (ch != '}') {
     pkwei->kwei_errex = KESYNTAX;
     pkwei->kwei_status = KSERROR;
-    int ret = kout_close(pkout_varname, NULL, NULL);
-    (void)ret;
-    kwe_free(&kwe_varname);
+    kwe_free(pkwe_varname);
     return KSERROR;
   }
 
-  if (kwe_varname.kwe_wordc != 1) {
-    pkwei->kwei_errex = KESYNTAX;
-    pkwei->kwei_status = KSERROR;
-    int ret = kout_close(pkout_varname, NULL, NULL);
-    (void)ret;
-    kwe_free(&kwe_varname);
-    return KSERROR;
+  if (pkwe_varname->kwe_wordc != 1) {
+    pkwei->kwei_errex = KESYNTAX;
+    pkwei->kwei_status = KSERROR;
+    kwe_free(pkwe_varname);
+    return KSERROR;
+  }
+  char *varvalue;
+  kwei_status_t kstat =
+      kwei_getenv(pkwei, pkwe_varname->kwe_wordv[0], &varvalue);
+  kwe_free(pkwe_varname);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  if (varvalue == NULL) {
+    if (pkwei->kwei_flags & KWRDE_UNDEF) {
+      pkwei->kwei_errex = KEUNDEF;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    return KSSUCCESS;
+  }
+  return kwei_put_string(pkwei, varvalue);
+}
+
+// Finish the expansion that pframe was pushed for in its parent.
+static kwei_status_t kwei_frame_end(kwei_frame_t *pframe) {
+  kwordexp_internal_t *pparent = pframe->kf_parent;
+  switch (pframe->kf_kind) {
+  case KWEI_FRAME_CMDSUB: {
+    const char *output;
+    size_t len;
+    kwei_status_t kstat = kwei_cmdsub_end(pparent, pframe, &output, &len);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    return kwei_put_value(pparent, output, len);
+  }
+  case KWEI_FRAME_VAR:
+    return kwei_var_brace_end(pparent, pframe);
+  case KWEI_FRAME_STRIP:
+    return kwei_var_strip_end(pparent, pframe);
+  }
+  return KSSUCCESS;
+}
+
+int kwei_has_wildcard(const char *word, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    switch (word[i]) {
+    case '\\':
+      i++;
+      break;
+    case '*':
+    case '?':
+    case '[':
+      return 1;
+    }
+  }
+  return 0;
+}
+
+kwei_status_t kwei_expand_word(kwordexp_internal_t *pkwei, const char *word,
+                               size_t len, int has_pattern) {
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  if (pkwei->kwei_info != NULL) {
+    kwei_info_set(pkwei, (*word == '~' ? KWRDI_TILDE : 0) |
+                             (has_pattern ? KWRDI_GLOB : 0));
+    has_pattern = 0;
   }
-  char *varvalue;
-  kstat = kwei_getenv(pkwei, kwe_varname.kwe_wordv[0], &varvalue);
-  int ret = kout_close(pkout_varname, NULL, NULL);
-  (void)ret;
-  kwe_free(&kwe_varname);
-  if (kstat != KSSUCCESS)
-    return kstat;
-  if (varvalue == NULL) {
-    if (pkwei->kwei_flags & KWRDE_UNDEF) {
-      pkwei->kwei_errex = KEUNDEF;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
+  char *tilde = NULL;
+  if (*word == '~' && pkwei->kwei_info == NULL) {
+    kwei_status_t kstat = kwei_tilde(pkwei, word, len, &tilde, &len);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    if (tilde != NULL)
+      word = tilde;
+  }
+  int native = (pkwei->kwei_flags & (KWRDE_GLOBCACHE | KWRDE_NOSORT |
+                                     KWRDE_GLOBSTAR | KWRDE_PARALLEL)) ||
+               pkwe->kwe_glob != NULL || pkwe->kwe_glob_max > 0 ||
+               pkwe->kwe_readdir != NULL || pkwe->kwe_shcache != NULL;
+  kwei_status_t kstat = KSSUCCESS;
+  size_t count = 0;
+  kwordexp_stats_t *pstats = pkwe->kwe_stats;
+  int timed = has_pattern && (pstats != NULL || kwei_metrics_enabled());
+  uint64_t start = 0;
+  if (has_pattern) {
+    KWEI_PROBE1(glob__start, word);
+    if (timed)
+      start = kwei_clock_now(pstats != NULL);
+    kwei_deps_glob(pkwei);
+  }
+  if (has_pattern && native) {
+    kstat = kwei_glob(pkwei, word, len, &count);
+  } else if (has_pattern) {
+    glob_t gl;
+    int ret = glob(word, 0, NULL, &gl);
+    if (ret == 0) {
+      for (size_t i = 0; i < gl.gl_pathc && kstat == KSSUCCESS; i++)
+        kstat = kwei_add_word(pkwei, gl.gl_pathv[i], strlen(gl.gl_pathv[i]));
+      count = gl.gl_pathc;
     }
-    return KSSUCCESS;
+    if (ret != GLOB_NOMATCH)
+      globfree(&gl);
   }
-  ret = kout_printf(pkwei->kwei_pout, "%s", varvalue);
-  if (ret == -1) {
-    pkwei->kwei_errno = errno;
-    pkwei->kwei_errex = KESYSTEM;
-    pkwei->kwei_status = KSERROR;
-    return KSERROR;
+  if (has_pattern) {
+    uint64_t elapsed = timed ? kwei_clock_now(pstats != NULL) - start : 0;
+    KWEI_PROBE3(glob__done, word, count, elapsed);
+    kwei_metrics_record(KWEI_METRIC_GLOB, elapsed);
+    if (pstats != NULL) {
+      pstats->kws_globs++;
+      pstats->kws_matches += count;
+      pstats->kws_glob_ns += elapsed;
+    }
   }
-  return KSSUCCESS;
+  if (kstat == KSSUCCESS && count == 0) {
+    if (pkwei->kwei_has_escape)
+      kstat = kwei_add_word_unescape(pkwei, word, len);
+    else
+      kstat = kwei_add_word(pkwei, word, len);
+  }
+  if (tilde != NULL)
+    ksfree(tilde);
+  return kstat;
 }
 
 kwei_status_t kwei_push_word(kwordexp_internal_t *pkwei) {
+  pkwei->kwei_ifsdelim = 0;
   if (!pkwei->kwei_has_arg)
     return KSSUCCESS;
+  if (pkwei->kwei_has_brace)
+    kwei_info_set(pkwei, KWRDI_BRACE);
 
-  kwordexp_t *pkwe = pkwei->kwei_pwe;
-  size_t wordc = pkwe->kwe_wordc;
-
-  char *word = NULL;
-  int ret = kout_close(pkwei->kwei_pout, &word, NULL);
-  if (ret == -1) {
+  size_t len;
+  const char *word = kout_data(pkwei->kwei_pout, &len);
+  if (word == NULL) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
     pkwei->kwei_status = KSERROR;
     return KSERROR;
   }
-  if (word == NULL) {
-    word = kstrdup("");
-    if (word == NULL) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-  }
 
-  glob_t gl;
-  int has_pattern = pkwei->kwei_has_pattern;
-  if (has_pattern) {
-    int ret = glob(word, GLOB_NOCHECK | GLOB_BRACE | GLOB_TILDE, NULL, &gl);
-    if (ret != 0)
-      has_pattern = 0;
-  }
+  kwei_status_t kstat;
+  if (pkwei->kwei_rawword)
+    kstat = kwei_add_word(pkwei, word, len);
+  else if (pkwei->kwei_flags & KWRDE_SPLITONLY)
+    kstat = pkwei->kwei_has_escape ? kwei_add_word_unescape(pkwei, word, len)
+                                   : kwei_add_word(pkwei, word, len);
+  else if (pkwei->kwei_has_brace && pkwei->kwei_info == NULL)
+    kstat = kwei_brace_expand(pkwei, word, len);
+  else
+    kstat = kwei_expand_word(pkwei, word, len, pkwei->kwei_has_pattern);
+  if (kstat != KSSUCCESS)
+    return kstat;
 
-  size_t wordc_add = has_pattern ? gl.gl_pathc : 1;
-  char **wordv =
-      krealloc(pkwe->kwe_wordv, (wordc + wordc_add + 1) * sizeof(char *));
-  if (wordv == NULL) {
+  int ret = kout_reset(pkwei->kwei_pout);
+  if (ret == EOF) {
     pkwei->kwei_errno = errno;
     pkwei->kwei_errex = KESYSTEM;
     pkwei->kwei_status = KSERROR;
-    kfree(word);
-    if (has_pattern)
-      globfree(&gl);
     return KSERROR;
   }
-
-  if (has_pattern) {
-    for (size_t i = 0; i < gl.gl_pathc; i++) {
-      wordv[wordc + i] = kstrdup(gl.gl_pathv[i]);
-      if (wordv[wordc + i] == NULL) {
-        pkwei->kwei_errno = errno;
-        pkwei->kwei_errex = KESYSTEM;
-        pkwei->kwei_status = KSERROR;
-        for (size_t j = 0; j < i; j++)
-          kfree(wordv[wordc + j]);
-        kfree(word);
-        if (has_pattern)
-          globfree(&gl);
-        return KSERROR;
-      }
-    }
-  } else {
-    wordv[wordc] = word;
-  }
-
-  pkwe->kwe_wordv = wordv;
-  pkwe->kwe_wordv[wordc + wordc_add] = NULL;
-  pkwe->kwe_wordc = wordc + wordc_add;
   pkwei->kwei_has_arg = 0;
   pkwei->kwei_has_pattern = 0;
-  if (has_pattern)
-    globfree(&gl);
+  pkwei->kwei_has_brace = 0;
+  pkwei->kwei_has_escape = 0;
   return KSSUCCESS;
 }
 
 kwei_status_t kwei_var_asterisk(kwordexp_internal_t *pkwei) {
+  if (!pkwei->kwei_quoted)
+    return kwei_var_atto(pkwei);
   pkwei->kwei_has_arg = 1;
   const char *ifs = pkwei->kwei_ifs;
   for (size_t i = 1; i < pkwei->kwei_pwe->kwe_argc; i++) {
-    if (i > 1) {
-      int ret = kout_putc(pkwei->kwei_pout, *ifs);
-      if (ret == -1) {
-        pkwei->kwei_errno = errno;
-        pkwei->kwei_errex = KESYSTEM;
-        pkwei->kwei_status = KSERROR;
-        return KSERROR;
-      }
-    }
-    int ret = kout_printf(pkwei->kwei_pout, "%s", pkwei->kwei_pwe->kwe_argv[i]);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
+    if (i > 1 && *ifs != '\0') {
+      kwei_status_t kstat = kwei_put_literal(pkwei, ifs, 1);
+      if (kstat != KSSUCCESS)
+        return kstat;
     }
+    kwei_status_t kstat = kwei_put_string(pkwei, pkwei->kwei_pwe->kwe_argv[i]);
+    if (kstat != KSSUCCESS)
+      return kstat;
   }
   return KSSUCCESS;
 }
@@ -378,37 +1393,31 @@ kwei_status_t kwei_var_atto(kwordexp_internal_t *pkwei) {
         return kstat;
     }
 
-    pkwei->kwei_has_arg = 1;
-    int ret = kout_printf(pkwei->kwei_pout, "%s", pkwei->kwei_pwe->kwe_argv[i]);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
+    if (pkwei->kwei_quoted)
+      pkwei->kwei_has_arg = 1;
+    kwei_status_t kstat = kwei_put_string(pkwei, pkwei->kwei_pwe->kwe_argv[i]);
+    if (kstat != KSSUCCESS)
+      return kstat;
   }
   return KSSUCCESS;
 }
 
 kwei_status_t kwei_var_num(kwordexp_internal_t *pkwei, int ch) {
   size_t n = ch - '0';
+  if (pkwei->kwei_info != NULL) {
+    pkwei->kwei_info->kwi_argmask |= 1u << n;
+    return KSSUCCESS;
+  }
   if (n >= pkwei->kwei_pwe->kwe_argc) {
     pkwei->kwei_errex = KENARG;
     pkwei->kwei_status = KSERROR;
     return KSERROR;
   }
-  int ret = kout_printf(pkwei->kwei_pout, "%s", pkwei->kwei_pwe->kwe_argv[n]);
-  if (ret == -1) {
-    pkwei->kwei_errno = errno;
-    pkwei->kwei_errex = KESYSTEM;
-    pkwei->kwei_status = KSERROR;
-    return KSERROR;
-  }
-  return KSSUCCESS;
+  return kwei_put_string(pkwei, pkwei->kwei_pwe->kwe_argv[n]);
 }
 
 kwei_status_t kwei_parse_var(kwordexp_internal_t *pkwei) {
-  pkwei->kwei_has_arg = 1;
+  char buf[32];
   int ch = kin_getc(pkwei->kwei_pin);
   switch (ch) {
 
@@ -423,96 +1432,74 @@ kwei_status_t kwei_parse_var(kwordexp_internal_t *pkwei) {
     return KSERROR;
 
   case '*':
+    kwei_info_set(pkwei, KWRDI_ARGS);
     return kwei_var_asterisk(pkwei);
 
   case '@':
+    kwei_info_set(pkwei, KWRDI_ARGS);
     return kwei_var_atto(pkwei);
 
-  case '#': {
-    int ret =
-        kout_printf(pkwei->kwei_pout, "%zu", pkwei->kwei_pwe->kwe_argc - 1);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
-  }
-
-  case '?': {
-    int ret =
-        kout_printf(pkwei->kwei_pout, "%d", pkwei->kwei_pwe->kwe_last_status);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
-  }
-
-  case '-': {
-    int ret = kout_printf(pkwei->kwei_pout, "$-");
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
-  }
-
-  case '$': {
-    int ret = kout_printf(pkwei->kwei_pout, "%d", (int)getpid());
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
-  }
+  case '#':
+    kwei_info_set(pkwei, KWRDI_ARGS);
+    return kwei_put_value(pkwei, buf,
+                          snprintf(buf, sizeof(buf), "%zu",
+                                   pkwei->kwei_pwe->kwe_argc - 1));
+
+  case '?':
+    kwei_info_set(pkwei, KWRDI_SPECIAL);
+    kwei_deps_volatile(pkwei);
+    return kwei_put_value(pkwei, buf,
+                          snprintf(buf, sizeof(buf), "%d",
+                                   pkwei->kwei_pwe->kwe_last_status));
+
+  case '-':
+    kwei_info_set(pkwei, KWRDI_SPECIAL);
+    return kwei_put_string(pkwei, "$-");
+
+  case '$':
+    kwei_info_set(pkwei, KWRDI_SPECIAL);
+    kwei_deps_volatile(pkwei);
+    return kwei_put_value(
+        pkwei, buf, snprintf(buf, sizeof(buf), "%d", (int)getpid()));
+
+  case '!':
+    kwei_info_set(pkwei, KWRDI_SPECIAL);
+    kwei_deps_volatile(pkwei);
+    return kwei_put_value(pkwei, buf,
+                          snprintf(buf, sizeof(buf), "%d",
+                                   pkwei->kwei_pwe->kwe_last_bgpid));
+
+  case '0':
+    if (pkwei->kwei_info != NULL)
+      pkwei->kwei_info->kwi_argmask |= 1;
+    return kwei_put_string(pkwei, pkwei->kwei_pwe->kwe_argv[0]);
+
+  case '_':
+    kwei_info_set(pkwei, KWRDI_SPECIAL);
+    kwei_deps_volatile(pkwei);
+    return kwei_put_string(pkwei, pkwei->kwei_pwe->kwe_last_arg);
 
-  case '!': {
-    int ret =
-        kout_printf(pkwei->kwei_pout, "%d", pkwei->kwei_pwe->kwe_last_bgpid);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
-  }
+  case '{':
+    return kwei_parse_var_brace(pkwei);
 
-  case '0': {
-    int ret = kout_printf(pkwei->kwei_pout, "%s", pkwei->kwei_pwe->kwe_argv[0]);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
+  case '(':
+    ch = kin_getc(pkwei->kwei_pin);
+    if (ch == '(')
+      return kwei_parse_var_arith(pkwei);
+    if (pkwei->kwei_flags & KWRDE_NOCMD) {
+      pkwei->kwei_errex = KECMDSUB;
       pkwei->kwei_status = KSERROR;
       return KSERROR;
     }
-    return KSSUCCESS;
-  }
-
-  case '_': {
-    int ret =
-        kout_printf(pkwei->kwei_pout, "%s", pkwei->kwei_pwe->kwe_last_arg);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
+    if (ch != EOF) {
+      int ret = kin_ungetc(pkwei->kwei_pin, ch);
+      if (ret == EOF) {
+        pkwei->kwei_errno = errno;
+        pkwei->kwei_errex = KESYSTEM;
+        pkwei->kwei_status = KSERROR;
+        return KSERROR;
+      }
     }
-    return KSSUCCESS;
-  }
-
-  case '{':
-    return kwei_parse_var_brace(pkwei);
-
-  case '(':
     return kwei_parse_var_paren(pkwei);
 
   case '1' ... '9':
@@ -581,18 +1568,14 @@ kwei_status_t kwei_parse_var(kwordexp_internal_t *pkwei) {
       }
       return KSSUCCESS;
     }
-    ret = kout_printf(pkwei->kwei_pout, "%s", varvalue);
-    if (ret == -1) {
-      pkwei->kwei_errno = errno;
-      pkwei->kwei_errex = KESYSTEM;
-      pkwei->kwei_status = KSERROR;
-      return KSERROR;
-    }
-    return KSSUCCESS;
+    return kwei_put_string(pkwei, varvalue);
   }
 }
 
-static kwei_status_t kwei_parse_dquote(kwordexp_internal_t *pkwei) {
+// mode is a constant in every caller, so each parser variant below gets a
+// copy of this with the unused branches folded away.
+static inline __attribute__((always_inline)) kwei_status_t
+kwei_parse_dquote(kwordexp_internal_t *pkwei, int mode) {
   pkwei->kwei_has_arg = 1;
   while (1) {
     int ch = kin_getc(pkwei->kwei_pin);
@@ -612,7 +1595,9 @@ static kwei_status_t kwei_parse_dquote(kwordexp_internal_t *pkwei) {
       return KSSUCCESS;
 
     case '$': {
-      kwei_status_t kstat = kwei_parse_var(pkwei);
+      kwei_status_t kstat = mode & KWRDE_SPLITONLY
+                                ? kwei_put_literal(pkwei, "$", 1)
+                                : kwei_parse_var(pkwei);
       if (kstat != KSSUCCESS)
         return kstat;
       continue;
@@ -633,23 +1618,30 @@ static kwei_status_t kwei_parse_dquote(kwordexp_internal_t *pkwei) {
       // fallthrough
 
     default: {
-      int ret = kout_putc(pkwei->kwei_pout, ch);
-      if (ret == -1) {
-        pkwei->kwei_errno = errno;
-        pkwei->kwei_errex = KESYSTEM;
-        pkwei->kwei_status = KSERROR;
-        return KSERROR;
-      }
+      char c = ch;
+      kwei_status_t kstat = kwei_put_literal(pkwei, &c, 1);
+      if (kstat != KSSUCCESS)
+        return kstat;
       continue;
     }
     }
   }
 }
 
-kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
-  int brace_level = 0;
-  int bracket_level = 0;
+static inline __attribute__((always_inline)) kwei_status_t
+kwei_parse_mode(kwordexp_internal_t *pkwei, int mode) {
+  const int glob = !(mode & (KWRDE_NOGLOB | KWRDE_SPLITONLY));
+  const int brace = !(mode & KWRDE_SPLITONLY);
   while (1) {
+    if (pkwei->kwei_dquote) {
+      // parse double quoted string, or the rest of it after a nested parser
+      kwei_status_t kstat = kwei_parse_dquote(pkwei, mode);
+      if (kstat != KSSUCCESS)
+        return kstat;
+      pkwei->kwei_dquote = 0;
+      pkwei->kwei_quoted = 0;
+      continue;
+    }
     // Skip leading spaces
     int ch = kin_getc(pkwei->kwei_pin);
     switch (ch) {
@@ -670,17 +1662,16 @@ kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
       break;
     }
 
-    case '"': {
-      // parse double quoted string
-      kwei_status_t kstat = kwei_parse_dquote(pkwei);
-      if (kstat != KSSUCCESS)
-        return kstat;
+    case '"':
+      pkwei->kwei_quoted = 1;
+      pkwei->kwei_dquote = 1;
       break;
-    }
 
     case '$': {
       // parse variable
-      kwei_status_t kstat = kwei_parse_var(pkwei);
+      kwei_status_t kstat = mode & KWRDE_SPLITONLY
+                                ? kwei_put_literal(pkwei, "$", 1)
+                                : kwei_parse_var(pkwei);
       if (kstat != KSSUCCESS)
         return kstat;
       break;
@@ -708,18 +1699,30 @@ kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
           return KSERROR;
         }
       }
-      if (ch == '[' || (bracket_level > 0 && ch == ']') || ch == '{' ||
-          (brace_level > 0 && ch == '}') || ch == '~' || ch == '*' ||
-          ch == '?') {
+      if (esc) {
+        char c = ch;
+        kwei_status_t kstat = kwei_put_literal(pkwei, &c, 1);
+        if (kstat != KSSUCCESS)
+          return kstat;
+        continue;
+      }
+      if ((glob && (ch == '[' ||
+                    (pkwei->kwei_bracket_level > 0 && ch == ']') ||
+                    ch == '*' || ch == '?')) ||
+          (brace && (ch == '{' ||
+                     (pkwei->kwei_brace_level > 0 && ch == '}') ||
+                     ch == '~'))) {
         if (ch == '[')
-          bracket_level++;
+          pkwei->kwei_bracket_level++;
         if (ch == ']')
-          bracket_level--;
+          pkwei->kwei_bracket_level--;
         if (ch == '{')
-          brace_level++;
+          pkwei->kwei_brace_level++;
         if (ch == '}')
-          brace_level--;
-        if (!esc)
+          pkwei->kwei_brace_level--;
+        if (ch == '{')
+          pkwei->kwei_has_brace = 1;
+        else if (ch != '}' && ch != '~')
           pkwei->kwei_has_pattern = 1;
         pkwei->kwei_has_arg = 1;
         int ret = kout_putc(pkwei->kwei_pout, ch);
@@ -731,7 +1734,12 @@ kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
         }
         continue;
       }
-      if (isprint(ch) && ch != '}' && ch != ']') {
+      int term = ch == pkwei->kwei_term && pkwei->kwei_paren_level == 0;
+      if (ch == '(')
+        pkwei->kwei_paren_level++;
+      if (ch == ')' && pkwei->kwei_paren_level > 0)
+        pkwei->kwei_paren_level--;
+      if (!term && isprint(ch)) {
         pkwei->kwei_has_arg = 1;
         int ret = kout_putc(pkwei->kwei_pout, ch);
         if (ret == -1) {
@@ -754,43 +1762,310 @@ kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
   }
 }
 
+static kwei_status_t kwei_parse_full(kwordexp_internal_t *pkwei) {
+  return kwei_parse_mode(pkwei, 0);
+}
+
+static kwei_status_t kwei_parse_noglob(kwordexp_internal_t *pkwei) {
+  return kwei_parse_mode(pkwei, KWRDE_NOGLOB);
+}
+
+static kwei_status_t kwei_parse_split(kwordexp_internal_t *pkwei) {
+  return kwei_parse_mode(pkwei, KWRDE_SPLITONLY);
+}
+
+kwei_status_t kwei_parse_internal(kwordexp_internal_t *pkwei) {
+  if (pkwei->kwei_flags & KWRDE_SPLITONLY)
+    return kwei_parse_split(pkwei);
+  if (pkwei->kwei_flags & KWRDE_NOGLOB)
+    return kwei_parse_noglob(pkwei);
+  return kwei_parse_full(pkwei);
+}
+
+// Run pkwei and every parser nested below it. A $(...) or ${...} pushes a
+// frame and returns KSNEST rather than recursing; the loop then runs that
+// frame until it ends, finishes the expansion in the parent and resumes the
+// parent where it stopped.
 kwei_status_t kwei_parse(kwordexp_internal_t *pkwei) {
-  kwei_status_t kstat = kwei_parse_internal(pkwei);
-  if (kstat != KSSUCCESS)
-    return kstat;
-  kstat = kwei_push_word(pkwei);
-  if (kstat != KSSUCCESS)
+  kwei_frames_t *pkf = pkwei->kwei_frames;
+  kwordexp_internal_t *pcur = pkwei;
+  while (1) {
+    kwei_status_t kstat = kwei_parse_internal(pcur);
+    if (kstat == KSNEST) {
+      pcur = &pkf->kwf_framev[pcur->kwei_depth]->kf_wei;
+      continue;
+    }
+    if (kstat == KSSUCCESS)
+      kstat = kwei_push_word(pcur);
+    if (pcur == pkwei)
+      return kstat;
+    kwei_frame_t *pframe = pkf->kwf_framev[pcur->kwei_depth - 1];
+    if (kstat == KSSUCCESS) {
+      pcur = pframe->kf_parent;
+      kstat = kwei_frame_end(pframe);
+      if (kstat == KSSUCCESS)
+        continue;
+    }
+    // unwind the frames still open above pkwei
+    if (kstat == KSERROR) {
+      pkwei->kwei_errno = pcur->kwei_errno;
+      pkwei->kwei_errex = pcur->kwei_errex;
+      pkwei->kwei_status = KSERROR;
+    }
+    while (pcur != pkwei) {
+      pframe = pkf->kwf_framev[pcur->kwei_depth - 1];
+      kwe_free(&pframe->kf_we);
+      pcur = pframe->kf_parent;
+    }
     return kstat;
-  return KSSUCCESS;
+  }
 }
 
 // ----------------------------------------------------------------
 // kwordexp
 // ----------------------------------------------------------------
 
-int kfwordexp(FILE *fp, kwordexp_t *pwe, int flags) {
+// Bytes of the words from wordc on, counting the terminating NULs
+static size_t kwei_wordv_bytes(const kwordexp_t *pwe, size_t wordc) {
+  if (pwe->kwe_words != NULL)
+    return kwei_words_bytes(pwe->kwe_words, wordc);
+  size_t bytes = 0;
+  for (size_t i = wordc; i < pwe->kwe_wordc; i++)
+    bytes += strlen(pwe->kwe_wordv[i]) + 1;
+  return bytes;
+}
 
+static int kwei_fwordexp(FILE *fp, kwordexp_t *pwe, int flags) {
+  if (pwe->kwe_word == NULL &&
+      ((flags & KWRDE_COMPACT) || pwe->kwe_words != NULL) &&
+      kwei_words_prepare(pwe) != 0) {
+    kwei_metrics_error(KESYSTEM);
+    return -1;
+  }
   kin_t *pkin = kin_open(fp, NULL, 0);
-  if (pkin == NULL)
+  if (pkin == NULL) {
+    kwei_metrics_error(KESYSTEM);
     return -1;
+  }
   kout_t *pkout = kout_open(NULL, NULL, 0);
   if (pkout == NULL) {
     kin_close(pkin);
+    kwei_metrics_error(KESYSTEM);
     return -1;
   }
-  kwordexp_internal_t kwei = kwei_init(pwe, pkin, pkout, flags);
+  size_t wordc = pwe->kwe_wordc;
+  kwei_frames_t frames;
+  kwei_frames_init(&frames, pwe);
+  kwordexp_internal_t kwei = kwei_init(pwe, pkin, pkout, flags, NULL);
+  kwei.kwei_frames = &frames;
+  if (pwe->kwe_word != NULL)
+    kwei.kwei_sink = kwei_sink_word;
   kwei_status_t kstat = kwei_parse(&kwei);
   kin_close(pkin);
   int ret = kout_close(pkout, NULL, NULL);
   (void)ret;
-  if (kstat != KSSUCCESS) {
+  kwei_frames_free(&frames);
+  if (kwei.kwei_scratch != NULL)
+    ksfree(kwei.kwei_scratch);
+  if (kstat == KSERROR) {
+    kwei_metrics_error(kwei.kwei_errex);
+    kwe_free(pwe);
+    if (kwei.kwei_errex == KESYSTEM)
+      errno = kwei.kwei_errno;
+    return -1;
+  }
+  kwei_metrics_record(KWEI_METRIC_OUTPUT,
+                      kwei.kwei_sink != NULL ? kwei.kwei_outbytes
+                                             : kwei_wordv_bytes(pwe, wordc));
+  return 0;
+}
+
+// The slow hook gets the phase breakdown even when no stats were asked for.
+// Returns the statistics to fill, which may be pslow.
+static kwordexp_stats_t *kwei_slow_begin(kwordexp_t *pwe,
+                                         kwordexp_stats_t *pslow) {
+  if (pwe->kwe_stats == NULL && pwe->kwe_slow != NULL)
+    pwe->kwe_stats = pslow;
+  return pwe->kwe_stats;
+}
+
+static void kwei_slow_end(kwordexp_t *pwe, kwordexp_stats_t *pslow,
+                          const char *input, size_t len) {
+  kwordexp_stats_t *pstats = pwe->kwe_stats;
+  if (pstats == pslow)
+    pwe->kwe_stats = NULL;
+  if (pwe->kwe_slow != NULL && pstats->kws_total_ns >= pwe->kwe_slow_ns)
+    pwe->kwe_slow(pwe->kwe_data, input, len, pstats);
+}
+
+int kfwordexp(FILE *fp, kwordexp_t *pwe, int flags) {
+  kwordexp_stats_t slow;
+  kwordexp_stats_t *pstats = kwei_slow_begin(pwe, &slow);
+  kmalloc_tally_t tally;
+  kmalloc_tally_t *pprev =
+      pstats != NULL ? kwei_stats_begin(pstats, &tally) : NULL;
+  size_t wordc = pwe->kwe_wordc;
+  // only a seekable stream tells how much was read
+  off_t pos = pstats != NULL ? ftello(fp) : -1;
+  KWEI_PROBE2(expand__start, NULL, 0);
+  int timed = pstats != NULL || kwei_metrics_enabled();
+  uint64_t start = timed ? kwei_clock_now(pstats != NULL) : 0;
+  int ret = kwei_fwordexp(fp, pwe, flags);
+  uint64_t elapsed = timed ? kwei_clock_now(pstats != NULL) - start : 0;
+  KWEI_PROBE2(expand__done, ret, elapsed);
+  kwei_metrics_record(KWEI_METRIC_EXPAND, elapsed);
+  if (pstats == NULL)
+    return ret;
+  off_t end = pos != -1 ? ftello(fp) : -1;
+  if (end != -1)
+    pstats->kws_bytes = end - pos;
+  pstats->kws_words += pwe->kwe_wordc - wordc;
+  kwei_stats_end(pstats, &tally, pprev, elapsed);
+  kwei_slow_end(pwe, &slow, NULL, 0);
+  return ret;
+}
+
+static int kwei_wordexp_run(const char *ibuf, size_t len, kwordexp_t *pwe,
+                            int flags, kwei_into_t *pinto, kwei_sink_t sink,
+                            void *sinkdata) {
+  if (sink == NULL && pinto == NULL && pwe->kwe_word != NULL)
+    sink = kwei_sink_word;
+  if (pinto == NULL && sink == NULL &&
+      ((flags & KWRDE_COMPACT) || pwe->kwe_words != NULL) &&
+      kwei_words_prepare(pwe) != 0) {
+    kwei_metrics_error(KESYSTEM);
+    return -1;
+  }
+  // the cache replays into kwe_wordv
+  kwordexp_cache_t *pcache = pinto == NULL && sink == NULL &&
+                                     pwe->kwe_words == NULL
+                                 ? pwe->kwe_cache
+                                 : NULL;
+  size_t wordc = pwe->kwe_wordc;
+  if (pcache != NULL) {
+    int ret = kwei_cache_lookup(pcache, pwe, ibuf, len, flags);
+    if (ret > 0)
+      kwei_metrics_record(KWEI_METRIC_OUTPUT, kwei_wordv_bytes(pwe, wordc));
+    else if (ret < 0)
+      kwei_metrics_error(KESYSTEM);
+    if (ret != 0)
+      return ret > 0 ? 0 : -1;
+  }
+  kwei_vars_t vars;
+  if (pwe->kwe_getenvv != NULL && kwei_vars_load(pwe, ibuf, len, &vars) != 0) {
+    kwei_metrics_error(KESYSTEM);
+    return -1;
+  }
+  kin_t *pkin = kin_open(NULL, ibuf, len);
+  if (pkin == NULL) {
+    kwei_metrics_error(KESYSTEM);
+    return -1;
+  }
+  kout_t *pkout = kout_open(NULL, NULL, 0);
+  if (pkout == NULL) {
+    kin_close(pkin);
+    kwei_metrics_error(KESYSTEM);
+    return -1;
+  }
+  kwei_deps_t deps;
+  if (pcache != NULL)
+    kwei_deps_init(&deps, pcache, pwe);
+  kwei_frames_t frames;
+  kwei_frames_init(&frames, pwe);
+  kwordexp_internal_t kwei = kwei_init(
+      pwe, pkin, pkout, flags, pwe->kwe_getenvv != NULL ? &vars : NULL);
+  kwei.kwei_frames = &frames;
+  kwei.kwei_deps = pcache != NULL ? &deps : NULL;
+  kwei.kwei_into = pinto;
+  // nested parsers collect their words as before
+  kwei.kwei_sink = sink;
+  kwei.kwei_sinkdata = sinkdata;
+  // kwei_init looked IFS up before the dependencies were tracked
+  if (pcache != NULL)
+    kwei_deps_var(&kwei, "IFS");
+  kwei_status_t kstat = kwei_parse(&kwei);
+  kin_close(pkin);
+  int ret = kout_close(pkout, NULL, NULL);
+  (void)ret;
+  kwei_frames_free(&frames);
+  if (kwei.kwei_scratch != NULL)
+    ksfree(kwei.kwei_scratch);
+  if (kstat == KSSUCCESS && pcache != NULL)
+    kwei_cache_store(pcache, pwe, ibuf, len, flags, &deps, wordc);
+  if (pcache != NULL)
+    kwei_deps_free(&deps);
+  // KSSTOP: the sink ended the expansion early
+  if (kstat == KSERROR) {
+    kwei_metrics_error(kwei.kwei_errex);
     kwe_free(pwe);
+    if (kwei.kwei_errex == KESYSTEM)
+      errno = kwei.kwei_errno;
     return -1;
   }
+  kwei_metrics_record(KWEI_METRIC_OUTPUT,
+                      pinto != NULL  ? pinto->kwi_len
+                      : sink != NULL ? kwei.kwei_outbytes
+                                     : kwei_wordv_bytes(pwe, wordc));
   return 0;
 }
 
+int kwei_wordexp(const char *ibuf, size_t len, kwordexp_t *pwe, int flags,
+                 kwei_into_t *pinto, kwei_sink_t sink, void *sinkdata) {
+  kwordexp_stats_t slow;
+  kwordexp_stats_t *pstats = kwei_slow_begin(pwe, &slow);
+  kmalloc_tally_t tally;
+  kmalloc_tally_t *pprev =
+      pstats != NULL ? kwei_stats_begin(pstats, &tally) : NULL;
+  size_t wordc = pwe->kwe_wordc;
+  KWEI_PROBE2(expand__start, ibuf, len);
+  int timed = pstats != NULL || kwei_metrics_enabled();
+  uint64_t start = timed ? kwei_clock_now(pstats != NULL) : 0;
+  int ret = kwei_wordexp_run(ibuf, len, pwe, flags, pinto, sink, sinkdata);
+  uint64_t elapsed = timed ? kwei_clock_now(pstats != NULL) - start : 0;
+  KWEI_PROBE2(expand__done, ret, elapsed);
+  kwei_metrics_record(KWEI_METRIC_EXPAND, elapsed);
+  if (pstats == NULL)
+    return ret;
+  pstats->kws_bytes = len;
+  // streamed words were counted as they went out
+  pstats->kws_words +=
+      pinto != NULL ? pinto->kwi_wordc : pwe->kwe_wordc - wordc;
+  kwei_stats_end(pstats, &tally, pprev, elapsed);
+  kwei_slow_end(pwe, &slow, ibuf, len);
+  return ret;
+}
+
 int kwordexp(const char *ibuf, kwordexp_t *pwe, int flags) {
+  return kwei_wordexp(ibuf, strlen(ibuf), pwe, flags, NULL, NULL, NULL);
+}
+
+int kwordexp_n(const char *ibuf, size_t len, kwordexp_t *pwe, int flags) {
+  return kwei_wordexp(ibuf, len, pwe, flags, NULL, NULL, NULL);
+}
+
+int kwordexp_into(const char *ibuf, char *buf, size_t cap, size_t *offsets,
+                  size_t maxwords, kwordexp_t *pwe, int flags, size_t *psize,
+                  size_t *pwordc) {
+  kwei_into_t into;
+  into.kwi_buf = buf;
+  into.kwi_cap = cap;
+  into.kwi_len = 0;
+  into.kwi_offv = offsets;
+  into.kwi_maxwords = maxwords;
+  into.kwi_wordc = 0;
+  int ret = kwei_wordexp(ibuf, strlen(ibuf), pwe, flags, &into, NULL, NULL);
+  if (ret != 0)
+    return ret;
+  *psize = into.kwi_len;
+  *pwordc = into.kwi_wordc;
+  return into.kwi_len > cap || into.kwi_wordc > maxwords ? 1 : 0;
+}
+
+int kwordexp_analyze(const char *ibuf, kwordexp_info_t *pinfo) {
+  pinfo->kwi_flags = 0;
+  pinfo->kwi_argmask = 0;
+  pinfo->kwi_varv = NULL;
+  pinfo->kwi_varc = 0;
   kin_t *pkin = kin_open(NULL, ibuf, strlen(ibuf));
   if (pkin == NULL)
     return -1;
@@ -799,18 +2074,40 @@ int kwordexp(const char *ibuf, kwordexp_t *pwe, int flags) {
     kin_close(pkin);
     return -1;
   }
-  kwordexp_internal_t kwei = kwei_init(pwe, pkin, pkout, flags);
+  static char *argv[] = {"", NULL};
+  kwordexp_t kwe;
+  kwe_init(&kwe, argv, 1);
+  kwei_frames_t frames;
+  kwei_frames_init(&frames, &kwe);
+  kwordexp_internal_t kwei = kwei_init_state(&kwe, pkin, pkout, 0);
+  kwei.kwei_info = pinfo;
+  kwei.kwei_frames = &frames;
+  kwei.kwei_ifs = " \t\n";
+  memset(kwei.kwei_ifsmap, 0, sizeof(kwei.kwei_ifsmap));
+  for (const unsigned char *p = (const unsigned char *)kwei.kwei_ifs;
+       *p != '\0'; p++)
+    kwei.kwei_ifsmap[*p] = KWEI_IFS_SPACE;
   kwei_status_t kstat = kwei_parse(&kwei);
   kin_close(pkin);
   int ret = kout_close(pkout, NULL, NULL);
   (void)ret;
+  kwei_frames_free(&frames);
+  kwe_free(&kwe);
   if (kstat != KSSUCCESS) {
-    kwe_free(pwe);
+    kwordexp_info_free(pinfo);
     return -1;
   }
   return 0;
 }
 
+void kwordexp_info_free(kwordexp_info_t *pinfo) {
+  if (pinfo->kwi_varv != NULL) {
+    kfree(pinfo->kwi_varv);
+    pinfo->kwi_varv = NULL;
+  }
+  pinfo->kwi_varc = 0;
+}
+
 // ----------------------------------------------------------------
 // kwordfree
 // ----------------------------------------------------------------
@@ -854,6 +2151,7 @@ int kwordexp_exec_default(void *data, char **argv, FILE *ofp) {
     execvp(argv[0], (char *const *)argv);
     exit(EXIT_FAILURE);
   }
+  KWEI_PROBE2(exec__spawn, argv[0], pid);
   close(pipefd[1]);
   char buf[sysconf(_SC_PAGESIZE)];
   while (1) {
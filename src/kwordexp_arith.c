@@ -0,0 +1,553 @@
+#include "kwordexp_internal.h"
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct kwei_arith {
+  kwordexp_internal_t *kwa_pkwei;
+  const char *kwa_p;
+  int kwa_noeval;
+  // parentheses, unary operators, assignments and ?: being evaluated; past
+  // kwa_max the input is rejected before it can exhaust the stack
+  size_t kwa_depth;
+  size_t kwa_max;
+} kwei_arith_t;
+
+typedef enum kwei_arith_op {
+  KAONONE = 0,
+  KAOMUL,
+  KAODIV,
+  KAOMOD,
+  KAOADD,
+  KAOSUB,
+  KAOSHL,
+  KAOSHR,
+  KAOLT,
+  KAOLE,
+  KAOGT,
+  KAOGE,
+  KAOEQ,
+  KAONE,
+  KAOBAND,
+  KAOBXOR,
+  KAOBOR,
+  KAOLAND,
+  KAOLOR,
+} kwei_arith_op_t;
+
+static kwei_status_t kwei_arith_comma(kwei_arith_t *pka, intmax_t *pval);
+
+static kwei_status_t kwei_arith_error(kwei_arith_t *pka, kwei_err_t errex) {
+  pka->kwa_pkwei->kwei_errex = errex;
+  pka->kwa_pkwei->kwei_status = KSERROR;
+  return KSERROR;
+}
+
+static kwei_status_t kwei_arith_enter(kwei_arith_t *pka) {
+  if (++pka->kwa_depth > pka->kwa_max)
+    return kwei_arith_error(pka, KESYNTAX);
+  return KSSUCCESS;
+}
+
+static void kwei_arith_skip(kwei_arith_t *pka) {
+  while (isspace((unsigned char)*pka->kwa_p))
+    pka->kwa_p++;
+}
+
+static int kwei_arith_isname(int ch) { return isalnum(ch) || ch == '_'; }
+
+// Parse an integer constant as the shell does: decimal, 0x hex or 0 octal.
+static int kwei_arith_strtoimax(const char *s, const char **pend,
+                                intmax_t *pval) {
+  errno = 0;
+  char *end;
+  *pval = strtoimax(s, &end, 0);
+  if (end == s || errno == ERANGE)
+    return -1;
+  if (kwei_arith_isname((unsigned char)*end))
+    return -1;
+  *pend = end;
+  return 0;
+}
+
+static kwei_status_t kwei_arith_getvar(kwei_arith_t *pka, const char *name,
+                                       intmax_t *pval) {
+  *pval = 0;
+  if (pka->kwa_noeval)
+    return KSSUCCESS;
+  kwordexp_internal_t *pkwei = pka->kwa_pkwei;
+  char *value;
+  kwei_status_t kstat = kwei_getenv(pkwei, name, &value);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  if (value == NULL) {
+    if (pkwei->kwei_flags & KWRDE_UNDEF)
+      return kwei_arith_error(pka, KEUNDEF);
+    return KSSUCCESS;
+  }
+  while (isspace((unsigned char)*value))
+    value++;
+  if (*value == '\0')
+    return KSSUCCESS;
+  const char *end;
+  if (kwei_arith_strtoimax(value, &end, pval) != 0)
+    return kwei_arith_error(pka, KESYNTAX);
+  while (isspace((unsigned char)*end))
+    end++;
+  if (*end != '\0')
+    return kwei_arith_error(pka, KESYNTAX);
+  return KSSUCCESS;
+}
+
+static kwei_status_t kwei_arith_setvar(kwei_arith_t *pka, const char *name,
+                                       intmax_t val) {
+  if (pka->kwa_noeval)
+    return KSSUCCESS;
+  char buf[sizeof(intmax_t) * 3 + 2];
+  snprintf(buf, sizeof(buf), "%jd", val);
+  return kwei_setenv(pka->kwa_pkwei, name, buf, 1);
+}
+
+static kwei_status_t kwei_arith_binop(kwei_arith_t *pka, kwei_arith_op_t op,
+                                      intmax_t lhs, intmax_t rhs,
+                                      intmax_t *pval) {
+  switch (op) {
+  case KAOMUL:
+    *pval = (intmax_t)((uintmax_t)lhs * (uintmax_t)rhs);
+    return KSSUCCESS;
+  case KAODIV:
+  case KAOMOD:
+    if (pka->kwa_noeval) {
+      *pval = 0;
+      return KSSUCCESS;
+    }
+    if (rhs == 0)
+      return kwei_arith_error(pka, KESYNTAX);
+    if (rhs == -1) {
+      *pval = op == KAODIV ? (intmax_t)(0 - (uintmax_t)lhs) : 0;
+      return KSSUCCESS;
+    }
+    *pval = op == KAODIV ? lhs / rhs : lhs % rhs;
+    return KSSUCCESS;
+  case KAOADD:
+    *pval = (intmax_t)((uintmax_t)lhs + (uintmax_t)rhs);
+    return KSSUCCESS;
+  case KAOSUB:
+    *pval = (intmax_t)((uintmax_t)lhs - (uintmax_t)rhs);
+    return KSSUCCESS;
+  case KAOSHL:
+    *pval = (intmax_t)((uintmax_t)lhs << (rhs & (sizeof(intmax_t) * 8 - 1)));
+    return KSSUCCESS;
+  case KAOSHR:
+    *pval = lhs >> (rhs & (sizeof(intmax_t) * 8 - 1));
+    return KSSUCCESS;
+  case KAOLT:
+    *pval = lhs < rhs;
+    return KSSUCCESS;
+  case KAOLE:
+    *pval = lhs <= rhs;
+    return KSSUCCESS;
+  case KAOGT:
+    *pval = lhs > rhs;
+    return KSSUCCESS;
+  case KAOGE:
+    *pval = lhs >= rhs;
+    return KSSUCCESS;
+  case KAOEQ:
+    *pval = lhs == rhs;
+    return KSSUCCESS;
+  case KAONE:
+    *pval = lhs != rhs;
+    return KSSUCCESS;
+  case KAOBAND:
+    *pval = lhs & rhs;
+    return KSSUCCESS;
+  case KAOBXOR:
+    *pval = lhs ^ rhs;
+    return KSSUCCESS;
+  case KAOBOR:
+    *pval = lhs | rhs;
+    return KSSUCCESS;
+  default:
+    return kwei_arith_error(pka, KESYNTAX);
+  }
+}
+
+// Read a variable reference (NAME, $NAME, ${NAME}, $N or $#) into name.
+static int kwei_arith_name(kwei_arith_t *pka, char *name, size_t namesize) {
+  const char *p = pka->kwa_p;
+  int brace = 0;
+  if (*p == '$') {
+    p++;
+    if (*p == '{') {
+      brace = 1;
+      p++;
+    }
+    if (*p == '#' || isdigit((unsigned char)*p)) {
+      if (namesize < 2)
+        return -1;
+      name[0] = *p++;
+      name[1] = '\0';
+      goto done;
+    }
+  }
+  if (!isalpha((unsigned char)*p) && *p != '_')
+    return -1;
+  size_t n = 0;
+  while (kwei_arith_isname((unsigned char)*p)) {
+    if (n + 1 >= namesize)
+      return -1;
+    name[n++] = *p++;
+  }
+  name[n] = '\0';
+done:
+  if (brace && *p++ != '}')
+    return -1;
+  pka->kwa_p = p;
+  return 0;
+}
+
+static kwei_status_t kwei_arith_special(kwei_arith_t *pka, const char *name,
+                                        intmax_t *pval) {
+  kwordexp_internal_t *pkwei = pka->kwa_pkwei;
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  if (name[0] == '#') {
+    if (pkwei->kwei_info != NULL)
+      pkwei->kwei_info->kwi_flags |= KWRDI_ARGS;
+    *pval = (intmax_t)pkwe->kwe_argc - 1;
+    return KSSUCCESS;
+  }
+  size_t n = name[0] - '0';
+  // analyzing only records the reference, as kwei_var_num does
+  if (pkwei->kwei_info != NULL) {
+    pkwei->kwei_info->kwi_argmask |= 1u << n;
+    *pval = 0;
+    return KSSUCCESS;
+  }
+  if (n >= pkwe->kwe_argc) {
+    if (pka->kwa_noeval) {
+      *pval = 0;
+      return KSSUCCESS;
+    }
+    return kwei_arith_error(pka, KENARG);
+  }
+  const char *end;
+  if (kwei_arith_strtoimax(pkwe->kwe_argv[n], &end, pval) != 0 ||
+      *end != '\0')
+    return kwei_arith_error(pka, KESYNTAX);
+  return KSSUCCESS;
+}
+
+static kwei_status_t kwei_arith_unary(kwei_arith_t *pka, intmax_t *pval) {
+  kwei_arith_skip(pka);
+  int ch = (unsigned char)*pka->kwa_p;
+  switch (ch) {
+
+  case '+':
+  case '-':
+  case '!':
+  case '~': {
+    pka->kwa_p++;
+    kwei_status_t kstat = kwei_arith_enter(pka);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    kstat = kwei_arith_unary(pka, pval);
+    pka->kwa_depth--;
+    if (kstat != KSSUCCESS)
+      return kstat;
+    if (ch == '-')
+      *pval = (intmax_t)(0 - (uintmax_t)*pval);
+    else if (ch == '!')
+      *pval = !*pval;
+    else if (ch == '~')
+      *pval = ~*pval;
+    return KSSUCCESS;
+  }
+
+  case '(': {
+    pka->kwa_p++;
+    kwei_status_t kstat = kwei_arith_enter(pka);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    kstat = kwei_arith_comma(pka, pval);
+    pka->kwa_depth--;
+    if (kstat != KSSUCCESS)
+      return kstat;
+    kwei_arith_skip(pka);
+    if (*pka->kwa_p != ')')
+      return kwei_arith_error(pka, KESYNTAX);
+    pka->kwa_p++;
+    return KSSUCCESS;
+  }
+
+  case '0' ... '9': {
+    const char *end;
+    if (kwei_arith_strtoimax(pka->kwa_p, &end, pval) != 0)
+      return kwei_arith_error(pka, KESYNTAX);
+    pka->kwa_p = end;
+    return KSSUCCESS;
+  }
+
+  default: {
+    char name[256];
+    if (kwei_arith_name(pka, name, sizeof(name)) != 0)
+      return kwei_arith_error(pka, KESYNTAX);
+    if (name[0] == '#' || isdigit((unsigned char)name[0]))
+      return kwei_arith_special(pka, name, pval);
+    return kwei_arith_getvar(pka, name, pval);
+  }
+  }
+}
+
+static kwei_arith_op_t kwei_arith_peekop(kwei_arith_t *pka, int level,
+                                         size_t *plen) {
+  const char *p = pka->kwa_p;
+  kwei_arith_op_t op = KAONONE;
+  size_t len = 1;
+  switch (p[0]) {
+  case '*':
+    op = KAOMUL;
+    break;
+  case '/':
+    op = KAODIV;
+    break;
+  case '%':
+    op = KAOMOD;
+    break;
+  case '+':
+    op = KAOADD;
+    break;
+  case '-':
+    op = KAOSUB;
+    break;
+  case '<':
+    if (p[1] == '<')
+      op = KAOSHL, len = 2;
+    else if (p[1] == '=')
+      op = KAOLE, len = 2;
+    else
+      op = KAOLT;
+    break;
+  case '>':
+    if (p[1] == '>')
+      op = KAOSHR, len = 2;
+    else if (p[1] == '=')
+      op = KAOGE, len = 2;
+    else
+      op = KAOGT;
+    break;
+  case '=':
+    if (p[1] == '=')
+      op = KAOEQ, len = 2;
+    break;
+  case '!':
+    if (p[1] == '=')
+      op = KAONE, len = 2;
+    break;
+  case '&':
+    if (p[1] == '&')
+      op = KAOLAND, len = 2;
+    else
+      op = KAOBAND;
+    break;
+  case '^':
+    op = KAOBXOR;
+    break;
+  case '|':
+    if (p[1] == '|')
+      op = KAOLOR, len = 2;
+    else
+      op = KAOBOR;
+    break;
+  }
+  // An operator followed by '=' is an assignment, handled by the caller.
+  if (op != KAONONE && op != KAOEQ && op != KAONE && op != KAOLE &&
+      op != KAOGE && p[len] == '=')
+    return KAONONE;
+
+  static const kwei_arith_op_t levels[][4] = {
+      {KAOMUL, KAODIV, KAOMOD, KAONONE}, {KAOADD, KAOSUB, KAONONE},
+      {KAOSHL, KAOSHR, KAONONE},         {KAOLT, KAOLE, KAOGT, KAOGE},
+      {KAOEQ, KAONE, KAONONE},           {KAOBAND, KAONONE},
+      {KAOBXOR, KAONONE},                {KAOBOR, KAONONE},
+  };
+  for (int i = 0; i < 4 && levels[level][i] != KAONONE; i++) {
+    if (levels[level][i] == op) {
+      *plen = len;
+      return op;
+    }
+  }
+  return KAONONE;
+}
+
+// Binary operators from multiplicative (level 0) to bitwise or (level 7).
+static kwei_status_t kwei_arith_binary(kwei_arith_t *pka, int level,
+                                       intmax_t *pval) {
+  kwei_status_t kstat = level == 0 ? kwei_arith_unary(pka, pval)
+                                   : kwei_arith_binary(pka, level - 1, pval);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  while (1) {
+    kwei_arith_skip(pka);
+    size_t len;
+    kwei_arith_op_t op = kwei_arith_peekop(pka, level, &len);
+    if (op == KAONONE)
+      return KSSUCCESS;
+    pka->kwa_p += len;
+    intmax_t rhs;
+    kstat = level == 0 ? kwei_arith_unary(pka, &rhs)
+                       : kwei_arith_binary(pka, level - 1, &rhs);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    kstat = kwei_arith_binop(pka, op, *pval, rhs, pval);
+    if (kstat != KSSUCCESS)
+      return kstat;
+  }
+}
+
+static kwei_status_t kwei_arith_logical(kwei_arith_t *pka, int is_or,
+                                        intmax_t *pval) {
+  kwei_status_t kstat = is_or ? kwei_arith_logical(pka, 0, pval)
+                              : kwei_arith_binary(pka, 7, pval);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  const char *op = is_or ? "||" : "&&";
+  while (1) {
+    kwei_arith_skip(pka);
+    if (strncmp(pka->kwa_p, op, 2) != 0)
+      return KSSUCCESS;
+    pka->kwa_p += 2;
+    int noeval = pka->kwa_noeval;
+    int decided = is_or ? *pval != 0 : *pval == 0;
+    if (decided)
+      pka->kwa_noeval = 1;
+    intmax_t rhs;
+    kstat = is_or ? kwei_arith_logical(pka, 0, &rhs)
+                  : kwei_arith_binary(pka, 7, &rhs);
+    pka->kwa_noeval = noeval;
+    if (kstat != KSSUCCESS)
+      return kstat;
+    *pval = decided ? is_or : rhs != 0;
+  }
+}
+
+static kwei_status_t kwei_arith_assign(kwei_arith_t *pka, intmax_t *pval);
+
+static kwei_status_t kwei_arith_ternary(kwei_arith_t *pka, intmax_t *pval) {
+  kwei_status_t kstat = kwei_arith_logical(pka, 1, pval);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  kwei_arith_skip(pka);
+  if (*pka->kwa_p != '?')
+    return KSSUCCESS;
+  pka->kwa_p++;
+  kstat = kwei_arith_enter(pka);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  int noeval = pka->kwa_noeval;
+  int cond = *pval != 0;
+  intmax_t tval, fval;
+  pka->kwa_noeval = noeval || !cond;
+  kstat = kwei_arith_comma(pka, &tval);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  kwei_arith_skip(pka);
+  if (*pka->kwa_p != ':')
+    return kwei_arith_error(pka, KESYNTAX);
+  pka->kwa_p++;
+  pka->kwa_noeval = noeval || cond;
+  kstat = kwei_arith_assign(pka, &fval);
+  pka->kwa_noeval = noeval;
+  pka->kwa_depth--;
+  if (kstat != KSSUCCESS)
+    return kstat;
+  *pval = cond ? tval : fval;
+  return KSSUCCESS;
+}
+
+static kwei_status_t kwei_arith_assign(kwei_arith_t *pka, intmax_t *pval) {
+  kwei_arith_skip(pka);
+  const char *start = pka->kwa_p;
+  char name[256];
+  if ((isalpha((unsigned char)*start) || *start == '_') &&
+      kwei_arith_name(pka, name, sizeof(name)) == 0) {
+    kwei_arith_skip(pka);
+    const char *p = pka->kwa_p;
+    kwei_arith_op_t op = KAONONE;
+    size_t len = 0;
+    if (p[0] == '=' && p[1] != '=') {
+      len = 1;
+    } else if (p[0] != '\0' && p[1] == '=' && strchr("*/%+-&^|", p[0])) {
+      static const char ops[] = "*/%+-&^|";
+      static const kwei_arith_op_t opv[] = {KAOMUL, KAODIV, KAOMOD,
+                                            KAOADD, KAOSUB, KAOBAND,
+                                            KAOBXOR, KAOBOR};
+      op = opv[strchr(ops, p[0]) - ops];
+      len = 2;
+    } else if ((p[0] == '<' || p[0] == '>') && p[1] == p[0] && p[2] == '=') {
+      op = p[0] == '<' ? KAOSHL : KAOSHR;
+      len = 3;
+    }
+    if (len > 0) {
+      pka->kwa_p += len;
+      intmax_t rhs;
+      kwei_status_t kstat = kwei_arith_enter(pka);
+      if (kstat != KSSUCCESS)
+        return kstat;
+      kstat = kwei_arith_assign(pka, &rhs);
+      pka->kwa_depth--;
+      if (kstat != KSSUCCESS)
+        return kstat;
+      if (op != KAONONE) {
+        intmax_t lhs;
+        kstat = kwei_arith_getvar(pka, name, &lhs);
+        if (kstat != KSSUCCESS)
+          return kstat;
+        kstat = kwei_arith_binop(pka, op, lhs, rhs, &rhs);
+        if (kstat != KSSUCCESS)
+          return kstat;
+      }
+      *pval = rhs;
+      return kwei_arith_setvar(pka, name, rhs);
+    }
+    pka->kwa_p = start;
+  }
+  return kwei_arith_ternary(pka, pval);
+}
+
+static kwei_status_t kwei_arith_comma(kwei_arith_t *pka, intmax_t *pval) {
+  while (1) {
+    kwei_status_t kstat = kwei_arith_assign(pka, pval);
+    if (kstat != KSSUCCESS)
+      return kstat;
+    kwei_arith_skip(pka);
+    if (*pka->kwa_p != ',')
+      return KSSUCCESS;
+    pka->kwa_p++;
+  }
+}
+
+kwei_status_t kwei_arith_eval(kwordexp_internal_t *pkwei, const char *expr,
+                              intmax_t *pval) {
+  kwei_arith_t ka;
+  ka.kwa_pkwei = pkwei;
+  ka.kwa_p = expr;
+  ka.kwa_noeval = 0;
+  ka.kwa_depth = 0;
+  ka.kwa_max = pkwei->kwei_frames->kwf_max;
+  kwei_arith_skip(&ka);
+  if (*ka.kwa_p == '\0') {
+    *pval = 0;
+    return KSSUCCESS;
+  }
+  kwei_status_t kstat = kwei_arith_comma(&ka, pval);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  kwei_arith_skip(&ka);
+  if (*ka.kwa_p != '\0')
+    return kwei_arith_error(&ka, KESYNTAX);
+  return KSSUCCESS;
+}
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct kwei_brace_seg kwei_brace_seg_t;
+
+struct kwei_brace_seg {
+  const char *kbs_p;
+  size_t kbs_len;
+  const kwei_brace_seg_t *kbs_next;
+};
+
+typedef struct kwei_brace {
+  kwordexp_internal_t *kwb_pkwei;
+  char *kwb_buf;
+  size_t kwb_len;
+  size_t kwb_size;
+  // kwei_brace_gen calls in progress; every group and literal run adds some
+  size_t kwb_depth;
+} kwei_brace_t;
+
+typedef struct kwei_brace_range {
+  intmax_t kbr_from;
+  intmax_t kbr_to;
+  // the magnitude, which for INTMAX_MIN only fits unsigned
+  uintmax_t kbr_step;
+  int kbr_width;
+  int kbr_alpha;
+} kwei_brace_range_t;
+
+static kwei_status_t kwei_brace_gen(kwei_brace_t *pkb,
+                                    const kwei_brace_seg_t *pseg);
+static kwei_status_t kwei_brace_walk(kwei_brace_t *pkb,
+                                     const kwei_brace_seg_t *pseg);
+
+static kwei_status_t kwei_brace_syserr(kwei_brace_t *pkb, int err) {
+  pkb->kwb_pkwei->kwei_errno = err;
+  pkb->kwb_pkwei->kwei_errex = KESYSTEM;
+  pkb->kwb_pkwei->kwei_status = KSERROR;
+  return KSERROR;
+}
+
+static kwei_status_t kwei_brace_append(kwei_brace_t *pkb, const char *p,
+                                       size_t len) {
+  if (pkb->kwb_len + len + 1 > pkb->kwb_size) {
+    size_t size = pkb->kwb_size > 0 ? pkb->kwb_size : 64;
+    while (size < pkb->kwb_len + len + 1)
+      size *= 2;
+    char *buf = ksrealloc(pkb->kwb_buf, size);
+    if (buf == NULL)
+      return kwei_brace_syserr(pkb, errno);
+    pkb->kwb_buf = buf;
+    pkb->kwb_size = size;
+  }
+  memcpy(pkb->kwb_buf + pkb->kwb_len, p, len);
+  pkb->kwb_len += len;
+  pkb->kwb_buf[pkb->kwb_len] = '\0';
+  return KSSUCCESS;
+}
+
+static kwei_status_t kwei_brace_emit(kwei_brace_t *pkb) {
+  kwordexp_internal_t *pkwei = pkb->kwb_pkwei;
+  if (++pkwei->kwei_nbrace > KWEI_BRACE_MAX)
+    return kwei_brace_syserr(pkb, E2BIG);
+  const char *word = pkb->kwb_buf != NULL ? pkb->kwb_buf : "";
+  return kwei_expand_word(pkwei, word, pkb->kwb_len,
+                          !(pkwei->kwei_flags & KWRDE_NOGLOB) &&
+                              kwei_has_wildcard(word, pkb->kwb_len));
+}
+
+static int kwei_brace_int(const char *p, size_t len, intmax_t *pval) {
+  char buf[32];
+  if (len == 0 || len >= sizeof(buf))
+    return -1;
+  memcpy(buf, p, len);
+  buf[len] = '\0';
+  char *end;
+  errno = 0;
+  *pval = strtoimax(buf, &end, 10);
+  if (*end != '\0' || errno == ERANGE || !isdigit((unsigned char)end[-1]))
+    return -1;
+  return 0;
+}
+
+static int kwei_brace_padded(const char *p, size_t len) {
+  if (len > 0 && *p == '-')
+    p++, len--;
+  return len > 1 && *p == '0';
+}
+
+// Parse "x..y" or "x..y..step" where x and y are integers or single letters.
+static int kwei_brace_range(const char *p, size_t len,
+                            kwei_brace_range_t *pkbr) {
+  const char *dots = memmem(p, len, "..", 2);
+  if (dots == NULL)
+    return -1;
+  const char *to = dots + 2;
+  const char *end = p + len;
+  const char *step = memmem(to, end - to, "..", 2);
+  size_t fromlen = dots - p;
+  size_t tolen = (step != NULL ? step : end) - to;
+  pkbr->kbr_step = 1;
+  if (step != NULL) {
+    intmax_t n;
+    if (kwei_brace_int(step + 2, end - step - 2, &n) != 0)
+      return -1;
+    pkbr->kbr_step = n < 0 ? -(uintmax_t)n : (uintmax_t)n;
+    if (pkbr->kbr_step == 0)
+      pkbr->kbr_step = 1;
+  }
+  pkbr->kbr_width = 0;
+  pkbr->kbr_alpha = 0;
+  if (fromlen == 1 && tolen == 1 && isalpha((unsigned char)*p) &&
+      isalpha((unsigned char)*to)) {
+    pkbr->kbr_alpha = 1;
+    pkbr->kbr_from = (unsigned char)*p;
+    pkbr->kbr_to = (unsigned char)*to;
+    return 0;
+  }
+  if (kwei_brace_int(p, fromlen, &pkbr->kbr_from) != 0 ||
+      kwei_brace_int(to, tolen, &pkbr->kbr_to) != 0)
+    return -1;
+  if (kwei_brace_padded(p, fromlen) || kwei_brace_padded(to, tolen))
+    pkbr->kbr_width = fromlen > tolen ? fromlen : tolen;
+  return 0;
+}
+
+// Find the first brace group in p[0..len) that expands: it must have a
+// matching close brace and either a top level comma or a valid range.
+static int kwei_brace_find(const char *p, size_t len, size_t *popen,
+                           size_t *pclose, int *pcomma) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] == '\\') {
+      i++;
+      continue;
+    }
+    if (p[i] != '{')
+      continue;
+    int depth = 0;
+    int comma = 0;
+    for (size_t j = i + 1; j < len; j++) {
+      if (p[j] == '\\') {
+        j++;
+      } else if (p[j] == '{') {
+        depth++;
+      } else if (p[j] == ',' && depth == 0) {
+        comma = 1;
+      } else if (p[j] == '}' && depth-- == 0) {
+        kwei_brace_range_t kbr;
+        if (comma || kwei_brace_range(p + i + 1, j - i - 1, &kbr) == 0) {
+          *popen = i;
+          *pclose = j;
+          *pcomma = comma;
+          return 0;
+        }
+        break;
+      }
+    }
+  }
+  return -1;
+}
+
+static kwei_status_t kwei_brace_alt(kwei_brace_t *pkb, const char *p,
+                                    size_t len, const kwei_brace_seg_t *prest) {
+  kwei_brace_seg_t seg = {p, len, prest};
+  size_t base = pkb->kwb_len;
+  kwei_status_t kstat = kwei_brace_gen(pkb, &seg);
+  pkb->kwb_len = base;
+  return kstat;
+}
+
+static kwei_status_t kwei_brace_gen(kwei_brace_t *pkb,
+                                    const kwei_brace_seg_t *pseg) {
+  while (pseg != NULL && pseg->kbs_len == 0)
+    pseg = pseg->kbs_next;
+  if (pseg == NULL)
+    return kwei_brace_emit(pkb);
+  // the first descent reaches every group before anything is emitted, so a
+  // word with too many groups fails before producing any words
+  if (pkb->kwb_depth >= KWEI_BRACE_DEPTH)
+    return kwei_brace_syserr(pkb, E2BIG);
+  pkb->kwb_depth++;
+  kwei_status_t kstat = kwei_brace_walk(pkb, pseg);
+  pkb->kwb_depth--;
+  return kstat;
+}
+
+static kwei_status_t kwei_brace_walk(kwei_brace_t *pkb,
+                                     const kwei_brace_seg_t *pseg) {
+
+  const char *p = pseg->kbs_p;
+  size_t len = pseg->kbs_len;
+  size_t open, close;
+  int comma;
+  size_t base = pkb->kwb_len;
+  if (kwei_brace_find(p, len, &open, &close, &comma) != 0) {
+    kwei_status_t kstat = kwei_brace_append(pkb, p, len);
+    if (kstat == KSSUCCESS)
+      kstat = kwei_brace_gen(pkb, pseg->kbs_next);
+    pkb->kwb_len = base;
+    return kstat;
+  }
+
+  kwei_status_t kstat = kwei_brace_append(pkb, p, open);
+  if (kstat != KSSUCCESS)
+    return kstat;
+  kwei_brace_seg_t rest = {p + close + 1, len - close - 1, pseg->kbs_next};
+  const char *body = p + open + 1;
+  size_t bodylen = close - open - 1;
+
+  if (comma) {
+    size_t start = 0;
+    int depth = 0;
+    for (size_t i = 0; i <= bodylen && kstat == KSSUCCESS; i++) {
+      if (i < bodylen && body[i] == '\\') {
+        i++;
+        continue;
+      }
+      if (i < bodylen && body[i] == '{')
+        depth++;
+      else if (i < bodylen && body[i] == '}')
+        depth--;
+      else if (i == bodylen || (body[i] == ',' && depth == 0)) {
+        kstat = kwei_brace_alt(pkb, body + start, i - start, &rest);
+        start = i + 1;
+      }
+    }
+  } else {
+    kwei_brace_range_t kbr;
+    int ret = kwei_brace_range(body, bodylen, &kbr);
+    (void)ret;
+    int up = kbr.kbr_from <= kbr.kbr_to;
+    for (intmax_t v = kbr.kbr_from; kstat == KSSUCCESS;) {
+      char buf[sizeof(intmax_t) * 3 + 4];
+      int n;
+      if (kbr.kbr_alpha) {
+        n = 0;
+        // letters between 'Z' and 'a' are pattern and quote characters
+        if (kwei_ismeta((int)v)) {
+          buf[n++] = '\\';
+          pkb->kwb_pkwei->kwei_has_escape = 1;
+        }
+        buf[n++] = (char)v;
+      } else {
+        n = snprintf(buf, sizeof(buf), "%0*jd", kbr.kbr_width, v);
+      }
+      kstat = kwei_brace_alt(pkb, buf, n, &rest);
+      // the distance left to kbr_to, unsigned so that it cannot overflow
+      uintmax_t left = up ? (uintmax_t)kbr.kbr_to - (uintmax_t)v
+                          : (uintmax_t)v - (uintmax_t)kbr.kbr_to;
+      if (left < kbr.kbr_step)
+        break;
+      v = up ? (intmax_t)((uintmax_t)v + kbr.kbr_step)
+             : (intmax_t)((uintmax_t)v - kbr.kbr_step);
+    }
+  }
+  pkb->kwb_len = base;
+  return kstat;
+}
+
+kwei_status_t kwei_brace_expand(kwordexp_internal_t *pkwei, const char *word,
+                                size_t len) {
+  kwei_brace_t kb;
+  kb.kwb_pkwei = pkwei;
+  kb.kwb_buf = NULL;
+  kb.kwb_len = 0;
+  kb.kwb_size = 0;
+  kb.kwb_depth = 0;
+  kwei_brace_seg_t seg = {word, len, NULL};
+  kwei_status_t kstat = kwei_brace_gen(&kb, &seg);
+  if (kb.kwb_buf != NULL)
+    ksfree(kb.kwb_buf);
+  return kstat;
+}
@@ -0,0 +1,342 @@
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KWEI_CACHE_BUCKETS 256
+
+typedef struct kwei_cachent kwei_cachent_t;
+
+struct kwei_cachent {
+  kwei_cachent_t *kce_next;
+  kwei_cachent_t *kce_lruprev;
+  kwei_cachent_t *kce_lrunext;
+  size_t kce_hash;
+  // key
+  char *kce_input;
+  size_t kce_inputlen;
+  int kce_flags;
+  kwordexp_t kce_kwe;
+  // dependencies
+  char **kce_namev;
+  size_t kce_namec;
+  unsigned long kce_envgen;
+  unsigned long kce_fsgen;
+  int kce_glob;
+  // result
+  char **kce_wordv;
+  size_t kce_wordc;
+};
+
+struct kwordexp_cache {
+  pthread_mutex_t kc_lock;
+  kwei_cachent_t *kc_bucket[KWEI_CACHE_BUCKETS];
+  kwei_cachent_t *kc_head;
+  kwei_cachent_t *kc_tail;
+  size_t kc_count;
+  size_t kc_max;
+  // bumped by every invalidation; stale entries are removed right away
+  unsigned long kc_gen;
+};
+
+static size_t kwei_cache_hash(const kwordexp_t *pkwe, const char *input,
+                              size_t len, int flags) {
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)input[i]) * 1099511628211ULL;
+  hash = (hash ^ (unsigned)flags) * 1099511628211ULL;
+  hash = (hash ^ (uintptr_t)pkwe->kwe_argv) * 1099511628211ULL;
+  return hash ^ pkwe->kwe_argc;
+}
+
+// Everything besides the input and flags that feeds the expansion and is
+// not tracked as a dependency.
+static int kwei_cache_same(const kwordexp_t *pa, const kwordexp_t *pb) {
+  return pa->kwe_argv == pb->kwe_argv && pa->kwe_argc == pb->kwe_argc &&
+         pa->kwe_getenv == pb->kwe_getenv &&
+         pa->kwe_getenvv == pb->kwe_getenvv && pa->kwe_env == pb->kwe_env &&
+         pa->kwe_data == pb->kwe_data &&
+         pa->kwe_glob_max == pb->kwe_glob_max &&
+         pa->kwe_depth_max == pb->kwe_depth_max;
+}
+
+static void kwei_cachent_destroy(kwei_cachent_t *pkce) {
+  for (size_t i = 0; i < pkce->kce_namec; i++)
+    ksfree(pkce->kce_namev[i]);
+  for (size_t i = 0; i < pkce->kce_wordc; i++)
+    ksfree(pkce->kce_wordv[i]);
+  if (pkce->kce_namev != NULL)
+    ksfree(pkce->kce_namev);
+  if (pkce->kce_wordv != NULL)
+    ksfree(pkce->kce_wordv);
+  if (pkce->kce_input != NULL)
+    ksfree(pkce->kce_input);
+  ksfree(pkce);
+}
+
+static void kwei_cache_unlink(kwordexp_cache_t *pkc, kwei_cachent_t *pkce) {
+  kwei_cachent_t **pp = &pkc->kc_bucket[pkce->kce_hash % KWEI_CACHE_BUCKETS];
+  while (*pp != pkce)
+    pp = &(*pp)->kce_next;
+  *pp = pkce->kce_next;
+  if (pkce->kce_lruprev != NULL)
+    pkce->kce_lruprev->kce_lrunext = pkce->kce_lrunext;
+  else
+    pkc->kc_head = pkce->kce_lrunext;
+  if (pkce->kce_lrunext != NULL)
+    pkce->kce_lrunext->kce_lruprev = pkce->kce_lruprev;
+  else
+    pkc->kc_tail = pkce->kce_lruprev;
+  pkc->kc_count--;
+  kwei_cachent_destroy(pkce);
+}
+
+static void kwei_cache_push(kwordexp_cache_t *pkc, kwei_cachent_t *pkce) {
+  pkce->kce_lruprev = NULL;
+  pkce->kce_lrunext = pkc->kc_head;
+  if (pkc->kc_head != NULL)
+    pkc->kc_head->kce_lruprev = pkce;
+  else
+    pkc->kc_tail = pkce;
+  pkc->kc_head = pkce;
+}
+
+static kwei_cachent_t *kwei_cache_find(kwordexp_cache_t *pkc, size_t hash,
+                                       const kwordexp_t *pkwe,
+                                       const char *input, size_t len,
+                                       int flags) {
+  kwei_cachent_t *pkce = pkc->kc_bucket[hash % KWEI_CACHE_BUCKETS];
+  while (pkce != NULL &&
+         (pkce->kce_hash != hash || pkce->kce_flags != flags ||
+          !kwei_cache_same(&pkce->kce_kwe, pkwe) ||
+          pkce->kce_inputlen != len ||
+          memcmp(pkce->kce_input, input, len) != 0))
+    pkce = pkce->kce_next;
+  return pkce;
+}
+
+// ----------------------------------------------------------------
+// Dependency recording
+// ----------------------------------------------------------------
+
+static unsigned long kwei_cache_envgen(const kwordexp_t *pkwe) {
+  return pkwe->kwe_env != NULL ? kwei_env_gen(pkwe->kwe_env) : 0;
+}
+
+void kwei_deps_init(kwei_deps_t *pdeps, kwordexp_cache_t *pkc,
+                    const kwordexp_t *pkwe) {
+  memset(pdeps, 0, sizeof(*pdeps));
+  pthread_mutex_lock(&pkc->kc_lock);
+  pdeps->kdp_gen = pkc->kc_gen;
+  pthread_mutex_unlock(&pkc->kc_lock);
+  // taken before expanding, so a change while expanding leaves it stale
+  pdeps->kdp_envgen = kwei_cache_envgen(pkwe);
+  pdeps->kdp_fsok = kwei_dircache_gen(&pdeps->kdp_fsgen) == 0;
+}
+
+void kwei_deps_free(kwei_deps_t *pdeps) {
+  for (size_t i = 0; i < pdeps->kdp_namec; i++)
+    ksfree(pdeps->kdp_namev[i]);
+  if (pdeps->kdp_namev != NULL)
+    ksfree(pdeps->kdp_namev);
+}
+
+void kwei_deps_var(kwordexp_internal_t *pkwei, const char *name) {
+  kwei_deps_t *pdeps = pkwei->kwei_deps;
+  if (pdeps == NULL || pdeps->kdp_volatile)
+    return;
+  for (size_t i = 0; i < pdeps->kdp_namec; i++)
+    if (strcmp(pdeps->kdp_namev[i], name) == 0)
+      return;
+  if (pdeps->kdp_namec == pdeps->kdp_namecap) {
+    size_t namecap = pdeps->kdp_namecap > 0 ? pdeps->kdp_namecap * 2 : 8;
+    char **namev = ksrealloc(pdeps->kdp_namev, namecap * sizeof(char *));
+    if (namev == NULL) {
+      pdeps->kdp_volatile = 1;
+      return;
+    }
+    pdeps->kdp_namev = namev;
+    pdeps->kdp_namecap = namecap;
+  }
+  char *copy = ksstrdup(name);
+  if (copy == NULL) {
+    pdeps->kdp_volatile = 1;
+    return;
+  }
+  pdeps->kdp_namev[pdeps->kdp_namec++] = copy;
+}
+
+void kwei_deps_volatile(kwordexp_internal_t *pkwei) {
+  if (pkwei->kwei_deps != NULL)
+    pkwei->kwei_deps->kdp_volatile = 1;
+}
+
+void kwei_deps_glob(kwordexp_internal_t *pkwei) {
+  kwei_deps_t *pdeps = pkwei->kwei_deps;
+  if (pdeps == NULL)
+    return;
+  kwordexp_t *pkwe = pkwei->kwei_pwe;
+  // only the directory cache tells when a listing changes
+  if (!(pkwei->kwei_flags & KWRDE_GLOBCACHE) || !pdeps->kdp_fsok ||
+      pkwe->kwe_glob != NULL || pkwe->kwe_readdir != NULL)
+    pdeps->kdp_volatile = 1;
+  pdeps->kdp_glob = 1;
+}
+
+// ----------------------------------------------------------------
+// Cache
+// ----------------------------------------------------------------
+
+int kwei_cache_lookup(kwordexp_cache_t *pkc, kwordexp_t *pkwe,
+                      const char *input, size_t len, int flags) {
+  size_t hash = kwei_cache_hash(pkwe, input, len, flags);
+  unsigned long envgen = kwei_cache_envgen(pkwe);
+  unsigned long fsgen = 0;
+  int fsok = kwei_dircache_gen(&fsgen) == 0;
+  pthread_mutex_lock(&pkc->kc_lock);
+  kwei_cachent_t *pkce = kwei_cache_find(pkc, hash, pkwe, input, len, flags);
+  if (pkce == NULL) {
+    pthread_mutex_unlock(&pkc->kc_lock);
+    return 0;
+  }
+  if (pkce->kce_envgen != envgen ||
+      (pkce->kce_glob && (!fsok || pkce->kce_fsgen != fsgen))) {
+    kwei_cache_unlink(pkc, pkce);
+    pthread_mutex_unlock(&pkc->kc_lock);
+    return 0;
+  }
+  size_t wordc = pkwe->kwe_wordc;
+  size_t size = (wordc + pkce->kce_wordc + 1) * sizeof(char *);
+  char **wordv = krealloc(pkwe->kwe_wordv, size);
+  if (wordv == NULL) {
+    pthread_mutex_unlock(&pkc->kc_lock);
+    return -1;
+  }
+  pkwe->kwe_wordv = wordv;
+  for (size_t i = 0; i < pkce->kce_wordc; i++) {
+    char *word = kstrdup(pkce->kce_wordv[i]);
+    if (word == NULL) {
+      wordv[pkwe->kwe_wordc] = NULL;
+      pthread_mutex_unlock(&pkc->kc_lock);
+      return -1;
+    }
+    wordv[pkwe->kwe_wordc++] = word;
+  }
+  wordv[pkwe->kwe_wordc] = NULL;
+  if (pkc->kc_head != pkce) {
+    pkce->kce_lruprev->kce_lrunext = pkce->kce_lrunext;
+    if (pkce->kce_lrunext != NULL)
+      pkce->kce_lrunext->kce_lruprev = pkce->kce_lruprev;
+    else
+      pkc->kc_tail = pkce->kce_lruprev;
+    kwei_cache_push(pkc, pkce);
+  }
+  pthread_mutex_unlock(&pkc->kc_lock);
+  return 1;
+}
+
+void kwei_cache_store(kwordexp_cache_t *pkc, const kwordexp_t *pkwe,
+                      const char *input, size_t len, int flags,
+                      kwei_deps_t *pdeps, size_t wordc) {
+  if (pdeps->kdp_volatile)
+    return;
+  kwei_cachent_t *pkce = ksmalloc(sizeof(kwei_cachent_t));
+  if (pkce == NULL)
+    return;
+  memset(pkce, 0, sizeof(*pkce));
+  pkce->kce_hash = kwei_cache_hash(pkwe, input, len, flags);
+  pkce->kce_flags = flags;
+  pkce->kce_kwe = *pkwe;
+  pkce->kce_kwe.kwe_wordv = NULL;
+  pkce->kce_kwe.kwe_wordc = 0;
+  pkce->kce_envgen = pdeps->kdp_envgen;
+  pkce->kce_glob = pdeps->kdp_glob;
+  pkce->kce_fsgen = pdeps->kdp_fsgen;
+  // the names move over to the entry
+  pkce->kce_namev = pdeps->kdp_namev;
+  pkce->kce_namec = pdeps->kdp_namec;
+  pdeps->kdp_namev = NULL;
+  pdeps->kdp_namec = 0;
+  pkce->kce_input = ksmalloc(len + 1);
+  pkce->kce_inputlen = len;
+  if (pkce->kce_input != NULL) {
+    memcpy(pkce->kce_input, input, len);
+    pkce->kce_input[len] = '\0';
+  }
+  pkce->kce_wordc = pkwe->kwe_wordc - wordc;
+  pkce->kce_wordv = ksmalloc((pkce->kce_wordc + 1) * sizeof(char *));
+  if (pkce->kce_input == NULL || pkce->kce_wordv == NULL) {
+    pkce->kce_wordc = 0;
+    kwei_cachent_destroy(pkce);
+    return;
+  }
+  for (size_t i = 0; i < pkce->kce_wordc; i++) {
+    if ((pkce->kce_wordv[i] = ksstrdup(pkwe->kwe_wordv[wordc + i])) == NULL) {
+      pkce->kce_wordc = i;
+      kwei_cachent_destroy(pkce);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&pkc->kc_lock);
+  // an invalidation while expanding leaves the result stale already
+  if (pdeps->kdp_gen != pkc->kc_gen) {
+    pthread_mutex_unlock(&pkc->kc_lock);
+    kwei_cachent_destroy(pkce);
+    return;
+  }
+  kwei_cachent_t *pold =
+      kwei_cache_find(pkc, pkce->kce_hash, pkwe, input, len, flags);
+  if (pold != NULL)
+    kwei_cache_unlink(pkc, pold);
+  kwei_cachent_t **pp = &pkc->kc_bucket[pkce->kce_hash % KWEI_CACHE_BUCKETS];
+  pkce->kce_next = *pp;
+  *pp = pkce;
+  kwei_cache_push(pkc, pkce);
+  pkc->kc_count++;
+  while (pkc->kc_count > pkc->kc_max)
+    kwei_cache_unlink(pkc, pkc->kc_tail);
+  pthread_mutex_unlock(&pkc->kc_lock);
+}
+
+kwordexp_cache_t *kwordexp_cache_new(size_t max) {
+  kwordexp_cache_t *pkc = ksmalloc(sizeof(kwordexp_cache_t));
+  if (pkc == NULL)
+    return NULL;
+  memset(pkc, 0, sizeof(*pkc));
+  pthread_mutex_init(&pkc->kc_lock, NULL);
+  pkc->kc_max = max > 0 ? max : KWEI_CACHE_MAX;
+  return pkc;
+}
+
+void kwordexp_cache_invalidate(kwordexp_cache_t *pkc, const char *name) {
+  pthread_mutex_lock(&pkc->kc_lock);
+  pkc->kc_gen++;
+  if (name == NULL) {
+    while (pkc->kc_head != NULL)
+      kwei_cache_unlink(pkc, pkc->kc_head);
+    pthread_mutex_unlock(&pkc->kc_lock);
+    return;
+  }
+  kwei_cachent_t *pkce = pkc->kc_head;
+  while (pkce != NULL) {
+    kwei_cachent_t *next = pkce->kce_lrunext;
+    for (size_t i = 0; i < pkce->kce_namec; i++) {
+      if (strcmp(pkce->kce_namev[i], name) == 0) {
+        kwei_cache_unlink(pkc, pkce);
+        break;
+      }
+    }
+    pkce = next;
+  }
+  pthread_mutex_unlock(&pkc->kc_lock);
+}
+
+void kwordexp_cache_free(kwordexp_cache_t *pkc) {
+  while (pkc->kc_head != NULL)
+    kwei_cache_unlink(pkc, pkc->kc_head);
+  pthread_mutex_destroy(&pkc->kc_lock);
+  ksfree(pkc);
+}
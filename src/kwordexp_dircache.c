@@ -0,0 +1,484 @@
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define KWEI_DIRCACHE_BUCKETS 1024
+
+#define KWEI_DIRCACHE_MASK                                                     \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |      \
+   IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct kwei_dircache {
+  pthread_mutex_t kdc_lock;
+  kwei_dir_t *kdc_bucket[KWEI_DIRCACHE_BUCKETS];
+  kwei_dir_t *kdc_wdbucket[KWEI_DIRCACHE_BUCKETS];
+  kwei_dir_t *kdc_head;
+  kwei_dir_t *kdc_tail;
+  size_t kdc_count;
+  // entries revalidated by mtime, whose changes do not bump kdc_gen
+  size_t kdc_nunwatched;
+  int kdc_state;
+  int kdc_ifd;
+  unsigned long kdc_gen;
+} kwei_dircache_t;
+
+static kwei_dircache_t kwei_dircache = {
+    .kdc_lock = PTHREAD_MUTEX_INITIALIZER,
+    .kdc_ifd = -1,
+};
+
+static size_t kwei_dircache_hash(const char *path) {
+  size_t hash = 14695981039346656037ULL;
+  while (*path != '\0')
+    hash = (hash ^ (unsigned char)*path++) * 1099511628211ULL;
+  return hash;
+}
+
+static int kwei_dirent_cmp(const void *a, const void *b) {
+  return strcmp(((const kwei_dirent_t *)a)->kde_name,
+                ((const kwei_dirent_t *)b)->kde_name);
+}
+
+kwei_dir_t *kwei_dir_new(void) {
+  kwei_dir_t *pkd = ksmalloc(sizeof(kwei_dir_t));
+  if (pkd == NULL)
+    return NULL;
+  memset(pkd, 0, sizeof(*pkd));
+  pkd->kd_wd = -1;
+  pkd->kd_refs = 1;
+  return pkd;
+}
+
+int kwei_dir_add(kwei_dir_t *pkd, const char *name, unsigned char type) {
+  size_t namelen = strlen(name) + 1;
+  if (pkd->kd_entc == pkd->kd_entcap) {
+    size_t entcap = pkd->kd_entcap > 0 ? pkd->kd_entcap * 2 : 64;
+    kwei_dirent_t *entv =
+        ksrealloc(pkd->kd_entv, entcap * sizeof(kwei_dirent_t));
+    if (entv == NULL)
+      return -1;
+    pkd->kd_entv = entv;
+    pkd->kd_entcap = entcap;
+  }
+  if (pkd->kd_bloblen + namelen > pkd->kd_blobsize) {
+    size_t blobsize = pkd->kd_blobsize > 0 ? pkd->kd_blobsize * 2 : 1024;
+    while (pkd->kd_bloblen + namelen > blobsize)
+      blobsize *= 2;
+    char *blob = ksrealloc(pkd->kd_blob, blobsize);
+    if (blob == NULL)
+      return -1;
+    pkd->kd_blob = blob;
+    pkd->kd_blobsize = blobsize;
+  }
+  memcpy(pkd->kd_blob + pkd->kd_bloblen, name, namelen);
+  // offsets for now; the blob may still move
+  kwei_dirent_t *pkde = &pkd->kd_entv[pkd->kd_entc];
+  pkde->kde_name = (const char *)(uintptr_t)pkd->kd_bloblen;
+  pkde->kde_type = type;
+  pkd->kd_entc++;
+  pkd->kd_bloblen += namelen;
+  return 0;
+}
+
+void kwei_dir_finish(kwei_dir_t *pkd) {
+  for (size_t i = 0; i < pkd->kd_entc; i++) {
+    kwei_dirent_t *pkde = &pkd->kd_entv[i];
+    pkde->kde_name = pkd->kd_blob + (uintptr_t)pkde->kde_name;
+  }
+  qsort(pkd->kd_entv, pkd->kd_entc, sizeof(kwei_dirent_t), kwei_dirent_cmp);
+  // providers may report a name more than once
+  size_t n = 0;
+  for (size_t i = 0; i < pkd->kd_entc; i++)
+    if (n == 0 || strcmp(pkd->kd_entv[n - 1].kde_name,
+                         pkd->kd_entv[i].kde_name) != 0)
+      pkd->kd_entv[n++] = pkd->kd_entv[i];
+  pkd->kd_entc = n;
+}
+
+// List the directory open at fd, which stays open and owned by the caller.
+kwei_dir_t *kwei_dir_loadat(int fd) {
+  int dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dfd == -1)
+    return NULL;
+  DIR *dir = fdopendir(dfd);
+  if (dir == NULL) {
+    int err = errno;
+    close(dfd);
+    errno = err;
+    return NULL;
+  }
+  struct stat st;
+  kwei_dir_t *pkd = NULL;
+  int err = 0;
+  if (fstat(dfd, &st) == -1 || (pkd = kwei_dir_new()) == NULL)
+    err = errno;
+  while (err == 0) {
+    errno = 0;
+    struct dirent *ent = readdir(dir);
+    if (ent == NULL) {
+      err = errno;
+      break;
+    }
+    if (kwei_dir_add(pkd, ent->d_name, ent->d_type) != 0)
+      err = errno;
+  }
+  closedir(dir);
+  if (err != 0) {
+    if (pkd != NULL)
+      kwei_dir_release(pkd);
+    errno = err;
+    return NULL;
+  }
+  kwei_dir_finish(pkd);
+  pkd->kd_mtime = st.st_mtim;
+  return pkd;
+}
+
+kwei_dir_t *kwei_dir_load(const char *path) {
+  int fd = open(*path != '\0' ? path : ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  kwei_dir_t *pkd = kwei_dir_loadat(fd);
+  int err = errno;
+  close(fd);
+  errno = err;
+  return pkd;
+}
+
+// The shared cache key of a listing: the directory's device and inode,
+// which name it whatever path or working directory reached it, and the
+// modification time it was read at, so that a changed directory is simply
+// missed
+typedef struct kwei_dir_key {
+  int64_t kdk_dev;
+  int64_t kdk_ino;
+  int64_t kdk_sec;
+  int64_t kdk_nsec;
+} kwei_dir_key_t;
+
+static void kwei_dir_key(kwei_dir_key_t *pkey, const struct stat *pst,
+                         const struct timespec *pmtime) {
+  memset(pkey, 0, sizeof(*pkey));
+  pkey->kdk_dev = pst->st_dev;
+  pkey->kdk_ino = pst->st_ino;
+  pkey->kdk_sec = pmtime->tv_sec;
+  pkey->kdk_nsec = pmtime->tv_nsec;
+}
+
+// List the directory open at fd through the shared cache; fd stays open and
+// owned by the caller, as with kwei_dir_loadat.
+kwei_dir_t *kwei_dir_load_shared(kwordexp_shcache_t *pshc, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return NULL;
+  kwei_dir_key_t key;
+  kwei_dir_key(&key, &st, &st.st_mtim);
+  size_t len;
+  int64_t aux;
+  char *value = kwei_shcache_get(pshc, KWEI_SHCACHE_DIR, (const char *)&key,
+                                 sizeof(key), &len, &aux);
+  if (value != NULL) {
+    // a type byte and a NUL-terminated name per entry, already sorted
+    kwei_dir_t *pkd = kwei_dir_new();
+    for (size_t off = 0; pkd != NULL && off < len;) {
+      const char *name = value + off + 1;
+      if (kwei_dir_add(pkd, name, value[off]) != 0) {
+        kwei_dir_release(pkd);
+        pkd = NULL;
+      }
+      off += strlen(name) + 2;
+    }
+    ksfree(value);
+    if (pkd == NULL)
+      return NULL;
+    kwei_dir_finish(pkd);
+    pkd->kd_mtime = st.st_mtim;
+    return pkd;
+  }
+
+  kwei_dir_t *pkd = kwei_dir_loadat(fd);
+  if (pkd == NULL)
+    return NULL;
+  // keyed by the time kwei_dir_loadat saw, which a change during the read
+  // leaves behind
+  kwei_dir_key(&key, &st, &pkd->kd_mtime);
+  value = ksmalloc(pkd->kd_bloblen + pkd->kd_entc);
+  if (value != NULL) {
+    char *p = value;
+    for (size_t i = 0; i < pkd->kd_entc; i++) {
+      *p++ = pkd->kd_entv[i].kde_type;
+      p = stpcpy(p, pkd->kd_entv[i].kde_name) + 1;
+    }
+    kwei_shcache_put(pshc, KWEI_SHCACHE_DIR, (const char *)&key, sizeof(key),
+                     value, p - value, 0);
+    ksfree(value);
+  }
+  return pkd;
+}
+
+void kwei_dir_release(kwei_dir_t *pkd) {
+  if (__atomic_sub_fetch(&pkd->kd_refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  if (pkd->kd_path != NULL)
+    ksfree(pkd->kd_path);
+  if (pkd->kd_entv != NULL)
+    ksfree(pkd->kd_entv);
+  if (pkd->kd_blob != NULL)
+    ksfree(pkd->kd_blob);
+  ksfree(pkd);
+}
+
+const kwei_dirent_t *kwei_dir_find(const kwei_dir_t *pkd, const char *name) {
+  kwei_dirent_t key = {.kde_name = name};
+  return bsearch(&key, pkd->kd_entv, pkd->kd_entc, sizeof(kwei_dirent_t),
+                 kwei_dirent_cmp);
+}
+
+// ----------------------------------------------------------------
+// Process-wide cache; callers hold kdc_lock
+// ----------------------------------------------------------------
+
+static void kwei_dircache_unlink(kwei_dir_t *pkd, int rmwatch) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  kwei_dir_t **pp = &pkdc->kdc_bucket[pkd->kd_hash % KWEI_DIRCACHE_BUCKETS];
+  while (*pp != pkd)
+    pp = &(*pp)->kd_next;
+  *pp = pkd->kd_next;
+
+  if (pkd->kd_wd >= 0) {
+    int shared = 0;
+    pp = &pkdc->kdc_wdbucket[pkd->kd_wd % KWEI_DIRCACHE_BUCKETS];
+    while (*pp != NULL) {
+      if (*pp == pkd) {
+        *pp = pkd->kd_wdnext;
+        continue;
+      }
+      if ((*pp)->kd_wd == pkd->kd_wd)
+        shared = 1;
+      pp = &(*pp)->kd_wdnext;
+    }
+    // two paths naming one directory share a watch descriptor
+    if (rmwatch && !shared && pkdc->kdc_ifd >= 0)
+      inotify_rm_watch(pkdc->kdc_ifd, pkd->kd_wd);
+  } else {
+    pkdc->kdc_nunwatched--;
+  }
+
+  if (pkd->kd_lruprev != NULL)
+    pkd->kd_lruprev->kd_lrunext = pkd->kd_lrunext;
+  else
+    pkdc->kdc_head = pkd->kd_lrunext;
+  if (pkd->kd_lrunext != NULL)
+    pkd->kd_lrunext->kd_lruprev = pkd->kd_lruprev;
+  else
+    pkdc->kdc_tail = pkd->kd_lruprev;
+  pkdc->kdc_count--;
+  kwei_dir_release(pkd);
+}
+
+static void kwei_dircache_clear(void) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  while (pkdc->kdc_head != NULL)
+    kwei_dircache_unlink(pkdc->kdc_head, 1);
+  pkdc->kdc_gen++;
+}
+
+static void kwei_dircache_touch(kwei_dir_t *pkd) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  if (pkdc->kdc_head == pkd)
+    return;
+  pkd->kd_lruprev->kd_lrunext = pkd->kd_lrunext;
+  if (pkd->kd_lrunext != NULL)
+    pkd->kd_lrunext->kd_lruprev = pkd->kd_lruprev;
+  else
+    pkdc->kdc_tail = pkd->kd_lruprev;
+  pkd->kd_lruprev = NULL;
+  pkd->kd_lrunext = pkdc->kdc_head;
+  pkdc->kdc_head->kd_lruprev = pkd;
+  pkdc->kdc_head = pkd;
+}
+
+static void *kwei_dircache_watch(void *arg) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  int ifd = (int)(intptr_t)arg;
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    ssize_t n = read(ifd, buf, sizeof(buf));
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    pthread_mutex_lock(&pkdc->kdc_lock);
+    if (pkdc->kdc_ifd != ifd) {
+      pthread_mutex_unlock(&pkdc->kdc_lock);
+      break;
+    }
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        kwei_dircache_clear();
+        continue;
+      }
+      kwei_dir_t *pkd = pkdc->kdc_wdbucket[ev->wd % KWEI_DIRCACHE_BUCKETS];
+      while (pkd != NULL) {
+        kwei_dir_t *next = pkd->kd_wdnext;
+        if (pkd->kd_wd == ev->wd)
+          kwei_dircache_unlink(pkd, !(ev->mask & IN_IGNORED));
+        pkd = next;
+      }
+    }
+    pkdc->kdc_gen++;
+    pthread_mutex_unlock(&pkdc->kdc_lock);
+  }
+  return NULL;
+}
+
+static void kwei_dircache_atfork(void) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  // the watcher thread does not survive fork; start over in the child
+  pthread_mutex_init(&pkdc->kdc_lock, NULL);
+  if (pkdc->kdc_ifd >= 0)
+    close(pkdc->kdc_ifd);
+  pkdc->kdc_ifd = -1;
+  kwei_dircache_clear();
+  pkdc->kdc_state = 0;
+}
+
+static void kwei_dircache_start(void) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  static int registered;
+  if (!registered)
+    pthread_atfork(NULL, NULL, kwei_dircache_atfork);
+  registered = 1;
+  pkdc->kdc_state = 1;
+  int ifd = inotify_init1(IN_CLOEXEC);
+  if (ifd == -1)
+    return;
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, kwei_dircache_watch,
+                     (void *)(intptr_t)ifd) != 0) {
+    close(ifd);
+    ifd = -1;
+  }
+  pthread_attr_destroy(&attr);
+  pkdc->kdc_ifd = ifd;
+}
+
+static kwei_dir_t *kwei_dircache_lookup(const char *path, size_t hash) {
+  kwei_dir_t *pkd = kwei_dircache.kdc_bucket[hash % KWEI_DIRCACHE_BUCKETS];
+  while (pkd != NULL &&
+         (pkd->kd_hash != hash || strcmp(pkd->kd_path, path) != 0))
+    pkd = pkd->kd_next;
+  return pkd;
+}
+
+kwei_dir_t *kwei_dircache_get(const char *path) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  size_t hash = kwei_dircache_hash(path);
+
+  pthread_mutex_lock(&pkdc->kdc_lock);
+  if (pkdc->kdc_state == 0)
+    kwei_dircache_start();
+  kwei_dir_t *pkd = kwei_dircache_lookup(path, hash);
+  if (pkd != NULL && pkd->kd_wd < 0) {
+    // no inotify watch: revalidate by modification time
+    struct stat st;
+    if (stat(path, &st) == -1 ||
+        st.st_mtim.tv_sec != pkd->kd_mtime.tv_sec ||
+        st.st_mtim.tv_nsec != pkd->kd_mtime.tv_nsec) {
+      kwei_dircache_unlink(pkd, 1);
+      pkd = NULL;
+    }
+  }
+  if (pkd != NULL) {
+    __atomic_add_fetch(&pkd->kd_refs, 1, __ATOMIC_RELAXED);
+    kwei_dircache_touch(pkd);
+    pthread_mutex_unlock(&pkdc->kdc_lock);
+    return pkd;
+  }
+  int ifd = pkdc->kdc_ifd;
+  unsigned long gen = pkdc->kdc_gen;
+  pthread_mutex_unlock(&pkdc->kdc_lock);
+
+  // watch before reading so that no change can slip in between
+  int wd = ifd >= 0 ? inotify_add_watch(ifd, path, KWEI_DIRCACHE_MASK) : -1;
+  pkd = kwei_dir_load(path);
+  if (pkd == NULL)
+    return NULL;
+  char *copy = ksstrdup(path);
+  if (copy == NULL)
+    return pkd;
+
+  pthread_mutex_lock(&pkdc->kdc_lock);
+  if (pkdc->kdc_gen != gen || pkdc->kdc_ifd != ifd ||
+      kwei_dircache_lookup(path, hash) != NULL) {
+    pthread_mutex_unlock(&pkdc->kdc_lock);
+    ksfree(copy);
+    return pkd;
+  }
+  pkd->kd_path = copy;
+  pkd->kd_hash = hash;
+  pkd->kd_wd = wd;
+  pkd->kd_refs++;
+  pkd->kd_next = pkdc->kdc_bucket[hash % KWEI_DIRCACHE_BUCKETS];
+  pkdc->kdc_bucket[hash % KWEI_DIRCACHE_BUCKETS] = pkd;
+  if (wd >= 0) {
+    pkd->kd_wdnext = pkdc->kdc_wdbucket[wd % KWEI_DIRCACHE_BUCKETS];
+    pkdc->kdc_wdbucket[wd % KWEI_DIRCACHE_BUCKETS] = pkd;
+  } else {
+    pkdc->kdc_nunwatched++;
+  }
+  pkd->kd_lruprev = NULL;
+  pkd->kd_lrunext = pkdc->kdc_head;
+  if (pkdc->kdc_head != NULL)
+    pkdc->kdc_head->kd_lruprev = pkd;
+  else
+    pkdc->kdc_tail = pkd;
+  pkdc->kdc_head = pkd;
+  pkdc->kdc_count++;
+  while (pkdc->kdc_count > KWEI_DIRCACHE_MAX) {
+    // changes to an evicted directory are no longer seen
+    kwei_dircache_unlink(pkdc->kdc_tail, 1);
+    pkdc->kdc_gen++;
+  }
+  pthread_mutex_unlock(&pkdc->kdc_lock);
+  return pkd;
+}
+
+int kwei_dircache_gen(unsigned long *pgen) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  pthread_mutex_lock(&pkdc->kdc_lock);
+  int ret = -1;
+  if (pkdc->kdc_ifd >= 0 && pkdc->kdc_nunwatched == 0) {
+    *pgen = pkdc->kdc_gen;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&pkdc->kdc_lock);
+  return ret;
+}
+
+int kwordexp_dir_add(kwordexp_dir_t *pdir, const char *name, int isdir) {
+  return kwei_dir_add(pdir, name, isdir ? DT_DIR : DT_REG);
+}
+
+void kwordexp_globcache_flush(void) {
+  kwei_dircache_t *pkdc = &kwei_dircache;
+  pthread_mutex_lock(&pkdc->kdc_lock);
+  kwei_dircache_clear();
+  pthread_mutex_unlock(&pkdc->kdc_lock);
+}
@@ -0,0 +1,199 @@
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+extern char **environ;
+
+typedef struct kwei_envent {
+  size_t kee_hash;
+  size_t kee_keylen;
+  // "KEY=VALUE", or "KEY" alone when an overlay unsets the variable
+  char *kee_str;
+} kwei_envent_t;
+
+struct kwordexp_env {
+  kwordexp_env_t *ke_base;
+  kwei_envent_t *ke_entv;
+  size_t ke_entc;
+  size_t ke_entcap;
+  // replaced strings stay alive until the env is freed, since lookups hand
+  // out pointers into them
+  char **ke_oldv;
+  size_t ke_oldc;
+  size_t ke_oldcap;
+  unsigned long ke_refs;
+  // bumped by every change, so cached results can tell they are stale
+  unsigned long ke_gen;
+  int ke_frozen;
+};
+
+static size_t kwei_env_hash(const char *key, size_t keylen) {
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < keylen; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static kwei_envent_t *kwei_env_slot(const kwordexp_env_t *pke, size_t hash,
+                                    const char *key, size_t keylen) {
+  size_t mask = pke->ke_entcap - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    kwei_envent_t *pkee = &pke->ke_entv[i];
+    if (pkee->kee_str == NULL ||
+        (pkee->kee_hash == hash && pkee->kee_keylen == keylen &&
+         memcmp(pkee->kee_str, key, keylen) == 0))
+      return pkee;
+  }
+}
+
+static int kwei_env_grow(kwordexp_env_t *pke) {
+  size_t entcap = pke->ke_entcap > 0 ? pke->ke_entcap * 2 : 64;
+  kwei_envent_t *entv = ksmalloc(entcap * sizeof(kwei_envent_t));
+  if (entv == NULL)
+    return -1;
+  memset(entv, 0, entcap * sizeof(kwei_envent_t));
+  kwei_envent_t *oldv = pke->ke_entv;
+  size_t oldcap = pke->ke_entcap;
+  pke->ke_entv = entv;
+  pke->ke_entcap = entcap;
+  for (size_t i = 0; i < oldcap; i++) {
+    if (oldv[i].kee_str == NULL)
+      continue;
+    *kwei_env_slot(pke, oldv[i].kee_hash, oldv[i].kee_str,
+                   oldv[i].kee_keylen) = oldv[i];
+  }
+  if (oldv != NULL)
+    ksfree(oldv);
+  return 0;
+}
+
+static int kwei_env_put(kwordexp_env_t *pke, const char *key,
+                        const char *value) {
+  size_t keylen = strlen(key);
+  if (keylen == 0 || memchr(key, '=', keylen) != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if ((pke->ke_entc + 1) * 2 > pke->ke_entcap && kwei_env_grow(pke) != 0)
+    return -1;
+  if (pke->ke_oldc == pke->ke_oldcap) {
+    size_t oldcap = pke->ke_oldcap > 0 ? pke->ke_oldcap * 2 : 16;
+    char **oldv = ksrealloc(pke->ke_oldv, oldcap * sizeof(char *));
+    if (oldv == NULL)
+      return -1;
+    pke->ke_oldv = oldv;
+    pke->ke_oldcap = oldcap;
+  }
+  size_t valuelen = value != NULL ? strlen(value) + 1 : 0;
+  char *str = ksmalloc(keylen + valuelen + 1);
+  if (str == NULL)
+    return -1;
+  memcpy(str, key, keylen);
+  str[keylen] = '\0';
+  if (value != NULL) {
+    str[keylen] = '=';
+    memcpy(str + keylen + 1, value, valuelen);
+  }
+  size_t hash = kwei_env_hash(key, keylen);
+  kwei_envent_t *pkee = kwei_env_slot(pke, hash, key, keylen);
+  if (pkee->kee_str != NULL)
+    pke->ke_oldv[pke->ke_oldc++] = pkee->kee_str;
+  else
+    pke->ke_entc++;
+  pkee->kee_hash = hash;
+  pkee->kee_keylen = keylen;
+  pkee->kee_str = str;
+  __atomic_add_fetch(&pke->ke_gen, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+unsigned long kwei_env_gen(const kwordexp_env_t *pke) {
+  // a base is frozen, so only the overlay itself can change
+  return __atomic_load_n(&pke->ke_gen, __ATOMIC_ACQUIRE);
+}
+
+kwordexp_env_t *kwordexp_env_new(kwordexp_env_t *base) {
+  kwordexp_env_t *pke = ksmalloc(sizeof(kwordexp_env_t));
+  if (pke == NULL)
+    return NULL;
+  memset(pke, 0, sizeof(*pke));
+  pke->ke_refs = 1;
+  if (kwei_env_grow(pke) != 0) {
+    ksfree(pke);
+    return NULL;
+  }
+  if (base != NULL) {
+    // a base is shared from now on and must not change under its overlays
+    __atomic_store_n(&base->ke_frozen, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&base->ke_refs, 1, __ATOMIC_RELAXED);
+    pke->ke_base = base;
+  }
+  return pke;
+}
+
+kwordexp_env_t *kwordexp_env_snapshot(void) {
+  kwordexp_env_t *pke = kwordexp_env_new(NULL);
+  if (pke == NULL)
+    return NULL;
+  for (char **pp = environ; pp != NULL && *pp != NULL; pp++) {
+    const char *eq = strchr(*pp, '=');
+    if (eq == NULL || eq == *pp)
+      continue;
+    size_t keylen = eq - *pp;
+    char key[keylen + 1];
+    memcpy(key, *pp, keylen);
+    key[keylen] = '\0';
+    // the first definition wins, as with getenv()
+    if (kwei_env_slot(pke, kwei_env_hash(key, keylen), key, keylen)
+            ->kee_str != NULL)
+      continue;
+    if (kwei_env_put(pke, key, eq + 1) != 0) {
+      kwordexp_env_free(pke);
+      return NULL;
+    }
+  }
+  pke->ke_frozen = 1;
+  return pke;
+}
+
+int kwordexp_env_set(kwordexp_env_t *env, const char *key, const char *value) {
+  if (__atomic_load_n(&env->ke_frozen, __ATOMIC_ACQUIRE)) {
+    errno = EROFS;
+    return -1;
+  }
+  return kwei_env_put(env, key, value);
+}
+
+int kwordexp_env_unset(kwordexp_env_t *env, const char *key) {
+  return kwordexp_env_set(env, key, NULL);
+}
+
+const char *kwordexp_env_get(const kwordexp_env_t *env, const char *key) {
+  size_t keylen = strlen(key);
+  size_t hash = kwei_env_hash(key, keylen);
+  for (const kwordexp_env_t *pke = env; pke != NULL; pke = pke->ke_base) {
+    const kwei_envent_t *pkee = kwei_env_slot(pke, hash, key, keylen);
+    if (pkee->kee_str != NULL)
+      return pkee->kee_str[keylen] == '=' ? pkee->kee_str + keylen + 1 : NULL;
+  }
+  return NULL;
+}
+
+void kwordexp_env_free(kwordexp_env_t *env) {
+  while (env != NULL &&
+         __atomic_sub_fetch(&env->ke_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    kwordexp_env_t *base = env->ke_base;
+    for (size_t i = 0; i < env->ke_entcap; i++)
+      if (env->ke_entv[i].kee_str != NULL)
+        ksfree(env->ke_entv[i].kee_str);
+    for (size_t i = 0; i < env->ke_oldc; i++)
+      ksfree(env->ke_oldv[i]);
+    if (env->ke_oldv != NULL)
+      ksfree(env->ke_oldv);
+    ksfree(env->ke_entv);
+    ksfree(env);
+    env = base;
+  }
+}
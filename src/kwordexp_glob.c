@@ -0,0 +1,825 @@
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef KWEI_GLOB_THREADS
+#define KWEI_GLOB_THREADS 8
+#endif
+
+typedef struct kwei_glob_comp {
+  char *kgc_pat;
+  kwordexp_pattern_t *kgc_compiled;
+  char *kgc_prefix;
+  int kgc_magic;
+  int kgc_globstar;
+} kwei_glob_comp_t;
+
+typedef struct kwei_glob_pool kwei_glob_pool_t;
+
+typedef struct kwei_glob {
+  kwordexp_internal_t *kwg_pkwei;
+  kwei_glob_pool_t *kwg_pool;
+  size_t kwg_worker;
+  kwei_glob_comp_t *kwg_compv;
+  size_t kwg_compc;
+  int kwg_dironly;
+  int kwg_cache;
+  int kwg_provider;
+  // listings shared between processes, when neither of the above applies
+  kwordexp_shcache_t *kwg_shcache;
+  int kwg_stream;
+  int kwg_stop;
+  int *kwg_pstop;
+  int kwg_errno;
+  size_t kwg_max;
+  size_t kwg_count;
+  size_t *kwg_pcount;
+  char *kwg_path;
+  size_t kwg_pathlen;
+  size_t kwg_pathsize;
+  size_t kwg_root;
+  // the innermost directory being listed, open as kwg_dirfd, is the first
+  // kwg_dirlen bytes of kwg_path; names below it are looked up relative to
+  // it rather than by resolving the whole path again
+  int kwg_dirfd;
+  size_t kwg_dirlen;
+  char **kwg_matchv;
+  size_t kwg_matchc;
+  size_t kwg_matchcap;
+  // KWRDE_COMPACT: matches go here instead of kwg_matchv
+  kwordexp_words_t *kwg_words;
+} kwei_glob_t;
+
+typedef struct kwei_glob_task kwei_glob_task_t;
+
+struct kwei_glob_task {
+  kwei_glob_task_t *kgt_prev;
+  kwei_glob_task_t *kgt_next;
+  size_t kgt_idx;
+  int kgt_nested;
+  size_t kgt_len;
+  char kgt_path[];
+};
+
+// The owner pushes and pops at the head, thieves take from the tail.
+typedef struct kwei_glob_deque {
+  pthread_mutex_t kgq_lock;
+  kwei_glob_task_t *kgq_head;
+  kwei_glob_task_t *kgq_tail;
+} kwei_glob_deque_t;
+
+struct kwei_glob_pool {
+  pthread_mutex_t kgp_lock;
+  pthread_cond_t kgp_cond;
+  size_t kgp_pending;
+  size_t kgp_queued;
+  size_t kgp_nworker;
+  kwei_glob_t kgp_worker[KWEI_GLOB_THREADS];
+  kwei_glob_deque_t kgp_deque[KWEI_GLOB_THREADS];
+};
+
+static int kwei_glob_stopped(kwei_glob_t *pkg) {
+  return __atomic_load_n(pkg->kwg_pstop, __ATOMIC_RELAXED);
+}
+
+static void kwei_glob_stop(kwei_glob_t *pkg) {
+  __atomic_store_n(pkg->kwg_pstop, 1, __ATOMIC_RELAXED);
+}
+
+static kwei_status_t kwei_glob_syserr(kwei_glob_t *pkg, int err) {
+  if (pkg->kwg_pool != NULL) {
+    // workers must not touch the shared parser state
+    pkg->kwg_errno = err;
+    kwei_glob_stop(pkg);
+    return KSERROR;
+  }
+  pkg->kwg_pkwei->kwei_errno = err;
+  pkg->kwg_pkwei->kwei_errex = KESYSTEM;
+  pkg->kwg_pkwei->kwei_status = KSERROR;
+  return KSERROR;
+}
+
+static kwei_status_t kwei_glob_reserve(kwei_glob_t *pkg, size_t len) {
+  if (pkg->kwg_pathlen + len + 2 <= pkg->kwg_pathsize)
+    return KSSUCCESS;
+  size_t size = pkg->kwg_pathsize > 0 ? pkg->kwg_pathsize : 256;
+  while (size < pkg->kwg_pathlen + len + 2)
+    size *= 2;
+  char *path = ksrealloc(pkg->kwg_path, size);
+  if (path == NULL)
+    return kwei_glob_syserr(pkg, errno);
+  pkg->kwg_path = path;
+  pkg->kwg_pathsize = size;
+  return KSSUCCESS;
+}
+
+// Append a path component, dropping the backslashes of a literal one.
+static kwei_status_t kwei_glob_append(kwei_glob_t *pkg, const char *s,
+                                      int unescape) {
+  size_t len = strlen(s);
+  if (kwei_glob_reserve(pkg, len) != KSSUCCESS)
+    return KSERROR;
+  char *p = pkg->kwg_path + pkg->kwg_pathlen;
+  for (; *s != '\0'; s++) {
+    if (unescape && *s == '\\' && s[1] != '\0')
+      s++;
+    *p++ = *s;
+  }
+  *p = '\0';
+  pkg->kwg_pathlen = p - pkg->kwg_path;
+  return KSSUCCESS;
+}
+
+// A kwe_readdir provider lists directories in place of the filesystem.
+static kwei_dir_t *kwei_glob_provide(kwei_glob_t *pkg, const char *path,
+                                     const char *prefix) {
+  kwordexp_t *pkwe = pkg->kwg_pkwei->kwei_pwe;
+  kwei_dir_t *pkd = kwei_dir_new();
+  if (pkd == NULL)
+    return NULL;
+  if (pkwe->kwe_readdir(pkwe->kwe_data, *path != '\0' ? path : ".", prefix,
+                        pkd) != 0) {
+    kwei_dir_release(pkd);
+    return NULL;
+  }
+  kwei_dir_finish(pkd);
+  return pkd;
+}
+
+// The kwg_path entry relative to kwg_dirfd
+static const char *kwei_glob_rel(kwei_glob_t *pkg) {
+  const char *rel = pkg->kwg_path + pkg->kwg_dirlen;
+  return *rel != '\0' ? rel : ".";
+}
+
+static int kwei_glob_openat(kwei_glob_t *pkg) {
+  pkg->kwg_path[pkg->kwg_pathlen] = '\0';
+  return openat(pkg->kwg_dirfd, kwei_glob_rel(pkg),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Load the listing of the directory currently held in kwg_path. Names
+// not starting with prefix may be left out. A directory read from the
+// filesystem is left open in *pfd for looking up the names in it; *pfd is
+// -1 otherwise.
+static kwei_dir_t *kwei_glob_opendir(kwei_glob_t *pkg, const char *prefix,
+                                     int *pfd) {
+  char *path = pkg->kwg_path;
+  size_t len = pkg->kwg_pathlen;
+  path[len] = '\0';
+  *pfd = -1;
+  if (!pkg->kwg_provider && !pkg->kwg_cache) {
+    int fd = kwei_glob_openat(pkg);
+    if (fd == -1)
+      return NULL;
+    kwei_dir_t *pkd = pkg->kwg_shcache != NULL
+                          ? kwei_dir_load_shared(pkg->kwg_shcache, fd)
+                          : kwei_dir_loadat(fd);
+    if (pkd == NULL)
+      close(fd);
+    else
+      *pfd = fd;
+    return pkd;
+  }
+  int trim = len > 1 && path[len - 1] == '/';
+  if (trim)
+    path[len - 1] = '\0';
+  kwei_dir_t *pkd;
+  if (pkg->kwg_provider)
+    pkd = kwei_glob_provide(pkg, path, prefix);
+  else
+    pkd = kwei_dircache_get(path);
+  if (trim)
+    path[len - 1] = '/';
+  return pkd;
+}
+
+static int kwei_glob_isdir(kwei_glob_t *pkg, unsigned char type) {
+  if (type == DT_DIR)
+    return 1;
+  if (pkg->kwg_provider || (type != DT_LNK && type != DT_UNKNOWN))
+    return 0;
+  struct stat st;
+  return fstatat(pkg->kwg_dirfd, kwei_glob_rel(pkg), &st, 0) == 0 &&
+         S_ISDIR(st.st_mode);
+}
+
+static int kwei_glob_isrealdir(kwei_glob_t *pkg, unsigned char type) {
+  if (pkg->kwg_provider || type != DT_UNKNOWN)
+    return type == DT_DIR;
+  struct stat st;
+  return fstatat(pkg->kwg_dirfd, kwei_glob_rel(pkg), &st,
+                 AT_SYMLINK_NOFOLLOW) == 0 &&
+         S_ISDIR(st.st_mode);
+}
+
+static kwei_status_t kwei_glob_emit(kwei_glob_t *pkg) {
+  kwordexp_t *pkwe = pkg->kwg_pkwei->kwei_pwe;
+  char *path = pkg->kwg_path + pkg->kwg_root;
+  size_t len = pkg->kwg_pathlen - pkg->kwg_root;
+  size_t count = __atomic_add_fetch(pkg->kwg_pcount, 1, __ATOMIC_RELAXED);
+  if (pkg->kwg_stream && pkg->kwg_max > 0 && count >= pkg->kwg_max)
+    kwei_glob_stop(pkg);
+
+  if (pkwe->kwe_glob != NULL) {
+    char save = path[len];
+    path[len] = pkg->kwg_dironly ? '/' : '\0';
+    path[len + pkg->kwg_dironly] = '\0';
+    if (pkg->kwg_pool != NULL)
+      pthread_mutex_lock(&pkg->kwg_pool->kgp_lock);
+    int ret = pkwe->kwe_glob(pkwe->kwe_data, path);
+    if (pkg->kwg_pool != NULL)
+      pthread_mutex_unlock(&pkg->kwg_pool->kgp_lock);
+    path[len] = save;
+    if (ret != 0)
+      kwei_glob_stop(pkg);
+    return KSSUCCESS;
+  }
+
+  if (pkg->kwg_words != NULL) {
+    char save = path[len];
+    if (pkg->kwg_dironly)
+      path[len] = '/';
+    if (pkg->kwg_pool != NULL)
+      pthread_mutex_lock(&pkg->kwg_pool->kgp_lock);
+    int ret = kwei_words_add(pkg->kwg_words, path, len + pkg->kwg_dironly);
+    int err = errno;
+    if (pkg->kwg_pool != NULL)
+      pthread_mutex_unlock(&pkg->kwg_pool->kgp_lock);
+    path[len] = save;
+    return ret != 0 ? kwei_glob_syserr(pkg, err) : KSSUCCESS;
+  }
+
+  // workers are not known to the collector; they copy out at the end
+  char *word =
+      pkg->kwg_pool != NULL ? ksmalloc(len + 2) : kmalloc_atomic(len + 2);
+  if (word == NULL)
+    return kwei_glob_syserr(pkg, errno);
+  memcpy(word, path, len);
+  if (pkg->kwg_dironly)
+    word[len++] = '/';
+  word[len] = '\0';
+  if (pkg->kwg_stream && pkg->kwg_pool == NULL)
+    return kwei_append_word(pkg->kwg_pkwei, word);
+
+  if (pkg->kwg_matchc == pkg->kwg_matchcap) {
+    size_t cap = pkg->kwg_matchcap > 0 ? pkg->kwg_matchcap * 2 : 16;
+    char **matchv = ksrealloc(pkg->kwg_matchv, cap * sizeof(char *));
+    if (matchv == NULL) {
+      if (pkg->kwg_pool != NULL)
+        ksfree(word);
+      return kwei_glob_syserr(pkg, errno);
+    }
+    pkg->kwg_matchv = matchv;
+    pkg->kwg_matchcap = cap;
+  }
+  pkg->kwg_matchv[pkg->kwg_matchc++] = word;
+  return KSSUCCESS;
+}
+
+// ----------------------------------------------------------------
+// Work-stealing pool for multi-level patterns
+// ----------------------------------------------------------------
+
+// Queue the directory held in kwg_path for matching against component idx.
+static kwei_status_t kwei_glob_push(kwei_glob_t *pkg, size_t idx,
+                                    int nested) {
+  kwei_glob_pool_t *pool = pkg->kwg_pool;
+  kwei_glob_task_t *task =
+      ksmalloc(sizeof(kwei_glob_task_t) + pkg->kwg_pathlen + 1);
+  if (task == NULL)
+    return kwei_glob_syserr(pkg, errno);
+  task->kgt_idx = idx;
+  task->kgt_nested = nested;
+  task->kgt_len = pkg->kwg_pathlen;
+  memcpy(task->kgt_path, pkg->kwg_path, pkg->kwg_pathlen);
+  task->kgt_path[pkg->kwg_pathlen] = '\0';
+
+  __atomic_add_fetch(&pool->kgp_pending, 1, __ATOMIC_ACQ_REL);
+  kwei_glob_deque_t *pkgq = &pool->kgp_deque[pkg->kwg_worker];
+  pthread_mutex_lock(&pkgq->kgq_lock);
+  task->kgt_prev = NULL;
+  task->kgt_next = pkgq->kgq_head;
+  if (pkgq->kgq_head != NULL)
+    pkgq->kgq_head->kgt_prev = task;
+  else
+    pkgq->kgq_tail = task;
+  pkgq->kgq_head = task;
+  pthread_mutex_unlock(&pkgq->kgq_lock);
+
+  __atomic_add_fetch(&pool->kgp_queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&pool->kgp_lock);
+  pthread_cond_signal(&pool->kgp_cond);
+  pthread_mutex_unlock(&pool->kgp_lock);
+  return KSSUCCESS;
+}
+
+static kwei_glob_task_t *kwei_glob_take(kwei_glob_t *pkg) {
+  kwei_glob_pool_t *pool = pkg->kwg_pool;
+  for (size_t i = 0; i < pool->kgp_nworker; i++) {
+    kwei_glob_deque_t *pkgq =
+        &pool->kgp_deque[(pkg->kwg_worker + i) % pool->kgp_nworker];
+    pthread_mutex_lock(&pkgq->kgq_lock);
+    kwei_glob_task_t *task = i == 0 ? pkgq->kgq_head : pkgq->kgq_tail;
+    if (task != NULL) {
+      if (task->kgt_prev != NULL)
+        task->kgt_prev->kgt_next = task->kgt_next;
+      else
+        pkgq->kgq_head = task->kgt_next;
+      if (task->kgt_next != NULL)
+        task->kgt_next->kgt_prev = task->kgt_prev;
+      else
+        pkgq->kgq_tail = task->kgt_prev;
+    }
+    pthread_mutex_unlock(&pkgq->kgq_lock);
+    if (task != NULL) {
+      __atomic_sub_fetch(&pool->kgp_queued, 1, __ATOMIC_ACQ_REL);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void kwei_glob_done(kwei_glob_pool_t *pool) {
+  if (__atomic_sub_fetch(&pool->kgp_pending, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  pthread_mutex_lock(&pool->kgp_lock);
+  pthread_cond_broadcast(&pool->kgp_cond);
+  pthread_mutex_unlock(&pool->kgp_lock);
+}
+
+static kwei_status_t kwei_glob_walk(kwei_glob_t *pkg, size_t idx);
+
+static kwei_status_t kwei_glob_globstar(kwei_glob_t *pkg, size_t idx,
+                                        int nested);
+
+static void kwei_glob_work(kwei_glob_t *pkg) {
+  kwei_glob_pool_t *pool = pkg->kwg_pool;
+  while (1) {
+    kwei_glob_task_t *task = kwei_glob_take(pkg);
+    if (task == NULL) {
+      pthread_mutex_lock(&pool->kgp_lock);
+      while (__atomic_load_n(&pool->kgp_queued, __ATOMIC_ACQUIRE) == 0 &&
+             __atomic_load_n(&pool->kgp_pending, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&pool->kgp_cond, &pool->kgp_lock);
+      int done = __atomic_load_n(&pool->kgp_pending, __ATOMIC_ACQUIRE) == 0;
+      pthread_mutex_unlock(&pool->kgp_lock);
+      if (done)
+        break;
+      continue;
+    }
+    // a stopped walk still drains the queues
+    if (!kwei_glob_stopped(pkg)) {
+      // task paths are complete; resolve them afresh
+      pkg->kwg_dirfd = AT_FDCWD;
+      pkg->kwg_dirlen = 0;
+      pkg->kwg_pathlen = 0;
+      if (kwei_glob_reserve(pkg, task->kgt_len) == KSSUCCESS) {
+        memcpy(pkg->kwg_path, task->kgt_path, task->kgt_len);
+        pkg->kwg_pathlen = task->kgt_len;
+        kwei_status_t kstat =
+            task->kgt_nested ? kwei_glob_globstar(pkg, task->kgt_idx, 1)
+                             : kwei_glob_walk(pkg, task->kgt_idx);
+        if (kstat != KSSUCCESS)
+          kwei_glob_stop(pkg);
+      }
+    }
+    ksfree(task);
+    kwei_glob_done(pool);
+  }
+}
+
+static void *kwei_glob_thread(void *arg) {
+  kwei_glob_work(arg);
+  return NULL;
+}
+
+static kwei_status_t kwei_glob_walk(kwei_glob_t *pkg, size_t idx);
+
+// Descend into the entry just appended to kwg_path.
+static kwei_status_t kwei_glob_next(kwei_glob_t *pkg, size_t idx,
+                                    unsigned char type) {
+  int last = idx + 1 == pkg->kwg_compc;
+  if ((!last || pkg->kwg_dironly) && !kwei_glob_isdir(pkg, type))
+    return KSSUCCESS;
+  if (last)
+    return kwei_glob_emit(pkg);
+  pkg->kwg_path[pkg->kwg_pathlen++] = '/';
+  if (pkg->kwg_pool != NULL)
+    return kwei_glob_push(pkg, idx + 1, 0);
+  return kwei_glob_walk(pkg, idx + 1);
+}
+
+static kwei_status_t kwei_glob_match(kwei_glob_t *pkg, size_t idx,
+                                     size_t base, const char *name,
+                                     unsigned char type) {
+  if (!kwordexp_pattern_match(pkg->kwg_compv[idx].kgc_compiled, name,
+                              strlen(name)))
+    return KSSUCCESS;
+  pkg->kwg_pathlen = base;
+  kwei_status_t kstat = kwei_glob_append(pkg, name, 0);
+  if (kstat == KSSUCCESS)
+    kstat = kwei_glob_next(pkg, idx, type);
+  return kstat;
+}
+
+// Match entries as the directory is read, for unsorted uncached walks.
+static kwei_status_t kwei_glob_scan(kwei_glob_t *pkg, size_t idx) {
+  size_t base = pkg->kwg_pathlen;
+  int fd = kwei_glob_openat(pkg);
+  DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+  if (dir == NULL) {
+    if (fd != -1)
+      close(fd);
+    return KSSUCCESS;
+  }
+  int dirfd = pkg->kwg_dirfd;
+  size_t dirlen = pkg->kwg_dirlen;
+  pkg->kwg_dirfd = fd;
+  pkg->kwg_dirlen = base;
+  kwei_status_t kstat = KSSUCCESS;
+  struct dirent *ent;
+  while (kstat == KSSUCCESS && !kwei_glob_stopped(pkg) &&
+         (ent = readdir(dir)) != NULL)
+    kstat = kwei_glob_match(pkg, idx, base, ent->d_name, ent->d_type);
+  pkg->kwg_dirfd = dirfd;
+  pkg->kwg_dirlen = dirlen;
+  closedir(dir);
+  pkg->kwg_pathlen = base;
+  return kstat;
+}
+
+// "**" spans any number of directory levels. Like bash, it skips hidden
+// names and enters but does not recurse through symbolic links. Nested
+// levels were already matched by name one level up.
+static kwei_status_t kwei_glob_globstar(kwei_glob_t *pkg, size_t idx,
+                                        int nested) {
+  size_t base = pkg->kwg_pathlen;
+  int last = idx + 1 == pkg->kwg_compc;
+  kwei_status_t kstat = KSSUCCESS;
+  if (!last) {
+    kstat = kwei_glob_walk(pkg, idx + 1);
+  } else if (!nested && base > pkg->kwg_root) {
+    pkg->kwg_pathlen = base - pkg->kwg_dironly;
+    kstat = kwei_glob_emit(pkg);
+  }
+  pkg->kwg_pathlen = base;
+  if (kstat != KSSUCCESS)
+    return kstat;
+
+  int fd;
+  kwei_dir_t *pkd = kwei_glob_opendir(pkg, "", &fd);
+  if (pkd == NULL)
+    return KSSUCCESS;
+  int dirfd = pkg->kwg_dirfd;
+  size_t dirlen = pkg->kwg_dirlen;
+  if (fd != -1) {
+    pkg->kwg_dirfd = fd;
+    pkg->kwg_dirlen = base;
+  }
+  for (size_t i = 0;
+       i < pkd->kd_entc && kstat == KSSUCCESS && !kwei_glob_stopped(pkg); i++) {
+    const kwei_dirent_t *pkde = &pkd->kd_entv[i];
+    if (pkde->kde_name[0] == '.')
+      continue;
+    pkg->kwg_pathlen = base;
+    kstat = kwei_glob_append(pkg, pkde->kde_name, 0);
+    if (kstat != KSSUCCESS)
+      break;
+    int recurse = kwei_glob_isrealdir(pkg, pkde->kde_type);
+    int isdir = recurse || kwei_glob_isdir(pkg, pkde->kde_type);
+    if (last && (isdir || !pkg->kwg_dironly))
+      kstat = kwei_glob_emit(pkg);
+    if (kstat != KSSUCCESS || !(recurse || (isdir && !last)))
+      continue;
+    pkg->kwg_path[pkg->kwg_pathlen++] = '/';
+    if (pkg->kwg_pool != NULL)
+      kstat = kwei_glob_push(pkg, recurse ? idx : idx + 1, recurse);
+    else if (recurse)
+      kstat = kwei_glob_globstar(pkg, idx, 1);
+    else
+      kstat = kwei_glob_walk(pkg, idx + 1);
+  }
+  if (fd != -1) {
+    close(fd);
+    pkg->kwg_dirfd = dirfd;
+    pkg->kwg_dirlen = dirlen;
+  }
+  pkg->kwg_pathlen = base;
+  kwei_dir_release(pkd);
+  return kstat;
+}
+
+static kwei_status_t kwei_glob_walk(kwei_glob_t *pkg, size_t idx) {
+  size_t base = pkg->kwg_pathlen;
+  kwei_glob_comp_t *pkgc = &pkg->kwg_compv[idx];
+  kwei_status_t kstat = KSSUCCESS;
+  if (pkgc->kgc_globstar)
+    return kwei_glob_globstar(pkg, idx, 0);
+
+  if (!pkgc->kgc_magic) {
+    // only the final name needs to exist; ask the parent listing when it
+    // is held in memory
+    int last = idx + 1 == pkg->kwg_compc;
+    int listed = last && (pkg->kwg_cache || pkg->kwg_provider ||
+                          pkg->kwg_shcache != NULL);
+    kwei_dir_t *pkd = NULL;
+    int fd = -1;
+    if (listed &&
+        (pkd = kwei_glob_opendir(pkg, pkgc->kgc_prefix, &fd)) == NULL)
+      return KSSUCCESS;
+    kstat = kwei_glob_append(pkg, pkgc->kgc_pat, 1);
+    // opening a middle name as a directory is its existence check
+    unsigned char type = DT_DIR;
+    int found = 1;
+    if (pkd != NULL) {
+      const kwei_dirent_t *pkde = kwei_dir_find(pkd, pkg->kwg_path + base);
+      found = pkde != NULL;
+      type = found ? pkde->kde_type : DT_UNKNOWN;
+    } else if (last) {
+      struct stat st;
+      found = fstatat(pkg->kwg_dirfd, kwei_glob_rel(pkg), &st,
+                      AT_SYMLINK_NOFOLLOW) == 0;
+      type = found && S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+    }
+    if (kstat == KSSUCCESS && found)
+      kstat = kwei_glob_next(pkg, idx, type);
+    if (pkd != NULL)
+      kwei_dir_release(pkd);
+    if (fd != -1)
+      close(fd);
+    pkg->kwg_pathlen = base;
+    return kstat;
+  }
+
+  if (pkg->kwg_stream && !pkg->kwg_cache && !pkg->kwg_provider &&
+      pkg->kwg_shcache == NULL)
+    return kwei_glob_scan(pkg, idx);
+
+  int fd;
+  kwei_dir_t *pkd = kwei_glob_opendir(pkg, pkgc->kgc_prefix, &fd);
+  if (pkd == NULL)
+    return KSSUCCESS;
+  int dirfd = pkg->kwg_dirfd;
+  size_t dirlen = pkg->kwg_dirlen;
+  if (fd != -1) {
+    pkg->kwg_dirfd = fd;
+    pkg->kwg_dirlen = base;
+  }
+  for (size_t i = 0;
+       i < pkd->kd_entc && kstat == KSSUCCESS && !kwei_glob_stopped(pkg); i++)
+    kstat = kwei_glob_match(pkg, idx, base, pkd->kd_entv[i].kde_name,
+                            pkd->kd_entv[i].kde_type);
+  if (fd != -1) {
+    close(fd);
+    pkg->kwg_dirfd = dirfd;
+    pkg->kwg_dirlen = dirlen;
+  }
+  pkg->kwg_pathlen = base;
+  kwei_dir_release(pkd);
+  return kstat;
+}
+
+static int kwei_glob_cmp(const void *a, const void *b) {
+  return strcoll(*(char *const *)a, *(char *const *)b);
+}
+
+// The unescaped literal text before the first wildcard.
+static char *kwei_glob_prefix(const char *pat) {
+  char *prefix = kmalloc_atomic(strlen(pat) + 1);
+  if (prefix == NULL)
+    return NULL;
+  char *p = prefix;
+  for (; *pat != '\0' && strchr("*?[", *pat) == NULL; pat++) {
+    if (*pat == '\\' && pat[1] != '\0')
+      pat++;
+    *p++ = *pat;
+  }
+  *p = '\0';
+  return prefix;
+}
+
+static kwei_status_t kwei_glob_split(kwei_glob_t *pkg, char *p) {
+  size_t cap = 1;
+  for (const char *q = p; *q != '\0'; q++)
+    cap += *q == '/';
+  pkg->kwg_compv = kmalloc(cap * sizeof(kwei_glob_comp_t));
+  if (pkg->kwg_compv == NULL)
+    return kwei_glob_syserr(pkg, errno);
+  while (*p != '\0') {
+    char *start = p;
+    while (*p != '\0' && *p != '/') {
+      if (*p == '\\' && p[1] != '\0')
+        p++;
+      p++;
+    }
+    int slash = *p == '/';
+    *p = '\0';
+    if (p > start) {
+      kwei_glob_comp_t *pkgc = &pkg->kwg_compv[pkg->kwg_compc++];
+      pkgc->kgc_pat = start;
+      pkgc->kgc_compiled = NULL;
+      pkgc->kgc_magic = kwei_has_wildcard(start, p - start);
+      pkgc->kgc_globstar = (pkg->kwg_pkwei->kwei_flags & KWRDE_GLOBSTAR) &&
+                           strcmp(start, "**") == 0;
+      pkgc->kgc_prefix = kwei_glob_prefix(start);
+      if (pkgc->kgc_prefix == NULL)
+        return kwei_glob_syserr(pkg, errno);
+      if (pkgc->kgc_magic && !pkgc->kgc_globstar &&
+          (pkgc->kgc_compiled = kwordexp_pattern_compile(
+               start, KWRDE_PATTERN_PERIOD)) == NULL)
+        return kwei_glob_syserr(pkg, errno);
+    }
+    pkg->kwg_dironly = slash && p[1] == '\0';
+    if (slash)
+      p++;
+  }
+  return KSSUCCESS;
+}
+
+// Walk on up to KWEI_GLOB_THREADS threads with the caller as worker 0.
+static kwei_status_t kwei_glob_parallel(kwei_glob_t *pkg) {
+  kwei_glob_pool_t *pool = ksmalloc(sizeof(kwei_glob_pool_t));
+  if (pool == NULL)
+    return kwei_glob_syserr(pkg, errno);
+  pthread_mutex_init(&pool->kgp_lock, NULL);
+  pthread_cond_init(&pool->kgp_cond, NULL);
+  // the caller's own walk of the first level counts as pending
+  pool->kgp_pending = 1;
+  pool->kgp_queued = 0;
+  pool->kgp_nworker = KWEI_GLOB_THREADS;
+  for (size_t i = 0; i < KWEI_GLOB_THREADS; i++) {
+    pthread_mutex_init(&pool->kgp_deque[i].kgq_lock, NULL);
+    pool->kgp_deque[i].kgq_head = NULL;
+    pool->kgp_deque[i].kgq_tail = NULL;
+  }
+  pkg->kwg_pool = pool;
+  pkg->kwg_worker = 0;
+
+  pthread_t threads[KWEI_GLOB_THREADS];
+  int started[KWEI_GLOB_THREADS] = {0};
+  for (size_t i = 1; i < KWEI_GLOB_THREADS; i++) {
+    kwei_glob_t *pworker = &pool->kgp_worker[i];
+    *pworker = *pkg;
+    pworker->kwg_worker = i;
+    pworker->kwg_path = NULL;
+    pworker->kwg_pathlen = 0;
+    pworker->kwg_pathsize = 0;
+    pworker->kwg_matchv = NULL;
+    pworker->kwg_matchc = 0;
+    pworker->kwg_matchcap = 0;
+    started[i] =
+        pthread_create(&threads[i], NULL, kwei_glob_thread, pworker) == 0;
+  }
+
+  if (kwei_glob_walk(pkg, 0) != KSSUCCESS)
+    kwei_glob_stop(pkg);
+  kwei_glob_done(pool);
+  kwei_glob_work(pkg);
+
+  for (size_t i = 1; i < KWEI_GLOB_THREADS; i++) {
+    if (!started[i])
+      continue;
+    pthread_join(threads[i], NULL);
+    kwei_glob_t *pworker = &pool->kgp_worker[i];
+    if (pkg->kwg_errno == 0)
+      pkg->kwg_errno = pworker->kwg_errno;
+    size_t matchc = pkg->kwg_matchc + pworker->kwg_matchc;
+    if (pworker->kwg_matchc > 0 && matchc > pkg->kwg_matchcap) {
+      char **matchv = ksrealloc(pkg->kwg_matchv, matchc * sizeof(char *));
+      if (matchv != NULL) {
+        pkg->kwg_matchv = matchv;
+        pkg->kwg_matchcap = matchc;
+      } else if (pkg->kwg_errno == 0) {
+        pkg->kwg_errno = errno;
+      }
+    }
+    for (size_t j = 0; j < pworker->kwg_matchc; j++) {
+      if (pkg->kwg_matchc < pkg->kwg_matchcap)
+        pkg->kwg_matchv[pkg->kwg_matchc++] = pworker->kwg_matchv[j];
+      else
+        ksfree(pworker->kwg_matchv[j]);
+    }
+    if (pworker->kwg_matchv != NULL)
+      ksfree(pworker->kwg_matchv);
+    if (pworker->kwg_path != NULL)
+      ksfree(pworker->kwg_path);
+  }
+  for (size_t i = 0; i < KWEI_GLOB_THREADS; i++)
+    pthread_mutex_destroy(&pool->kgp_deque[i].kgq_lock);
+  pthread_cond_destroy(&pool->kgp_cond);
+  pthread_mutex_destroy(&pool->kgp_lock);
+  ksfree(pool);
+  pkg->kwg_pool = NULL;
+  if (pkg->kwg_errno != 0)
+    return kwei_glob_syserr(pkg, pkg->kwg_errno);
+  return KSSUCCESS;
+}
+
+// Pathname expansion against directory listings, served from the process
+// wide cache when KWRDE_GLOBCACHE is set or from the kwe_readdir provider,
+// which must be thread safe under KWRDE_PARALLEL, and otherwise from
+// kwe_shcache when one is set. With KWRDE_NOSORT or a kwe_glob
+// callback, matches are delivered as they are found and kwe_glob_max ends
+// the walk early; otherwise kwe_glob_max truncates the sorted result.
+// KWRDE_PARALLEL spreads patterns with several wildcard levels over a
+// thread pool; sorted output stays deterministic, but unsorted output and
+// callbacks, which are then serialized, follow completion order.
+// *pcount is left 0 on no match.
+kwei_status_t kwei_glob(kwordexp_internal_t *pkwei, const char *pattern,
+                        size_t len, size_t *pcount) {
+  kwei_glob_t kg;
+  memset(&kg, 0, sizeof(kg));
+  *pcount = 0;
+  kg.kwg_pkwei = pkwei;
+  kg.kwg_pstop = &kg.kwg_stop;
+  kg.kwg_pcount = &kg.kwg_count;
+  kg.kwg_dirfd = AT_FDCWD;
+  kg.kwg_provider = pkwei->kwei_pwe->kwe_readdir != NULL;
+  kg.kwg_cache = !kg.kwg_provider && (pkwei->kwei_flags & KWRDE_GLOBCACHE);
+  if (!kg.kwg_provider && !kg.kwg_cache)
+    kg.kwg_shcache = pkwei->kwei_pwe->kwe_shcache;
+  kg.kwg_stream = (pkwei->kwei_flags & KWRDE_NOSORT) ||
+                  pkwei->kwei_pwe->kwe_glob != NULL;
+  kg.kwg_max = pkwei->kwei_pwe->kwe_glob_max;
+  if (pkwei->kwei_into == NULL && pkwei->kwei_sink == NULL &&
+      pkwei->kwei_pwe->kwe_glob == NULL)
+    kg.kwg_words = pkwei->kwei_pwe->kwe_words;
+  size_t wordc = kg.kwg_words != NULL ? kwei_words_count(kg.kwg_words) : 0;
+  char *copy = kmalloc_atomic(len + 1);
+  if (copy == NULL)
+    return kwei_glob_syserr(&kg, errno);
+  memcpy(copy, pattern, len);
+  copy[len] = '\0';
+  kwei_status_t kstat = kwei_glob_split(&kg, copy);
+  size_t nmagic = 0;
+  for (size_t i = 0; i < kg.kwg_compc; i++)
+    nmagic += kg.kwg_compv[i].kgc_globstar ? 2 : kg.kwg_compv[i].kgc_magic;
+  int pooled = (pkwei->kwei_flags & KWRDE_PARALLEL) && nmagic > 1;
+
+  if (kstat == KSSUCCESS && *pattern == '/') {
+    kstat = kwei_glob_append(&kg, "/", 0);
+  } else if (kstat == KSSUCCESS && kg.kwg_cache) {
+    // cache keys are absolute so that chdir cannot alias entries
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+      kstat = kwei_glob_syserr(&kg, errno);
+    else {
+      kstat = kwei_glob_append(&kg, cwd, 0);
+      if (kstat == KSSUCCESS && kg.kwg_path[kg.kwg_pathlen - 1] != '/')
+        kg.kwg_path[kg.kwg_pathlen++] = '/';
+      kg.kwg_root = kg.kwg_pathlen;
+      free(cwd);
+    }
+  } else if (kstat == KSSUCCESS) {
+    kstat = kwei_glob_reserve(&kg, 0);
+  }
+  if (kstat == KSSUCCESS && kg.kwg_compc > 0)
+    kstat = pooled ? kwei_glob_parallel(&kg) : kwei_glob_walk(&kg, 0);
+
+  if (kstat == KSSUCCESS)
+    *pcount = kg.kwg_count;
+  if (kg.kwg_words != NULL) {
+    if (kstat == KSSUCCESS && !(pkwei->kwei_flags & KWRDE_NOSORT) &&
+        kwei_words_sort(kg.kwg_words, wordc) != 0)
+      kstat = kwei_glob_syserr(&kg, errno);
+    if (kstat != KSSUCCESS)
+      kwei_words_truncate(kg.kwg_words, wordc);
+    else if (kg.kwg_max > 0)
+      kwei_words_truncate(kg.kwg_words, wordc + kg.kwg_max);
+    pkwei->kwei_pwe->kwe_wordc = kwei_words_count(kg.kwg_words);
+  }
+  if (kstat == KSSUCCESS && kg.kwg_matchc > 0) {
+    size_t i = 1;
+    while (i < kg.kwg_matchc &&
+           kwei_glob_cmp(&kg.kwg_matchv[i - 1], &kg.kwg_matchv[i]) <= 0)
+      i++;
+    if (i < kg.kwg_matchc && !(pkwei->kwei_flags & KWRDE_NOSORT))
+      qsort(kg.kwg_matchv, kg.kwg_matchc, sizeof(char *), kwei_glob_cmp);
+    size_t matchc = kg.kwg_matchc;
+    if (kg.kwg_max > 0 && matchc > kg.kwg_max)
+      matchc = kg.kwg_max;
+    for (i = 0; i < matchc && kstat == KSSUCCESS; i++)
+      kstat = pooled ? kwei_add_word(pkwei, kg.kwg_matchv[i],
+                                     strlen(kg.kwg_matchv[i]))
+                     : kwei_append_word(pkwei, kg.kwg_matchv[i]);
+  }
+  for (size_t i = 0; i < kg.kwg_compc; i++)
+    if (kg.kwg_compv[i].kgc_compiled != NULL)
+      kwordexp_pattern_free(kg.kwg_compv[i].kgc_compiled);
+  if (kg.kwg_path != NULL)
+    ksfree(kg.kwg_path);
+  if (kg.kwg_matchv != NULL) {
+    for (size_t i = 0; pooled && i < kg.kwg_matchc; i++)
+      ksfree(kg.kwg_matchv[i]);
+    ksfree(kg.kwg_matchv);
+  }
+  return kstat;
+}
@@ -6,6 +6,31 @@
 
 #include "../include/kwordexp.h"
 #include "kio_internal.h"
+#include <stdint.h>
+#include <time.h>
+
+// USDT probes of the kwordexp provider; nothing without <sys/sdt.h>.
+//   expand__start(input, len)   input is NULL for kfwordexp
+//   expand__done(ret, ns)
+//   lookup(key)
+//   glob__start(pattern)
+//   glob__done(pattern, matches, ns)
+//   exec__start(argv0)
+//   exec__spawn(argv0, pid)     only the default exec callback forks
+//   exec__done(argv0, status, ns)
+// ns comes from the coarse clock unless kwe_stats or kwe_slow is set, and is
+// 0 when the metrics are off as well; the probes themselves are timestamped
+// by the tracer.
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define KWEI_PROBE1(name, a) DTRACE_PROBE1(kwordexp, name, a)
+#define KWEI_PROBE2(name, a, b) DTRACE_PROBE2(kwordexp, name, a, b)
+#define KWEI_PROBE3(name, a, b, c) DTRACE_PROBE3(kwordexp, name, a, b, c)
+#else
+#define KWEI_PROBE1(name, a) ((void)0)
+#define KWEI_PROBE2(name, a, b) ((void)0)
+#define KWEI_PROBE3(name, a, b, c) ((void)0)
+#endif
 
 typedef struct kwordexp_internal kwordexp_internal_t;
 
@@ -15,13 +40,63 @@ typedef enum kwei_err {
   KESYNTAX = 2,
   KENARG = 3,
   KEUNDEF = 4,
+  KECMDSUB = 5,
 } kwei_err_t;
 
 typedef enum kwei_status {
   KSERROR = -1,
   KSSUCCESS = 0,
+  // stopped on request; not an error
+  KSSTOP = 1,
+  // a nested parser was pushed onto the frame stack and runs next
+  KSNEST = 2,
 } kwei_status_t;
 
+typedef struct kwei_vars {
+  size_t kwv_count;
+  // sorted, without duplicates
+  const char **kwv_keyv;
+  char **kwv_valuev;
+} kwei_vars_t;
+
+typedef struct kwei_deps {
+  char **kdp_namev;
+  size_t kdp_namec;
+  size_t kdp_namecap;
+  unsigned long kdp_gen;
+  unsigned long kdp_envgen;
+  unsigned long kdp_fsgen;
+  int kdp_fsok;
+  int kdp_glob;
+  // the result must not be cached
+  int kdp_volatile;
+} kwei_deps_t;
+
+// Receives each finished top-level word; KSSTOP ends the expansion.
+typedef kwei_status_t (*kwei_sink_t)(kwordexp_internal_t *pkwei,
+                                     const char *word, size_t len);
+
+typedef struct kwei_into {
+  char *kwi_buf;
+  size_t kwi_cap;
+  // bytes needed so far, which may exceed kwi_cap
+  size_t kwi_len;
+  size_t *kwi_offv;
+  size_t kwi_maxwords;
+  size_t kwi_wordc;
+} kwei_into_t;
+
+typedef struct kwei_frame kwei_frame_t;
+
+// The stack of nested parsers, one frame per depth, kept for the whole
+// expansion so that a nesting level only allocates the first time it is
+// reached. The frame of depth d + 1 is kwf_framev[d].
+typedef struct kwei_frames {
+  kwei_frame_t **kwf_framev;
+  size_t kwf_framec;
+  size_t kwf_max;
+} kwei_frames_t;
+
 struct kwordexp_internal {
   kwordexp_t *kwei_pwe;
   kin_t *kwei_pin;
@@ -29,15 +104,126 @@ struct kwordexp_internal {
   int kwei_flags;
   int kwei_has_arg;
   int kwei_has_pattern;
+  int kwei_has_brace;
+  int kwei_has_escape;
   int kwei_errno;
   kwei_err_t kwei_errex;
   kwei_status_t kwei_status;
+  int kwei_quoted;
+  int kwei_ifsdelim;
+  int kwei_term;
+  int kwei_rawword;
+  // where kwei_parse_internal resumes after a nested parser
+  int kwei_dquote;
+  int kwei_brace_level;
+  int kwei_bracket_level;
+  int kwei_paren_level;
+  size_t kwei_wordcap;
+  size_t kwei_nbrace;
+  const kwei_vars_t *kwei_vars;
+  kwei_deps_t *kwei_deps;
+  kwordexp_info_t *kwei_info;
+  kwei_into_t *kwei_into;
+  kwei_sink_t kwei_sink;
+  void *kwei_sinkdata;
+  char *kwei_scratch;
+  size_t kwei_scratchsize;
+  // bytes handed to the sink
+  size_t kwei_outbytes;
+  kwei_frames_t *kwei_frames;
+  size_t kwei_depth;
   const char *kwei_ifs;
+  unsigned char kwei_ifsmap[256];
+};
+
+typedef enum kwei_frame_kind {
+  // $(...)
+  KWEI_FRAME_CMDSUB,
+  // ${...}
+  KWEI_FRAME_VAR,
+  // the pattern of ${name#pat} and the like
+  KWEI_FRAME_STRIP,
+} kwei_frame_kind_t;
+
+// A nested parser and what its parent does with the words once it ends
+struct kwei_frame {
+  kwordexp_t kf_we;
+  kwordexp_internal_t kf_wei;
+  kout_t *kf_out;
+  kwordexp_internal_t *kf_parent;
+  kwei_frame_kind_t kf_kind;
+  // KWEI_FRAME_STRIP only
+  const char *kf_name;
+  int kf_op;
+  int kf_longest;
+};
+
+#define KWEI_IFS_SPACE 0x01
+#define KWEI_IFS_DELIM 0x02
+
+#ifndef KWEI_DIRCACHE_MAX
+#define KWEI_DIRCACHE_MAX 4096
+#endif
+
+#ifndef KWEI_PATCACHE_MAX
+#define KWEI_PATCACHE_MAX 256
+#endif
+
+#ifndef KWEI_CACHE_MAX
+#define KWEI_CACHE_MAX 1024
+#endif
+
+#ifndef KWEI_HOMECACHE_MAX
+#define KWEI_HOMECACHE_MAX 64
+#endif
+
+#ifndef KWEI_HOMECACHE_TTL
+#define KWEI_HOMECACHE_TTL 300
+#endif
+
+#ifndef KWEI_BRACE_MAX
+#define KWEI_BRACE_MAX 0x100000
+#endif
+
+#ifndef KWEI_BRACE_DEPTH
+#define KWEI_BRACE_DEPTH 1024
+#endif
+
+#ifndef KWEI_DEPTH_MAX
+#define KWEI_DEPTH_MAX 128
+#endif
+
+typedef struct kwei_dirent {
+  const char *kde_name;
+  unsigned char kde_type;
+} kwei_dirent_t;
+
+typedef struct kwordexp_dir kwei_dir_t;
+
+struct kwordexp_dir {
+  kwei_dir_t *kd_next;
+  kwei_dir_t *kd_wdnext;
+  kwei_dir_t *kd_lruprev;
+  kwei_dir_t *kd_lrunext;
+  char *kd_path;
+  size_t kd_hash;
+  int kd_wd;
+  struct timespec kd_mtime;
+  unsigned long kd_refs;
+  size_t kd_entc;
+  size_t kd_entcap;
+  kwei_dirent_t *kd_entv;
+  char *kd_blob;
+  size_t kd_bloblen;
+  size_t kd_blobsize;
 };
 
 int kwordexp(const char *ibuf, kwordexp_t *we, int flags)
     __attribute__((warn_unused_result, nonnull(1, 2)));
 
+int kwordexp_n(const char *ibuf, size_t len, kwordexp_t *we, int flags)
+    __attribute__((warn_unused_result, nonnull(1, 3)));
+
 int kfwordexp(FILE *ifp, kwordexp_t *we, int flags)
     __attribute__((warn_unused_result, nonnull(1, 2)));
 
@@ -46,6 +232,19 @@ void kwordfree(kwordexp_t *we) __attribute__((nonnull(1)));
 void kwordexp_init(kwordexp_t *we, char **argv, size_t argc)
     __attribute__((nonnull(1, 2)));
 
+int kwordexp_into(const char *ibuf, char *buf, size_t cap, size_t *offsets,
+                  size_t maxwords, kwordexp_t *we, int flags, size_t *psize,
+                  size_t *pwordc)
+    __attribute__((warn_unused_result, nonnull(1, 6, 8, 9)));
+
+int kwordexp_write(int fd, const char *ibuf, int sep, kwordexp_t *we,
+                   int flags) __attribute__((warn_unused_result, nonnull(2, 4)));
+
+int kwordexp_analyze(const char *ibuf, kwordexp_info_t *info)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwordexp_info_free(kwordexp_info_t *info) __attribute__((nonnull(1)));
+
 int kwordexp_setenv_default(void *data, const char *key, char *value,
                             int overwrite)
     __attribute__((weak, warn_unused_result, nonnull(2, 3)));
@@ -68,7 +267,39 @@ void kwe_copy(kwordexp_t *pkwe, const kwordexp_t *pother)
 void kwe_free(kwordexp_t *pkwe) __attribute__((nonnull(1)));
 
 kwordexp_internal_t kwei_init(kwordexp_t *pkwe, kin_t *pkin, kout_t *pkout,
-                              int flags)
+                              int flags, const kwei_vars_t *pvars)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kwei_wordexp(const char *ibuf, size_t len, kwordexp_t *pwe, int flags,
+                 kwei_into_t *pinto, kwei_sink_t sink, void *sinkdata)
+    __attribute__((warn_unused_result, nonnull(1, 3)));
+
+kwei_status_t kwei_sink_word(kwordexp_internal_t *pkwei, const char *word,
+                             size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwordexp_internal_t kwei_init_sub(const kwordexp_internal_t *pparent,
+                                  kwordexp_t *pkwe, kout_t *pkout)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+int kwei_ismeta(int ch) __attribute__((warn_unused_result));
+
+kwei_status_t kwei_put_literal(kwordexp_internal_t *pkwei, const char *value,
+                               size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_append_word(kwordexp_internal_t *pkwei, char *word)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_add_word(kwordexp_internal_t *pkwei, const char *word,
+                           size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_put_value(kwordexp_internal_t *pkwei, const char *value,
+                             size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_put_string(kwordexp_internal_t *pkwei, const char *value)
     __attribute__((warn_unused_result, nonnull(1)));
 
 kwei_status_t kwei_parse_squote(kwordexp_internal_t *pkwei)
@@ -78,15 +309,215 @@ kwei_status_t kwei_getenv(kwordexp_internal_t *pkwei, const char *key,
                           char **pvalue)
     __attribute__((warn_unused_result, nonnull(1, 2, 3)));
 
+kwei_status_t kwei_setenv(kwordexp_internal_t *pkwei, const char *key,
+                          char *value, int overwrite)
+    __attribute__((warn_unused_result, nonnull(1, 2, 3)));
+
 kwei_status_t kwei_exec(kwordexp_internal_t *pkwei, char **argv, FILE *ofp)
     __attribute__((warn_unused_result, nonnull(1, 2, 3)));
 
 kwei_status_t kwei_parse_var_paren(kwordexp_internal_t *pkwei)
     __attribute__((warn_unused_result, nonnull(1)));
 
+kwei_status_t kwei_parse_var_arith(kwordexp_internal_t *pkwei)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+kwei_status_t kwei_arith_eval(kwordexp_internal_t *pkwei, const char *expr,
+                              intmax_t *pval)
+    __attribute__((warn_unused_result, nonnull(1, 2, 3)));
+
 kwei_status_t kwei_parse_var_brace(kwordexp_internal_t *pkwei)
     __attribute__((warn_unused_result, nonnull(1)));
 
+kwei_status_t kwei_add_word_unescape(kwordexp_internal_t *pkwei,
+                                    const char *word, size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+int kwei_has_wildcard(const char *word, size_t len)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+kwei_status_t kwei_expand_word(kwordexp_internal_t *pkwei, const char *word,
+                               size_t len, int has_pattern)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_brace_expand(kwordexp_internal_t *pkwei, const char *word,
+                                size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_status_t kwei_glob(kwordexp_internal_t *pkwei, const char *pattern,
+                        size_t len, size_t *pcount)
+    __attribute__((warn_unused_result, nonnull(1, 2, 4)));
+
+kwei_dir_t *kwei_dir_new(void) __attribute__((warn_unused_result));
+
+int kwei_dir_add(kwei_dir_t *pkd, const char *name, unsigned char type)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwei_dir_finish(kwei_dir_t *pkd) __attribute__((nonnull(1)));
+
+kwei_dir_t *kwei_dir_loadat(int fd) __attribute__((warn_unused_result));
+
+kwei_dir_t *kwei_dir_load(const char *path)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+kwei_dir_t *kwei_dir_load_shared(kwordexp_shcache_t *pshc, int fd)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+void kwei_dir_release(kwei_dir_t *pkd) __attribute__((nonnull(1)));
+
+const kwei_dirent_t *kwei_dir_find(const kwei_dir_t *pkd, const char *name)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+kwei_dir_t *kwei_dircache_get(const char *path)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kwei_dircache_gen(unsigned long *pgen)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kwordexp_dir_add(kwordexp_dir_t *dir, const char *name, int isdir)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwordexp_globcache_flush(void);
+
+kwordexp_pattern_t *kwordexp_pattern_compile(const char *pattern, int flags)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kwordexp_pattern_match(const kwordexp_pattern_t *pattern, const char *s,
+                           size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwordexp_pattern_free(kwordexp_pattern_t *pattern)
+    __attribute__((nonnull(1)));
+
+kwei_status_t kwei_tilde(kwordexp_internal_t *pkwei, const char *word,
+                         size_t len, char **pword, size_t *plen)
+    __attribute__((warn_unused_result, nonnull(1, 2, 4, 5)));
+
+void kwordexp_homecache_flush(void);
+
+kwordexp_env_t *kwordexp_env_snapshot(void)
+    __attribute__((warn_unused_result));
+
+kwordexp_env_t *kwordexp_env_new(kwordexp_env_t *base)
+    __attribute__((warn_unused_result));
+
+int kwordexp_env_set(kwordexp_env_t *env, const char *key, const char *value)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+int kwordexp_env_unset(kwordexp_env_t *env, const char *key)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+const char *kwordexp_env_get(const kwordexp_env_t *env, const char *key)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwordexp_env_free(kwordexp_env_t *env);
+
+unsigned long kwei_env_gen(const kwordexp_env_t *env)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+void kwei_deps_init(kwei_deps_t *pdeps, kwordexp_cache_t *pkc,
+                    const kwordexp_t *pkwe) __attribute__((nonnull(1, 2, 3)));
+
+void kwei_deps_free(kwei_deps_t *pdeps) __attribute__((nonnull(1)));
+
+void kwei_deps_var(kwordexp_internal_t *pkwei, const char *name)
+    __attribute__((nonnull(1, 2)));
+
+void kwei_deps_volatile(kwordexp_internal_t *pkwei)
+    __attribute__((nonnull(1)));
+
+void kwei_deps_glob(kwordexp_internal_t *pkwei) __attribute__((nonnull(1)));
+
+int kwei_cache_lookup(kwordexp_cache_t *pkc, kwordexp_t *pkwe,
+                      const char *input, size_t len, int flags)
+    __attribute__((warn_unused_result, nonnull(1, 2, 3)));
+
+void kwei_cache_store(kwordexp_cache_t *pkc, const kwordexp_t *pkwe,
+                      const char *input, size_t len, int flags,
+                      kwei_deps_t *pdeps, size_t wordc)
+    __attribute__((nonnull(1, 2, 3, 6)));
+
+kwordexp_cache_t *kwordexp_cache_new(size_t max)
+    __attribute__((warn_unused_result));
+
+void kwordexp_cache_invalidate(kwordexp_cache_t *cache, const char *name)
+    __attribute__((nonnull(1)));
+
+void kwordexp_cache_free(kwordexp_cache_t *cache) __attribute__((nonnull(1)));
+
+typedef enum kwei_metric {
+  // nanoseconds
+  KWEI_METRIC_EXPAND,
+  KWEI_METRIC_CMDSUB,
+  KWEI_METRIC_GLOB,
+  // bytes, counting the terminating NULs
+  KWEI_METRIC_OUTPUT,
+  KWEI_METRIC_MAX,
+} kwei_metric_t;
+
+int kwei_metrics_enabled(void) __attribute__((warn_unused_result));
+
+void kwei_metrics_record(kwei_metric_t metric, uint64_t value);
+
+void kwei_metrics_error(kwei_err_t errex);
+
+void kwordexp_metrics_enable(int on);
+
+int kwordexp_metrics_dump(FILE *fp) __attribute__((nonnull(1)));
+
+kwordexp_words_t *kwei_words_new(void) __attribute__((warn_unused_result));
+
+void kwei_words_free(kwordexp_words_t *pkww) __attribute__((nonnull(1)));
+
+size_t kwei_words_count(const kwordexp_words_t *pkww)
+    __attribute__((nonnull(1)));
+
+int kwei_words_add(kwordexp_words_t *pkww, const char *path, size_t len)
+    __attribute__((warn_unused_result, nonnull(1, 2)));
+
+void kwei_words_truncate(kwordexp_words_t *pkww, size_t wordc)
+    __attribute__((nonnull(1)));
+
+size_t kwei_words_bytes(const kwordexp_words_t *pkww, size_t wordc)
+    __attribute__((nonnull(1)));
+
+int kwei_words_sort(kwordexp_words_t *pkww, size_t wordc)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+int kwei_words_prepare(kwordexp_t *pkwe)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+const char *kwordexp_word_name(const kwordexp_t *we, size_t i, size_t *prefix)
+    __attribute__((nonnull(1, 3)));
+
+const char *kwordexp_word_prefix(const kwordexp_t *we, size_t prefix,
+                                 size_t *len) __attribute__((nonnull(1)));
+
+size_t kwordexp_word_path(const kwordexp_t *we, size_t i, char *buf,
+                          size_t cap) __attribute__((nonnull(1)));
+
+char **kwordexp_wordv(kwordexp_t *we)
+    __attribute__((warn_unused_result, nonnull(1)));
+
+// kinds of kwordexp_shcache_t entries
+#define KWEI_SHCACHE_CMD 1
+#define KWEI_SHCACHE_DIR 2
+
+void *kwei_shcache_get(kwordexp_shcache_t *pshc, int kind, const char *key,
+                       size_t keylen, size_t *plen, int64_t *paux)
+    __attribute__((warn_unused_result, nonnull(1, 3, 5, 6)));
+
+void kwei_shcache_put(kwordexp_shcache_t *pshc, int kind, const char *key,
+                      size_t keylen, const void *value, size_t len,
+                      int64_t aux) __attribute__((nonnull(1, 3)));
+
+kwordexp_shcache_t *kwordexp_shcache_open(const char *name, size_t size,
+                                          uint64_t ttl_ns)
+    __attribute__((warn_unused_result));
+
+void kwordexp_shcache_close(kwordexp_shcache_t *cache)
+    __attribute__((nonnull(1)));
+
 kwei_status_t kwei_push_word(kwordexp_internal_t *pkwei)
     __attribute__((warn_unused_result, nonnull(1)));
 
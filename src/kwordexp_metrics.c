@@ -0,0 +1,244 @@
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <pthread.h>
+#include <string.h>
+
+// Histograms are log-linear: values below KWEI_HIST_SUB have a bucket each,
+// and every power of two above is split into KWEI_HIST_SUB buckets.
+#define KWEI_HIST_SUB 4
+#define KWEI_HIST_BUCKETS (63 * KWEI_HIST_SUB)
+
+typedef struct kwei_hist {
+  uint64_t kh_count;
+  uint64_t kh_sum;
+  uint64_t kh_bucket[KWEI_HIST_BUCKETS];
+} kwei_hist_t;
+
+typedef struct kwei_shard kwei_shard_t;
+
+// Only the owning thread writes to its shard, so recording needs no locked
+// instructions; the relaxed atomics only keep readers from tearing values.
+struct kwei_shard {
+  kwei_shard_t *ks_prev;
+  kwei_shard_t *ks_next;
+  kwei_hist_t ks_hist[KWEI_METRIC_MAX];
+  uint64_t ks_errors[KECMDSUB + 1];
+};
+
+static struct {
+  pthread_mutex_t km_lock;
+  pthread_once_t km_once;
+  pthread_key_t km_key;
+  kwei_shard_t *km_head;
+  // what threads that have exited left behind
+  kwei_shard_t km_retired;
+} kwei_metrics = {
+    .km_lock = PTHREAD_MUTEX_INITIALIZER,
+    .km_once = PTHREAD_ONCE_INIT,
+};
+
+static __thread kwei_shard_t *kwei_shard;
+
+// on unless kwordexp_metrics_enable(0) turns the recording and its clock
+// reads off
+static int kwei_metrics_on = 1;
+
+static void kwei_shard_fold(kwei_shard_t *pdst, const kwei_shard_t *psrc) {
+  for (int i = 0; i < KWEI_METRIC_MAX; i++) {
+    kwei_hist_t *pdh = &pdst->ks_hist[i];
+    const kwei_hist_t *psh = &psrc->ks_hist[i];
+    pdh->kh_count += __atomic_load_n(&psh->kh_count, __ATOMIC_RELAXED);
+    pdh->kh_sum += __atomic_load_n(&psh->kh_sum, __ATOMIC_RELAXED);
+    for (int j = 0; j < KWEI_HIST_BUCKETS; j++)
+      pdh->kh_bucket[j] +=
+          __atomic_load_n(&psh->kh_bucket[j], __ATOMIC_RELAXED);
+  }
+  for (int i = 0; i <= KECMDSUB; i++)
+    pdst->ks_errors[i] +=
+        __atomic_load_n(&psrc->ks_errors[i], __ATOMIC_RELAXED);
+}
+
+static void kwei_shard_retire(void *data) {
+  kwei_shard_t *pks = data;
+  pthread_mutex_lock(&kwei_metrics.km_lock);
+  kwei_shard_fold(&kwei_metrics.km_retired, pks);
+  if (pks->ks_prev != NULL)
+    pks->ks_prev->ks_next = pks->ks_next;
+  else
+    kwei_metrics.km_head = pks->ks_next;
+  if (pks->ks_next != NULL)
+    pks->ks_next->ks_prev = pks->ks_prev;
+  pthread_mutex_unlock(&kwei_metrics.km_lock);
+  ksfree(pks);
+}
+
+static void kwei_metrics_once(void) {
+  if (pthread_key_create(&kwei_metrics.km_key, kwei_shard_retire) != 0)
+    kwei_metrics.km_key = (pthread_key_t)-1;
+}
+
+static kwei_shard_t *kwei_shard_get(void) {
+  kwei_shard_t *pks = kwei_shard;
+  if (pks != NULL)
+    return pks;
+  pthread_once(&kwei_metrics.km_once, kwei_metrics_once);
+  pks = ksmalloc(sizeof(kwei_shard_t));
+  if (pks == NULL)
+    return NULL;
+  memset(pks, 0, sizeof(*pks));
+  pthread_mutex_lock(&kwei_metrics.km_lock);
+  pks->ks_next = kwei_metrics.km_head;
+  if (kwei_metrics.km_head != NULL)
+    kwei_metrics.km_head->ks_prev = pks;
+  kwei_metrics.km_head = pks;
+  pthread_mutex_unlock(&kwei_metrics.km_lock);
+  // without the key the shard just stays registered after the thread ends
+  if (kwei_metrics.km_key != (pthread_key_t)-1)
+    pthread_setspecific(kwei_metrics.km_key, pks);
+  kwei_shard = pks;
+  return pks;
+}
+
+static inline void kwei_counter_add(uint64_t *pcounter, uint64_t n) {
+  __atomic_store_n(pcounter, __atomic_load_n(pcounter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static int kwei_hist_index(uint64_t value) {
+  if (value < KWEI_HIST_SUB)
+    return value;
+  // KWEI_HIST_SUB is 4: the two bits below the leading one pick the bucket
+  int exp = 63 - __builtin_clzll(value);
+  return (exp - 1) * KWEI_HIST_SUB + ((value >> (exp - 2)) & 3);
+}
+
+// The largest value that falls into bucket index
+static uint64_t kwei_hist_upper(int index) {
+  if (index < KWEI_HIST_SUB)
+    return index;
+  int exp = index / KWEI_HIST_SUB + 1;
+  uint64_t lead = KWEI_HIST_SUB + index % KWEI_HIST_SUB + 1;
+  if (exp == 63 && lead == 2 * KWEI_HIST_SUB)
+    return UINT64_MAX;
+  return (lead << (exp - 2)) - 1;
+}
+
+void kwordexp_metrics_enable(int on) {
+  __atomic_store_n(&kwei_metrics_on, on != 0, __ATOMIC_RELAXED);
+}
+
+int kwei_metrics_enabled(void) {
+  return __atomic_load_n(&kwei_metrics_on, __ATOMIC_RELAXED);
+}
+
+void kwei_metrics_record(kwei_metric_t metric, uint64_t value) {
+  if (!kwei_metrics_enabled())
+    return;
+  kwei_shard_t *pks = kwei_shard_get();
+  if (pks == NULL)
+    return;
+  kwei_hist_t *pkh = &pks->ks_hist[metric];
+  kwei_counter_add(&pkh->kh_count, 1);
+  kwei_counter_add(&pkh->kh_sum, value);
+  kwei_counter_add(&pkh->kh_bucket[kwei_hist_index(value)], 1);
+}
+
+void kwei_metrics_error(kwei_err_t errex) {
+  if (!kwei_metrics_enabled())
+    return;
+  kwei_shard_t *pks = kwei_shard_get();
+  if (pks == NULL || errex < 0 || errex > KECMDSUB)
+    return;
+  kwei_counter_add(&pks->ks_errors[errex], 1);
+}
+
+static const struct {
+  const char *kmd_name;
+  const char *kmd_help;
+  // nanoseconds are exported as seconds
+  int kmd_seconds;
+} kwei_metric_desc[KWEI_METRIC_MAX] = {
+    [KWEI_METRIC_EXPAND] = {"kwordexp_expansion_seconds",
+                            "Time taken by one expansion.", 1},
+    [KWEI_METRIC_CMDSUB] = {"kwordexp_substitution_seconds",
+                            "Time taken by one command substitution.", 1},
+    [KWEI_METRIC_GLOB] = {"kwordexp_glob_seconds",
+                          "Time taken by one pathname expansion.", 1},
+    [KWEI_METRIC_OUTPUT] = {"kwordexp_output_bytes",
+                            "Bytes in the words of one expansion.", 0},
+};
+
+static const char *const kwei_error_kind[KECMDSUB + 1] = {
+    [KESYSTEM] = "system",
+    [KESYNTAX] = "syntax",
+    [KENARG] = "narg",
+    [KEUNDEF] = "undef",
+    [KECMDSUB] = "cmdsub",
+};
+
+static int kwei_hist_dump(FILE *fp, int metric, const kwei_hist_t *pkh) {
+  const char *name = kwei_metric_desc[metric].kmd_name;
+  int seconds = kwei_metric_desc[metric].kmd_seconds;
+  if (fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", name,
+              kwei_metric_desc[metric].kmd_help, name) < 0)
+    return -1;
+  // the buckets from just below the first used one to the last used one
+  int first = 0, last = -1;
+  for (int i = 0; i < KWEI_HIST_BUCKETS; i++) {
+    if (pkh->kh_bucket[i] == 0)
+      continue;
+    if (last == -1)
+      first = i > 0 ? i - 1 : 0;
+    last = i;
+  }
+  uint64_t count = 0;
+  for (int i = first; i <= last; i++) {
+    count += pkh->kh_bucket[i];
+    uint64_t upper = kwei_hist_upper(i);
+    int ret = seconds ? fprintf(fp, "%s_bucket{le=\"%.9g\"} %llu\n", name,
+                                upper / 1e9, (unsigned long long)count)
+                      : fprintf(fp, "%s_bucket{le=\"%llu\"} %llu\n", name,
+                                (unsigned long long)upper,
+                                (unsigned long long)count);
+    if (ret < 0)
+      return -1;
+  }
+  int ret = fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                    (unsigned long long)pkh->kh_count);
+  if (ret >= 0 && seconds)
+    ret = fprintf(fp, "%s_sum %.9f\n", name, pkh->kh_sum / 1e9);
+  else if (ret >= 0)
+    ret = fprintf(fp, "%s_sum %llu\n", name, (unsigned long long)pkh->kh_sum);
+  if (ret >= 0)
+    ret = fprintf(fp, "%s_count %llu\n", name,
+                  (unsigned long long)pkh->kh_count);
+  return ret < 0 ? -1 : 0;
+}
+
+int kwordexp_metrics_dump(FILE *fp) {
+  kwei_shard_t *ptotal = ksmalloc(sizeof(kwei_shard_t));
+  if (ptotal == NULL)
+    return -1;
+  pthread_mutex_lock(&kwei_metrics.km_lock);
+  *ptotal = kwei_metrics.km_retired;
+  for (kwei_shard_t *pks = kwei_metrics.km_head; pks != NULL;
+       pks = pks->ks_next)
+    kwei_shard_fold(ptotal, pks);
+  pthread_mutex_unlock(&kwei_metrics.km_lock);
+
+  int ret = 0;
+  for (int i = 0; i < KWEI_METRIC_MAX && ret == 0; i++)
+    ret = kwei_hist_dump(fp, i, &ptotal->ks_hist[i]);
+  if (ret == 0 &&
+      fprintf(fp, "# HELP kwordexp_errors_total Failed expansions by cause.\n"
+                  "# TYPE kwordexp_errors_total counter\n") < 0)
+    ret = -1;
+  for (int i = KESYSTEM; i <= KECMDSUB && ret == 0; i++) {
+    if (fprintf(fp, "kwordexp_errors_total{kind=\"%s\"} %llu\n",
+                kwei_error_kind[i],
+                (unsigned long long)ptotal->ks_errors[i]) < 0)
+      ret = -1;
+  }
+  ksfree(ptotal);
+  return ret;
+}
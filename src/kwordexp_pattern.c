@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KWEI_PATCACHE_BUCKETS 256
+
+// A compiled pattern is the list of its '*'-separated segments. Each
+// segment has a fixed length, so the first and last are anchored and the
+// middle ones can be found leftmost-first with memmem()/memchr().
+
+typedef enum kwei_patatom_type {
+  KPALIT,
+  KPAANY,
+  KPASET,
+} kwei_patatom_type_t;
+
+typedef struct kwei_patatom {
+  kwei_patatom_type_t kpa_type;
+  unsigned char kpa_ch;
+  size_t kpa_set;
+} kwei_patatom_t;
+
+typedef struct kwei_patseg {
+  size_t kps_atom;
+  size_t kps_len;
+  const char *kps_lit;
+} kwei_patseg_t;
+
+struct kwordexp_pattern {
+  kwordexp_pattern_t *kp_next;
+  kwordexp_pattern_t *kp_lruprev;
+  kwordexp_pattern_t *kp_lrunext;
+  char *kp_source;
+  size_t kp_hash;
+  int kp_flags;
+  unsigned long kp_refs;
+  size_t kp_minlen;
+  int kp_dotok;
+  size_t kp_segc;
+  kwei_patseg_t *kp_segv;
+  kwei_patatom_t *kp_atomv;
+  uint64_t (*kp_setv)[4];
+  char *kp_lit;
+};
+
+typedef struct kwei_patcache {
+  pthread_mutex_t kpc_lock;
+  kwordexp_pattern_t *kpc_bucket[KWEI_PATCACHE_BUCKETS];
+  kwordexp_pattern_t *kpc_head;
+  kwordexp_pattern_t *kpc_tail;
+  size_t kpc_count;
+} kwei_patcache_t;
+
+static kwei_patcache_t kwei_patcache = {
+    .kpc_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void kwei_pattern_destroy(kwordexp_pattern_t *pkp) {
+  if (pkp->kp_source != NULL)
+    ksfree(pkp->kp_source);
+  if (pkp->kp_segv != NULL)
+    ksfree(pkp->kp_segv);
+  if (pkp->kp_atomv != NULL)
+    ksfree(pkp->kp_atomv);
+  if (pkp->kp_setv != NULL)
+    ksfree(pkp->kp_setv);
+  if (pkp->kp_lit != NULL)
+    ksfree(pkp->kp_lit);
+  ksfree(pkp);
+}
+
+void kwordexp_pattern_free(kwordexp_pattern_t *pkp) {
+  if (__atomic_sub_fetch(&pkp->kp_refs, 1, __ATOMIC_ACQ_REL) == 0)
+    kwei_pattern_destroy(pkp);
+}
+
+static int kwei_pattern_class(const char *name, size_t len, int ch) {
+  static const struct {
+    const char *name;
+    int (*fn)(int);
+  } classes[] = {
+      {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+      {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+      {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+      {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+  };
+  for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    if (strlen(classes[i].name) == len &&
+        memcmp(classes[i].name, name, len) == 0)
+      return classes[i].fn(ch) != 0;
+  return -1;
+}
+
+// Parse a bracket expression after its '['. Returns the length consumed
+// including the closing ']', or 0 when p does not hold one.
+static size_t kwei_pattern_bracket(const char *p, uint64_t set[4]) {
+  const char *start = p;
+  int negate = *p == '!' || *p == '^';
+  if (negate)
+    p++;
+  memset(set, 0, 4 * sizeof(uint64_t));
+  int first = 1;
+  while (*p != ']' || first) {
+    first = 0;
+    if (*p == '\0')
+      return 0;
+    if (p[0] == '[' && p[1] == ':') {
+      const char *end = strstr(p + 2, ":]");
+      if (end == NULL)
+        return 0;
+      for (int ch = 0; ch < 256; ch++) {
+        int ret = kwei_pattern_class(p + 2, end - p - 2, ch);
+        if (ret < 0)
+          return 0;
+        if (ret)
+          set[ch / 64] |= (uint64_t)1 << (ch % 64);
+      }
+      p = end + 2;
+      continue;
+    }
+    unsigned char lo;
+    if (p[0] == '[' && (p[1] == '.' || p[1] == '=')) {
+      // collating symbols and equivalence classes of a single byte
+      if (p[2] == '\0' || p[3] != p[1] || p[4] != ']')
+        return 0;
+      lo = p[2];
+      p += 5;
+    } else {
+      if (*p == '\\' && p[1] != '\0')
+        p++;
+      lo = *p++;
+    }
+    unsigned char hi = lo;
+    if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+      p++;
+      if (*p == '\\' && p[1] != '\0')
+        p++;
+      hi = *p++;
+    }
+    for (int ch = lo; ch <= hi; ch++)
+      set[ch / 64] |= (uint64_t)1 << (ch % 64);
+  }
+  if (negate)
+    for (int i = 0; i < 4; i++)
+      set[i] = ~set[i];
+  return p + 1 - start;
+}
+
+static kwordexp_pattern_t *kwei_pattern_build(const char *source, int flags) {
+  size_t len = strlen(source);
+  kwordexp_pattern_t *pkp = ksmalloc(sizeof(kwordexp_pattern_t));
+  if (pkp == NULL)
+    return NULL;
+  memset(pkp, 0, sizeof(*pkp));
+  pkp->kp_flags = flags;
+  pkp->kp_refs = 1;
+  size_t nset = 0;
+  for (const char *p = source; *p != '\0'; p++)
+    nset += *p == '[';
+  pkp->kp_source = ksstrdup(source);
+  pkp->kp_segv = ksmalloc((len + 1) * sizeof(kwei_patseg_t));
+  pkp->kp_atomv = ksmalloc((len + 1) * sizeof(kwei_patatom_t));
+  pkp->kp_setv = ksmalloc((nset + 1) * sizeof(*pkp->kp_setv));
+  pkp->kp_lit = ksmalloc(len + 1);
+  if (pkp->kp_source == NULL || pkp->kp_segv == NULL ||
+      pkp->kp_atomv == NULL || pkp->kp_setv == NULL || pkp->kp_lit == NULL) {
+    int err = errno;
+    kwei_pattern_destroy(pkp);
+    errno = err;
+    return NULL;
+  }
+
+  size_t natom = 0;
+  nset = 0;
+  kwei_patseg_t *pseg = &pkp->kp_segv[0];
+  pseg->kps_atom = 0;
+  pkp->kp_segc = 1;
+  for (const char *p = source; *p != '\0';) {
+    kwei_patatom_t *pkpa = &pkp->kp_atomv[natom];
+    if (*p == '*') {
+      while (*p == '*')
+        p++;
+      pseg->kps_len = natom - pseg->kps_atom;
+      pseg = &pkp->kp_segv[pkp->kp_segc++];
+      pseg->kps_atom = natom;
+      continue;
+    }
+    size_t n;
+    pkpa->kpa_ch = '\0';
+    if (*p == '?') {
+      pkpa->kpa_type = KPAANY;
+      p++;
+    } else if (*p == '[' &&
+               (n = kwei_pattern_bracket(p + 1, pkp->kp_setv[nset])) > 0) {
+      pkpa->kpa_type = KPASET;
+      pkpa->kpa_set = nset++;
+      p += n + 1;
+    } else {
+      if (*p == '\\' && p[1] != '\0')
+        p++;
+      pkpa->kpa_type = KPALIT;
+      pkpa->kpa_ch = *p++;
+    }
+    natom++;
+  }
+  pseg->kps_len = natom - pseg->kps_atom;
+
+  for (size_t i = 0; i < pkp->kp_segc; i++) {
+    pseg = &pkp->kp_segv[i];
+    pkp->kp_minlen += pseg->kps_len;
+    int literal = 1;
+    for (size_t j = 0; j < pseg->kps_len; j++) {
+      kwei_patatom_t *pkpa = &pkp->kp_atomv[pseg->kps_atom + j];
+      literal = literal && pkpa->kpa_type == KPALIT;
+      pkp->kp_lit[pseg->kps_atom + j] = pkpa->kpa_ch;
+    }
+    pseg->kps_lit = literal ? pkp->kp_lit + pseg->kps_atom : NULL;
+  }
+  pkp->kp_dotok = pkp->kp_segv[0].kps_len > 0 &&
+                  pkp->kp_atomv[0].kpa_type == KPALIT &&
+                  pkp->kp_atomv[0].kpa_ch == '.';
+  return pkp;
+}
+
+static int kwei_pattern_at(const kwordexp_pattern_t *pkp,
+                           const kwei_patseg_t *pseg, const unsigned char *s) {
+  if (pseg->kps_lit != NULL)
+    return memcmp(s, pseg->kps_lit, pseg->kps_len) == 0;
+  const kwei_patatom_t *pkpa = &pkp->kp_atomv[pseg->kps_atom];
+  for (size_t i = 0; i < pseg->kps_len; i++, pkpa++) {
+    switch (pkpa->kpa_type) {
+    case KPALIT:
+      if (s[i] != pkpa->kpa_ch)
+        return 0;
+      break;
+    case KPAANY:
+      break;
+    case KPASET:
+      if (!(pkp->kp_setv[pkpa->kpa_set][s[i] / 64] >> (s[i] % 64) & 1))
+        return 0;
+      break;
+    }
+  }
+  return 1;
+}
+
+// Leftmost occurrence of a middle segment in s[0..len).
+static const unsigned char *kwei_pattern_find(const kwordexp_pattern_t *pkp,
+                                              const kwei_patseg_t *pseg,
+                                              const unsigned char *s,
+                                              size_t len) {
+  if (pseg->kps_len > len)
+    return NULL;
+  if (pseg->kps_lit != NULL)
+    return memmem(s, len, pseg->kps_lit, pseg->kps_len);
+  const kwei_patatom_t *pkpa = &pkp->kp_atomv[pseg->kps_atom];
+  const unsigned char *end = s + len - pseg->kps_len;
+  while (s <= end) {
+    if (pkpa->kpa_type == KPALIT) {
+      s = memchr(s, pkpa->kpa_ch, end - s + 1);
+      if (s == NULL)
+        return NULL;
+    }
+    if (kwei_pattern_at(pkp, pseg, s))
+      return s;
+    s++;
+  }
+  return NULL;
+}
+
+int kwordexp_pattern_match(const kwordexp_pattern_t *pkp, const char *str,
+                           size_t len) {
+  const unsigned char *s = (const unsigned char *)str;
+  if (len < pkp->kp_minlen)
+    return 0;
+  if ((pkp->kp_flags & KWRDE_PATTERN_PERIOD) && len > 0 && *s == '.' &&
+      !pkp->kp_dotok)
+    return 0;
+  const kwei_patseg_t *pfirst = &pkp->kp_segv[0];
+  if (pkp->kp_segc == 1)
+    return len == pfirst->kps_len && kwei_pattern_at(pkp, pfirst, s);
+  const kwei_patseg_t *plast = &pkp->kp_segv[pkp->kp_segc - 1];
+  if (!kwei_pattern_at(pkp, pfirst, s) ||
+      !kwei_pattern_at(pkp, plast, s + len - plast->kps_len))
+    return 0;
+  const unsigned char *p = s + pfirst->kps_len;
+  const unsigned char *end = s + len - plast->kps_len;
+  for (size_t i = 1; i + 1 < pkp->kp_segc; i++) {
+    const kwei_patseg_t *pseg = &pkp->kp_segv[i];
+    p = kwei_pattern_find(pkp, pseg, p, end - p);
+    if (p == NULL)
+      return 0;
+    p += pseg->kps_len;
+  }
+  return 1;
+}
+
+// ----------------------------------------------------------------
+// Process-wide cache of compiled patterns; callers hold kpc_lock
+// ----------------------------------------------------------------
+
+static void kwei_patcache_unlink(kwordexp_pattern_t *pkp) {
+  kwei_patcache_t *pkpc = &kwei_patcache;
+  kwordexp_pattern_t **pp =
+      &pkpc->kpc_bucket[pkp->kp_hash % KWEI_PATCACHE_BUCKETS];
+  while (*pp != pkp)
+    pp = &(*pp)->kp_next;
+  *pp = pkp->kp_next;
+  if (pkp->kp_lruprev != NULL)
+    pkp->kp_lruprev->kp_lrunext = pkp->kp_lrunext;
+  else
+    pkpc->kpc_head = pkp->kp_lrunext;
+  if (pkp->kp_lrunext != NULL)
+    pkp->kp_lrunext->kp_lruprev = pkp->kp_lruprev;
+  else
+    pkpc->kpc_tail = pkp->kp_lruprev;
+  pkpc->kpc_count--;
+  kwordexp_pattern_free(pkp);
+}
+
+static void kwei_patcache_push(kwordexp_pattern_t *pkp) {
+  kwei_patcache_t *pkpc = &kwei_patcache;
+  pkp->kp_lruprev = NULL;
+  pkp->kp_lrunext = pkpc->kpc_head;
+  if (pkpc->kpc_head != NULL)
+    pkpc->kpc_head->kp_lruprev = pkp;
+  else
+    pkpc->kpc_tail = pkp;
+  pkpc->kpc_head = pkp;
+}
+
+// Find a cached pattern and take a reference to it.
+static kwordexp_pattern_t *kwei_patcache_get(const char *source, int flags,
+                                             size_t hash) {
+  kwei_patcache_t *pkpc = &kwei_patcache;
+  kwordexp_pattern_t *pkp = pkpc->kpc_bucket[hash % KWEI_PATCACHE_BUCKETS];
+  while (pkp != NULL && (pkp->kp_hash != hash || pkp->kp_flags != flags ||
+                         strcmp(pkp->kp_source, source) != 0))
+    pkp = pkp->kp_next;
+  if (pkp == NULL)
+    return NULL;
+  __atomic_add_fetch(&pkp->kp_refs, 1, __ATOMIC_RELAXED);
+  if (pkpc->kpc_head != pkp) {
+    pkp->kp_lruprev->kp_lrunext = pkp->kp_lrunext;
+    if (pkp->kp_lrunext != NULL)
+      pkp->kp_lrunext->kp_lruprev = pkp->kp_lruprev;
+    else
+      pkpc->kpc_tail = pkp->kp_lruprev;
+    kwei_patcache_push(pkp);
+  }
+  return pkp;
+}
+
+kwordexp_pattern_t *kwordexp_pattern_compile(const char *source, int flags) {
+  kwei_patcache_t *pkpc = &kwei_patcache;
+  size_t hash = 14695981039346656037ULL ^ (unsigned)flags;
+  for (const char *p = source; *p != '\0'; p++)
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+  pthread_mutex_lock(&pkpc->kpc_lock);
+  kwordexp_pattern_t *pkp = kwei_patcache_get(source, flags, hash);
+  pthread_mutex_unlock(&pkpc->kpc_lock);
+  if (pkp != NULL)
+    return pkp;
+
+  pkp = kwei_pattern_build(source, flags);
+  if (pkp == NULL)
+    return NULL;
+  pkp->kp_hash = hash;
+  pthread_mutex_lock(&pkpc->kpc_lock);
+  kwordexp_pattern_t *pother = kwei_patcache_get(source, flags, hash);
+  if (pother != NULL) {
+    // another thread compiled it meanwhile
+    pthread_mutex_unlock(&pkpc->kpc_lock);
+    kwei_pattern_destroy(pkp);
+    return pother;
+  }
+  // the cache holds a reference of its own
+  pkp->kp_refs++;
+  pkp->kp_next = pkpc->kpc_bucket[hash % KWEI_PATCACHE_BUCKETS];
+  pkpc->kpc_bucket[hash % KWEI_PATCACHE_BUCKETS] = pkp;
+  kwei_patcache_push(pkp);
+  pkpc->kpc_count++;
+  while (pkpc->kpc_count > KWEI_PATCACHE_MAX)
+    kwei_patcache_unlink(pkpc->kpc_tail);
+  pthread_mutex_unlock(&pkpc->kpc_lock);
+  return pkp;
+}
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// A hash table in a shared mapping, for processes that expand the same
+// words: a pre-fork server opens it before forking, or unrelated processes
+// open it by name. Everything in the mapping is addressed by offset, since
+// each process may map it elsewhere. One robust mutex guards it all; entries
+// live in an arena that is recycled whole when it fills up, and expired
+// entries are unlinked as lookups come across them.
+
+#define KWEI_SHCACHE_MAGIC 0x6b77736863616368ULL
+#define KWEI_SHCACHE_MIN 65536
+
+typedef struct kwei_shhdr {
+  uint64_t ksh_magic;
+  uint64_t ksh_size;
+  uint64_t ksh_ttl_ns;
+  uint64_t ksh_nbucket;
+  // offset of the arena, and bytes of it in use
+  uint64_t ksh_arena;
+  uint64_t ksh_used;
+  pthread_mutex_t ksh_lock;
+} kwei_shhdr_t;
+
+typedef struct kwei_shent {
+  uint64_t kse_next;
+  uint64_t kse_hash;
+  // CLOCK_MONOTONIC, which all processes of the host share
+  uint64_t kse_expires;
+  uint64_t kse_vallen;
+  int64_t kse_aux;
+  uint32_t kse_kind;
+  uint32_t kse_keylen;
+  // the key, then the value
+  char kse_data[];
+} kwei_shent_t;
+
+struct kwordexp_shcache {
+  kwei_shhdr_t *kshc_hdr;
+  size_t kshc_size;
+};
+
+#define KWEI_SHCACHE_AT(phdr, off) ((kwei_shent_t *)((char *)(phdr) + (off)))
+
+static uint64_t *kwei_shcache_buckets(kwei_shhdr_t *phdr) {
+  return (uint64_t *)(phdr + 1);
+}
+
+static uint64_t kwei_shcache_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t kwei_shcache_hash(int kind, const char *key, size_t keylen) {
+  uint64_t hash = (14695981039346656037ULL ^ kind) * 1099511628211ULL;
+  for (size_t i = 0; i < keylen; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static void kwei_shcache_reset(kwei_shhdr_t *phdr) {
+  memset(kwei_shcache_buckets(phdr), 0, phdr->ksh_nbucket * sizeof(uint64_t));
+  phdr->ksh_used = 0;
+}
+
+static int kwei_shcache_lock(kwei_shhdr_t *phdr) {
+  int ret = pthread_mutex_lock(&phdr->ksh_lock);
+  if (ret == EOWNERDEAD) {
+    // the owner died halfway through an update; start over
+    kwei_shcache_reset(phdr);
+    pthread_mutex_consistent(&phdr->ksh_lock);
+    ret = 0;
+  }
+  return ret;
+}
+
+// The live entry for key; expired ones on the way are unlinked.
+static kwei_shent_t *kwei_shcache_find(kwei_shhdr_t *phdr, uint64_t hash,
+                                       int kind, const char *key,
+                                       size_t keylen) {
+  uint64_t now = kwei_shcache_now();
+  uint64_t *poff = &kwei_shcache_buckets(phdr)[hash & (phdr->ksh_nbucket - 1)];
+  while (*poff != 0) {
+    kwei_shent_t *pent = KWEI_SHCACHE_AT(phdr, *poff);
+    if (pent->kse_expires <= now) {
+      *poff = pent->kse_next;
+      continue;
+    }
+    if (pent->kse_hash == hash && pent->kse_kind == (uint32_t)kind &&
+        pent->kse_keylen == keylen && memcmp(pent->kse_data, key, keylen) == 0)
+      return pent;
+    poff = &pent->kse_next;
+  }
+  return NULL;
+}
+
+static int kwei_shcache_init(kwei_shhdr_t *phdr, size_t size,
+                             uint64_t ttl_ns) {
+  pthread_mutexattr_t attr;
+  if (pthread_mutexattr_init(&attr) != 0)
+    return -1;
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int ret = pthread_mutex_init(&phdr->ksh_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (ret != 0) {
+    errno = ret;
+    return -1;
+  }
+  // about one bucket per kilobyte of arena
+  size_t nbucket = 64;
+  while (nbucket * 2048 <= size)
+    nbucket *= 2;
+  phdr->ksh_size = size;
+  phdr->ksh_ttl_ns = ttl_ns;
+  phdr->ksh_nbucket = nbucket;
+  phdr->ksh_arena = sizeof(kwei_shhdr_t) + nbucket * sizeof(uint64_t);
+  kwei_shcache_reset(phdr);
+  // the magic goes last; processes opening by name wait for it
+  __atomic_store_n(&phdr->ksh_magic, KWEI_SHCACHE_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Wait for the process that created a named cache to size and initialize
+// it.
+static kwei_shhdr_t *kwei_shcache_attach(int fd, size_t *psize) {
+  struct stat st;
+  for (int i = 0; i < 1000; i++) {
+    if (fstat(fd, &st) == -1)
+      return NULL;
+    if (st.st_size >= KWEI_SHCACHE_MIN) {
+      kwei_shhdr_t *phdr =
+          mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (phdr == MAP_FAILED)
+        return NULL;
+      if (__atomic_load_n(&phdr->ksh_magic, __ATOMIC_ACQUIRE) ==
+          KWEI_SHCACHE_MAGIC) {
+        *psize = st.st_size;
+        return phdr;
+      }
+      munmap(phdr, st.st_size);
+    }
+    usleep(1000);
+  }
+  errno = EPROTO;
+  return NULL;
+}
+
+kwordexp_shcache_t *kwordexp_shcache_open(const char *name, size_t size,
+                                          uint64_t ttl_ns) {
+  if (size < KWEI_SHCACHE_MIN)
+    size = KWEI_SHCACHE_MIN;
+  kwordexp_shcache_t *pshc = ksmalloc(sizeof(kwordexp_shcache_t));
+  if (pshc == NULL)
+    return NULL;
+  int create = 1;
+  int fd;
+  if (name == NULL) {
+    fd = memfd_create("kwordexp", MFD_CLOEXEC);
+  } else {
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EEXIST) {
+      create = 0;
+      fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    }
+  }
+  if (fd == -1) {
+    int err = errno;
+    ksfree(pshc);
+    errno = err;
+    return NULL;
+  }
+  kwei_shhdr_t *phdr = NULL;
+  if (!create) {
+    phdr = kwei_shcache_attach(fd, &size);
+  } else if (ftruncate(fd, size) == 0) {
+    phdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (phdr == MAP_FAILED)
+      phdr = NULL;
+    else if (kwei_shcache_init(phdr, size, ttl_ns) != 0) {
+      int err = errno;
+      munmap(phdr, size);
+      errno = err;
+      phdr = NULL;
+    }
+  }
+  int err = errno;
+  close(fd);
+  if (phdr == NULL) {
+    if (create && name != NULL)
+      shm_unlink(name);
+    ksfree(pshc);
+    errno = err;
+    return NULL;
+  }
+  pshc->kshc_hdr = phdr;
+  pshc->kshc_size = size;
+  return pshc;
+}
+
+void kwordexp_shcache_close(kwordexp_shcache_t *pshc) {
+  munmap(pshc->kshc_hdr, pshc->kshc_size);
+  ksfree(pshc);
+}
+
+// A copy of the value stored under key, or NULL when there is none.
+void *kwei_shcache_get(kwordexp_shcache_t *pshc, int kind, const char *key,
+                       size_t keylen, size_t *plen, int64_t *paux) {
+  kwei_shhdr_t *phdr = pshc->kshc_hdr;
+  uint64_t hash = kwei_shcache_hash(kind, key, keylen);
+  if (kwei_shcache_lock(phdr) != 0)
+    return NULL;
+  char *value = NULL;
+  kwei_shent_t *pent = kwei_shcache_find(phdr, hash, kind, key, keylen);
+  if (pent != NULL && (value = ksmalloc(pent->kse_vallen + 1)) != NULL) {
+    memcpy(value, pent->kse_data + keylen, pent->kse_vallen);
+    value[pent->kse_vallen] = '\0';
+    *plen = pent->kse_vallen;
+    *paux = pent->kse_aux;
+  }
+  pthread_mutex_unlock(&phdr->ksh_lock);
+  return value;
+}
+
+void kwei_shcache_put(kwordexp_shcache_t *pshc, int kind, const char *key,
+                      size_t keylen, const void *value, size_t len,
+                      int64_t aux) {
+  kwei_shhdr_t *phdr = pshc->kshc_hdr;
+  size_t arenasize = phdr->ksh_size - phdr->ksh_arena;
+  size_t need = (sizeof(kwei_shent_t) + keylen + len + 7) & ~(size_t)7;
+  // an entry this large would flush everything else too often
+  if (need > arenasize / 8 || keylen > UINT32_MAX)
+    return;
+  uint64_t hash = kwei_shcache_hash(kind, key, keylen);
+  if (kwei_shcache_lock(phdr) != 0)
+    return;
+  // another process may have stored it meanwhile
+  if (kwei_shcache_find(phdr, hash, kind, key, keylen) == NULL) {
+    if (phdr->ksh_used + need > arenasize)
+      kwei_shcache_reset(phdr);
+    uint64_t off = phdr->ksh_arena + phdr->ksh_used;
+    kwei_shent_t *pent = KWEI_SHCACHE_AT(phdr, off);
+    uint64_t *pbucket =
+        &kwei_shcache_buckets(phdr)[hash & (phdr->ksh_nbucket - 1)];
+    pent->kse_hash = hash;
+    pent->kse_expires = phdr->ksh_ttl_ns > 0
+                            ? kwei_shcache_now() + phdr->ksh_ttl_ns
+                            : UINT64_MAX;
+    pent->kse_vallen = len;
+    pent->kse_aux = aux;
+    pent->kse_kind = kind;
+    pent->kse_keylen = keylen;
+    memcpy(pent->kse_data, key, keylen);
+    if (len > 0)
+      memcpy(pent->kse_data + keylen, value, len);
+    pent->kse_next = *pbucket;
+    *pbucket = off;
+    phdr->ksh_used += need;
+  }
+  pthread_mutex_unlock(&phdr->ksh_lock);
+}
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct kwei_home kwei_home_t;
+
+struct kwei_home {
+  kwei_home_t *kh_prev;
+  kwei_home_t *kh_next;
+  char *kh_user;
+  // NULL when the user does not exist
+  char *kh_home;
+  time_t kh_expire;
+};
+
+typedef struct kwei_homecache {
+  pthread_mutex_t khc_lock;
+  kwei_home_t *khc_head;
+  kwei_home_t *khc_tail;
+  size_t khc_count;
+} kwei_homecache_t;
+
+static kwei_homecache_t kwei_homecache = {
+    .khc_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static time_t kwei_home_now(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+  return ts.tv_sec;
+}
+
+static void kwei_home_destroy(kwei_home_t *pkh) {
+  ksfree(pkh->kh_user);
+  if (pkh->kh_home != NULL)
+    ksfree(pkh->kh_home);
+  ksfree(pkh);
+}
+
+static void kwei_homecache_unlink(kwei_home_t *pkh) {
+  kwei_homecache_t *pkhc = &kwei_homecache;
+  if (pkh->kh_prev != NULL)
+    pkh->kh_prev->kh_next = pkh->kh_next;
+  else
+    pkhc->khc_head = pkh->kh_next;
+  if (pkh->kh_next != NULL)
+    pkh->kh_next->kh_prev = pkh->kh_prev;
+  else
+    pkhc->khc_tail = pkh->kh_prev;
+  pkhc->khc_count--;
+}
+
+static void kwei_homecache_push(kwei_home_t *pkh) {
+  kwei_homecache_t *pkhc = &kwei_homecache;
+  pkh->kh_prev = NULL;
+  pkh->kh_next = pkhc->khc_head;
+  if (pkhc->khc_head != NULL)
+    pkhc->khc_head->kh_prev = pkh;
+  else
+    pkhc->khc_tail = pkh;
+  pkhc->khc_head = pkh;
+  pkhc->khc_count++;
+}
+
+// Look the user up in the password database. An empty user is the caller.
+static int kwei_home_lookup(const char *user, char **phome) {
+  struct passwd pw;
+  struct passwd *ppw = NULL;
+  long bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
+  if (bufsize <= 0)
+    bufsize = 1024;
+  for (;;) {
+    char *buf = ksmalloc(bufsize);
+    if (buf == NULL)
+      return -1;
+    int ret = *user == '\0' ? getpwuid_r(getuid(), &pw, buf, bufsize, &ppw)
+                            : getpwnam_r(user, &pw, buf, bufsize, &ppw);
+    if (ret == ERANGE) {
+      ksfree(buf);
+      bufsize *= 2;
+      continue;
+    }
+    *phome = NULL;
+    if (ret == 0 && ppw != NULL && ppw->pw_dir != NULL) {
+      *phome = ksstrdup(ppw->pw_dir);
+      if (*phome == NULL) {
+        ksfree(buf);
+        return -1;
+      }
+    }
+    ksfree(buf);
+    return 0;
+  }
+}
+
+// Resolve the home directory of user through the cache. *phome is a
+// ksmalloc'ed copy, or NULL when the user is unknown.
+static int kwei_home_get(const char *user, char **phome) {
+  kwei_homecache_t *pkhc = &kwei_homecache;
+  time_t now = kwei_home_now();
+  pthread_mutex_lock(&pkhc->khc_lock);
+  for (kwei_home_t *pkh = pkhc->khc_head; pkh != NULL; pkh = pkh->kh_next) {
+    if (strcmp(pkh->kh_user, user) != 0)
+      continue;
+    kwei_homecache_unlink(pkh);
+    if (pkh->kh_expire <= now) {
+      kwei_home_destroy(pkh);
+      break;
+    }
+    kwei_homecache_push(pkh);
+    *phome = NULL;
+    if (pkh->kh_home != NULL && (*phome = ksstrdup(pkh->kh_home)) == NULL) {
+      pthread_mutex_unlock(&pkhc->khc_lock);
+      return -1;
+    }
+    pthread_mutex_unlock(&pkhc->khc_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&pkhc->khc_lock);
+
+  // lookups may go over the network, so do not hold the lock for them
+  if (kwei_home_lookup(user, phome) != 0)
+    return -1;
+  kwei_home_t *pkh = ksmalloc(sizeof(kwei_home_t));
+  if (pkh == NULL)
+    return 0;
+  pkh->kh_user = ksstrdup(user);
+  pkh->kh_home = *phome != NULL ? ksstrdup(*phome) : NULL;
+  pkh->kh_expire = now + KWEI_HOMECACHE_TTL;
+  if (pkh->kh_user == NULL || (*phome != NULL && pkh->kh_home == NULL)) {
+    if (pkh->kh_user != NULL)
+      ksfree(pkh->kh_user);
+    if (pkh->kh_home != NULL)
+      ksfree(pkh->kh_home);
+    ksfree(pkh);
+    return 0;
+  }
+  pthread_mutex_lock(&pkhc->khc_lock);
+  for (kwei_home_t *pold = pkhc->khc_head; pold != NULL;
+       pold = pold->kh_next) {
+    if (strcmp(pold->kh_user, user) == 0) {
+      kwei_homecache_unlink(pold);
+      kwei_home_destroy(pold);
+      break;
+    }
+  }
+  kwei_homecache_push(pkh);
+  while (pkhc->khc_count > KWEI_HOMECACHE_MAX) {
+    kwei_home_t *ptail = pkhc->khc_tail;
+    kwei_homecache_unlink(ptail);
+    kwei_home_destroy(ptail);
+  }
+  pthread_mutex_unlock(&pkhc->khc_lock);
+  return 0;
+}
+
+void kwordexp_homecache_flush(void) {
+  kwei_homecache_t *pkhc = &kwei_homecache;
+  pthread_mutex_lock(&pkhc->khc_lock);
+  while (pkhc->khc_head != NULL) {
+    kwei_home_t *pkh = pkhc->khc_head;
+    kwei_homecache_unlink(pkh);
+    kwei_home_destroy(pkh);
+  }
+  pthread_mutex_unlock(&pkhc->khc_lock);
+}
+
+kwei_status_t kwei_tilde(kwordexp_internal_t *pkwei, const char *word,
+                         size_t len, char **pword, size_t *plen) {
+  *pword = NULL;
+  size_t end = 1;
+  while (end < len && word[end] != '/') {
+    // a quoted or escaped character disables the expansion
+    if (word[end] == '\\')
+      return KSSUCCESS;
+    end++;
+  }
+
+  char *home = NULL;
+  int owned = 0;
+  if (end == 1) {
+    kwei_status_t kstat = kwei_getenv(pkwei, "HOME", &home);
+    if (kstat != KSSUCCESS)
+      return kstat;
+  }
+  if (home == NULL) {
+    char user[end];
+    memcpy(user, word + 1, end - 1);
+    user[end - 1] = '\0';
+    if (kwei_home_get(user, &home) != 0) {
+      pkwei->kwei_errno = errno;
+      pkwei->kwei_errex = KESYSTEM;
+      pkwei->kwei_status = KSERROR;
+      return KSERROR;
+    }
+    if (home == NULL)
+      return KSSUCCESS;
+    owned = 1;
+  }
+
+  size_t homelen = strlen(home);
+  char *buf = ksmalloc(homelen * 2 + len - end + 1);
+  if (buf == NULL) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    if (owned)
+      ksfree(home);
+    return KSERROR;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < homelen; i++) {
+    if (kwei_ismeta((unsigned char)home[i]))
+      buf[n++] = '\\';
+    buf[n++] = home[i];
+  }
+  memcpy(buf + n, word + end, len - end);
+  n += len - end;
+  buf[n] = '\0';
+  if (owned)
+    ksfree(home);
+  pkwei->kwei_has_escape = 1;
+  *pword = buf;
+  *plen = n;
+  return KSSUCCESS;
+}
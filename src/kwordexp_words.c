@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "kmalloc_internal.h"
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A word is kept as an interned directory prefix and the name after it, so
+// that the matches of a large glob store each directory only once.
+typedef struct kwei_word {
+  // offset of the name in kww_names
+  size_t kwd_off;
+  uint32_t kwd_prefix;
+  uint32_t kwd_len;
+} kwei_word_t;
+
+struct kwordexp_words {
+  kwei_word_t *kww_wordv;
+  size_t kww_wordc;
+  size_t kww_wordcap;
+  // names back to back, each followed by a NUL
+  char *kww_names;
+  size_t kww_nameslen;
+  size_t kww_namescap;
+  // prefixes the same way; prefix 0 is the empty one
+  char *kww_prefixes;
+  size_t kww_prefixeslen;
+  size_t kww_prefixescap;
+  size_t *kww_prefixv;
+  size_t kww_prefixc;
+  size_t kww_prefixcap;
+  // open addressing over prefix ids; 0 is an empty slot, so ids are stored
+  // plus one
+  uint32_t *kww_hashv;
+  size_t kww_hashcap;
+};
+
+static size_t kwei_words_hash(const char *s, size_t len) {
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static const char *kwei_words_prefix(const kwordexp_words_t *pkww, size_t id,
+                                     size_t *plen) {
+  size_t off = pkww->kww_prefixv[id];
+  size_t end = id + 1 < pkww->kww_prefixc ? pkww->kww_prefixv[id + 1]
+                                           : pkww->kww_prefixeslen;
+  *plen = end - off - 1;
+  return pkww->kww_prefixes + off;
+}
+
+static int kwei_words_grow(char **pbuf, size_t *pcap, size_t need) {
+  if (need <= *pcap)
+    return 0;
+  size_t cap = *pcap > 0 ? *pcap : 256;
+  while (cap < need)
+    cap *= 2;
+  char *buf = ksrealloc(*pbuf, cap);
+  if (buf == NULL)
+    return -1;
+  *pbuf = buf;
+  *pcap = cap;
+  return 0;
+}
+
+static int kwei_words_rehash(kwordexp_words_t *pkww) {
+  size_t cap = pkww->kww_hashcap > 0 ? pkww->kww_hashcap * 2 : 64;
+  uint32_t *hashv = ksmalloc(cap * sizeof(uint32_t));
+  if (hashv == NULL)
+    return -1;
+  memset(hashv, 0, cap * sizeof(uint32_t));
+  for (size_t id = 0; id < pkww->kww_prefixc; id++) {
+    size_t len;
+    const char *prefix = kwei_words_prefix(pkww, id, &len);
+    size_t i = kwei_words_hash(prefix, len) & (cap - 1);
+    while (hashv[i] != 0)
+      i = (i + 1) & (cap - 1);
+    hashv[i] = id + 1;
+  }
+  if (pkww->kww_hashv != NULL)
+    ksfree(pkww->kww_hashv);
+  pkww->kww_hashv = hashv;
+  pkww->kww_hashcap = cap;
+  return 0;
+}
+
+// The id of prefix, added when it is new; -1 with errno set on failure.
+static int64_t kwei_words_intern(kwordexp_words_t *pkww, const char *prefix,
+                                 size_t len) {
+  size_t mask = pkww->kww_hashcap - 1;
+  size_t i = kwei_words_hash(prefix, len) & mask;
+  for (; pkww->kww_hashv[i] != 0; i = (i + 1) & mask) {
+    size_t id = pkww->kww_hashv[i] - 1, idlen;
+    const char *s = kwei_words_prefix(pkww, id, &idlen);
+    if (idlen == len && memcmp(s, prefix, len) == 0)
+      return id;
+  }
+  if (pkww->kww_prefixc >= UINT32_MAX - 1) {
+    errno = E2BIG;
+    return -1;
+  }
+  if (kwei_words_grow(&pkww->kww_prefixes, &pkww->kww_prefixescap,
+                      pkww->kww_prefixeslen + len + 1) != 0)
+    return -1;
+  if (pkww->kww_prefixc == pkww->kww_prefixcap) {
+    size_t cap = pkww->kww_prefixcap * 2;
+    size_t *prefixv = ksrealloc(pkww->kww_prefixv, cap * sizeof(size_t));
+    if (prefixv == NULL)
+      return -1;
+    pkww->kww_prefixv = prefixv;
+    pkww->kww_prefixcap = cap;
+  }
+  size_t id = pkww->kww_prefixc++;
+  pkww->kww_prefixv[id] = pkww->kww_prefixeslen;
+  memcpy(pkww->kww_prefixes + pkww->kww_prefixeslen, prefix, len);
+  pkww->kww_prefixes[pkww->kww_prefixeslen + len] = '\0';
+  pkww->kww_prefixeslen += len + 1;
+  // keep the table at most half full
+  if (pkww->kww_prefixc * 2 > pkww->kww_hashcap) {
+    if (kwei_words_rehash(pkww) != 0)
+      return -1;
+  } else {
+    pkww->kww_hashv[i] = id + 1;
+  }
+  return id;
+}
+
+kwordexp_words_t *kwei_words_new(void) {
+  kwordexp_words_t *pkww = ksmalloc(sizeof(kwordexp_words_t));
+  if (pkww == NULL)
+    return NULL;
+  memset(pkww, 0, sizeof(*pkww));
+  pkww->kww_prefixv = ksmalloc(16 * sizeof(size_t));
+  if (pkww->kww_prefixv == NULL) {
+    ksfree(pkww);
+    return NULL;
+  }
+  pkww->kww_prefixcap = 16;
+  // prefix 0 is the empty one
+  if (kwei_words_grow(&pkww->kww_prefixes, &pkww->kww_prefixescap, 1) != 0 ||
+      kwei_words_rehash(pkww) != 0 || kwei_words_intern(pkww, "", 0) != 0) {
+    kwei_words_free(pkww);
+    return NULL;
+  }
+  return pkww;
+}
+
+void kwei_words_free(kwordexp_words_t *pkww) {
+  if (pkww->kww_wordv != NULL)
+    ksfree(pkww->kww_wordv);
+  if (pkww->kww_names != NULL)
+    ksfree(pkww->kww_names);
+  if (pkww->kww_prefixes != NULL)
+    ksfree(pkww->kww_prefixes);
+  if (pkww->kww_prefixv != NULL)
+    ksfree(pkww->kww_prefixv);
+  if (pkww->kww_hashv != NULL)
+    ksfree(pkww->kww_hashv);
+  ksfree(pkww);
+}
+
+size_t kwei_words_count(const kwordexp_words_t *pkww) {
+  return pkww->kww_wordc;
+}
+
+// The prefix is everything up to the last slash that is not the final
+// character, so "a/b/" is split as "a/" and "b/".
+int kwei_words_add(kwordexp_words_t *pkww, const char *path, size_t len) {
+  size_t split = len > 0 ? len - 1 : 0;
+  while (split > 0 && path[split - 1] != '/')
+    split--;
+  if (len - split > UINT32_MAX) {
+    errno = E2BIG;
+    return -1;
+  }
+  int64_t id = kwei_words_intern(pkww, path, split);
+  if (id < 0)
+    return -1;
+  size_t namelen = len - split;
+  if (kwei_words_grow(&pkww->kww_names, &pkww->kww_namescap,
+                      pkww->kww_nameslen + namelen + 1) != 0)
+    return -1;
+  if (pkww->kww_wordc == pkww->kww_wordcap) {
+    size_t cap = pkww->kww_wordcap > 0 ? pkww->kww_wordcap * 2 : 16;
+    kwei_word_t *wordv = ksrealloc(pkww->kww_wordv, cap * sizeof(kwei_word_t));
+    if (wordv == NULL)
+      return -1;
+    pkww->kww_wordv = wordv;
+    pkww->kww_wordcap = cap;
+  }
+  kwei_word_t *pkwd = &pkww->kww_wordv[pkww->kww_wordc++];
+  pkwd->kwd_off = pkww->kww_nameslen;
+  pkwd->kwd_prefix = id;
+  pkwd->kwd_len = namelen;
+  memcpy(pkww->kww_names + pkww->kww_nameslen, path + split, namelen);
+  pkww->kww_names[pkww->kww_nameslen + namelen] = '\0';
+  pkww->kww_nameslen += namelen + 1;
+  return 0;
+}
+
+// Drop the words from wordc on. Their names stay in the buffer.
+void kwei_words_truncate(kwordexp_words_t *pkww, size_t wordc) {
+  if (wordc < pkww->kww_wordc)
+    pkww->kww_wordc = wordc;
+}
+
+// Bytes of the words from wordc on as full paths, counting the NULs
+size_t kwei_words_bytes(const kwordexp_words_t *pkww, size_t wordc) {
+  size_t bytes = 0;
+  for (size_t i = wordc; i < pkww->kww_wordc; i++) {
+    size_t prefixlen;
+    kwei_words_prefix(pkww, pkww->kww_wordv[i].kwd_prefix, &prefixlen);
+    bytes += prefixlen + pkww->kww_wordv[i].kwd_len + 1;
+  }
+  return bytes;
+}
+
+static char *kwei_words_path(const kwordexp_words_t *pkww,
+                             const kwei_word_t *pkwd, char *buf) {
+  size_t prefixlen;
+  const char *prefix = kwei_words_prefix(pkww, pkwd->kwd_prefix, &prefixlen);
+  memcpy(buf, prefix, prefixlen);
+  memcpy(buf + prefixlen, pkww->kww_names + pkwd->kwd_off, pkwd->kwd_len + 1);
+  return buf;
+}
+
+typedef struct kwei_words_sort {
+  const kwordexp_words_t *kws_pkww;
+  char *kws_a;
+  char *kws_b;
+} kwei_words_sort_t;
+
+// Words under the same prefix compare by name alone; the prefix ends in a
+// slash, so no collation element can span the boundary.
+static int kwei_words_cmp(const void *a, const void *b, void *arg) {
+  const kwei_words_sort_t *pkws = arg;
+  const kwordexp_words_t *pkww = pkws->kws_pkww;
+  const kwei_word_t *pa = a, *pb = b;
+  if (pa->kwd_prefix == pb->kwd_prefix)
+    return strcoll(pkww->kww_names + pa->kwd_off,
+                   pkww->kww_names + pb->kwd_off);
+  return strcoll(kwei_words_path(pkww, pa, pkws->kws_a),
+                 kwei_words_path(pkww, pb, pkws->kws_b));
+}
+
+// Sort the words from wordc on as full paths, in the order of strcoll(3).
+int kwei_words_sort(kwordexp_words_t *pkww, size_t wordc) {
+  if (wordc >= pkww->kww_wordc)
+    return 0;
+  kwei_words_sort_t kws = {pkww, NULL, NULL};
+  const kwei_word_t *wordv = pkww->kww_wordv;
+  size_t maxlen = 0;
+  int mixed = 0;
+  for (size_t i = wordc; i < pkww->kww_wordc; i++) {
+    if (wordv[i].kwd_len > maxlen)
+      maxlen = wordv[i].kwd_len;
+    mixed |= wordv[i].kwd_prefix != wordv[wordc].kwd_prefix;
+  }
+  // the scratch paths are only needed when several prefixes are involved
+  if (mixed) {
+    size_t size = 0, prefixlen;
+    for (size_t id = 0; id < pkww->kww_prefixc; id++) {
+      kwei_words_prefix(pkww, id, &prefixlen);
+      if (prefixlen > size)
+        size = prefixlen;
+    }
+    size += maxlen + 1;
+    kws.kws_a = ksmalloc(size);
+    kws.kws_b = ksmalloc(size);
+    if (kws.kws_a == NULL || kws.kws_b == NULL) {
+      int err = errno;
+      if (kws.kws_a != NULL)
+        ksfree(kws.kws_a);
+      errno = err;
+      return -1;
+    }
+  }
+  size_t i = wordc + 1;
+  while (i < pkww->kww_wordc &&
+         kwei_words_cmp(&wordv[i - 1], &wordv[i], &kws) <= 0)
+    i++;
+  if (i < pkww->kww_wordc)
+    qsort_r(pkww->kww_wordv + wordc, pkww->kww_wordc - wordc,
+            sizeof(kwei_word_t), kwei_words_cmp, &kws);
+  if (kws.kws_a != NULL) {
+    ksfree(kws.kws_a);
+    ksfree(kws.kws_b);
+  }
+  return 0;
+}
+
+// KWRDE_COMPACT moves the words expanded so far into a kwordexp_words_t,
+// and every expansion into one drops the kwe_wordv built from it.
+int kwei_words_prepare(kwordexp_t *pkwe) {
+  if (pkwe->kwe_words == NULL) {
+    kwordexp_words_t *pkww = kwei_words_new();
+    if (pkww == NULL)
+      return -1;
+    for (size_t i = 0; i < pkwe->kwe_wordc; i++) {
+      if (kwei_words_add(pkww, pkwe->kwe_wordv[i],
+                         strlen(pkwe->kwe_wordv[i])) != 0) {
+        int err = errno;
+        kwei_words_free(pkww);
+        errno = err;
+        return -1;
+      }
+    }
+    pkwe->kwe_words = pkww;
+  }
+  if (pkwe->kwe_wordv != NULL) {
+    kfree(pkwe->kwe_wordv);
+    pkwe->kwe_wordv = NULL;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------
+// Accessors
+// ----------------------------------------------------------------
+
+const char *kwordexp_word_name(const kwordexp_t *pwe, size_t i,
+                               size_t *pprefix) {
+  const kwordexp_words_t *pkww = pwe->kwe_words;
+  if (pkww == NULL) {
+    *pprefix = 0;
+    return pwe->kwe_wordv[i];
+  }
+  *pprefix = pkww->kww_wordv[i].kwd_prefix;
+  return pkww->kww_names + pkww->kww_wordv[i].kwd_off;
+}
+
+const char *kwordexp_word_prefix(const kwordexp_t *pwe, size_t prefix,
+                                 size_t *plen) {
+  size_t len = 0;
+  const char *s =
+      pwe->kwe_words != NULL ? kwei_words_prefix(pwe->kwe_words, prefix, &len)
+                             : "";
+  if (plen != NULL)
+    *plen = len;
+  return s;
+}
+
+size_t kwordexp_word_path(const kwordexp_t *pwe, size_t i, char *buf,
+                          size_t cap) {
+  size_t prefix, prefixlen;
+  const char *name = kwordexp_word_name(pwe, i, &prefix);
+  const char *s = kwordexp_word_prefix(pwe, prefix, &prefixlen);
+  size_t namelen = pwe->kwe_words != NULL
+                       ? pwe->kwe_words->kww_wordv[i].kwd_len
+                       : strlen(name);
+  size_t len = prefixlen + namelen;
+  if (cap > 0) {
+    size_t n = prefixlen < cap - 1 ? prefixlen : cap - 1;
+    memcpy(buf, s, n);
+    size_t m = namelen < cap - 1 - n ? namelen : cap - 1 - n;
+    memcpy(buf + n, name, m);
+    buf[n + m] = '\0';
+  }
+  return len;
+}
+
+char **kwordexp_wordv(kwordexp_t *pwe) {
+  const kwordexp_words_t *pkww = pwe->kwe_words;
+  if (pkww == NULL || pwe->kwe_wordv != NULL)
+    return pwe->kwe_wordv;
+  // one block for all the strings, and the vector pointing into it
+  char *buf = kmalloc_atomic(kwei_words_bytes(pkww, 0) + 1);
+  if (buf == NULL)
+    return NULL;
+  char **wordv = kmalloc((pkww->kww_wordc + 1) * sizeof(char *));
+  if (wordv == NULL) {
+    kfree(buf);
+    return NULL;
+  }
+  char *p = buf;
+  for (size_t i = 0; i < pkww->kww_wordc; i++) {
+    wordv[i] = kwei_words_path(pkww, &pkww->kww_wordv[i], p);
+    p += strlen(p) + 1;
+  }
+  wordv[pkww->kww_wordc] = NULL;
+  pwe->kwe_wordv = wordv;
+  return wordv;
+}
@@ -0,0 +1,75 @@
+#include "kwordexp_internal.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define KWEI_WRITE_BUFSIZE 16384
+
+typedef struct kwei_writer {
+  int kww_fd;
+  char kww_sep;
+  size_t kww_len;
+  char kww_buf[KWEI_WRITE_BUFSIZE];
+} kwei_writer_t;
+
+static int kwei_writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return -1;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// Small words are batched; a word that does not fit goes out together with
+// the batch straight from where it lies.
+static kwei_status_t kwei_sink_write(kwordexp_internal_t *pkwei,
+                                     const char *word, size_t len) {
+  kwei_writer_t *pkww = pkwei->kwei_sinkdata;
+  if (pkww->kww_len + len + 1 <= sizeof(pkww->kww_buf)) {
+    memcpy(pkww->kww_buf + pkww->kww_len, word, len);
+    pkww->kww_len += len;
+    pkww->kww_buf[pkww->kww_len++] = pkww->kww_sep;
+    return KSSUCCESS;
+  }
+  struct iovec iov[3] = {
+      {pkww->kww_buf, pkww->kww_len},
+      {(void *)word, len},
+      {&pkww->kww_sep, 1},
+  };
+  pkww->kww_len = 0;
+  if (kwei_writev_all(pkww->kww_fd, iov, 3) != 0) {
+    pkwei->kwei_errno = errno;
+    pkwei->kwei_errex = KESYSTEM;
+    pkwei->kwei_status = KSERROR;
+    return KSERROR;
+  }
+  return KSSUCCESS;
+}
+
+int kwordexp_write(int fd, const char *ibuf, int sep, kwordexp_t *pwe,
+                   int flags) {
+  kwei_writer_t kww;
+  kww.kww_fd = fd;
+  kww.kww_sep = sep;
+  kww.kww_len = 0;
+  int ret = kwei_wordexp(ibuf, strlen(ibuf), pwe, flags, NULL,
+                         kwei_sink_write, &kww);
+  if (ret == 0 && kww.kww_len > 0) {
+    struct iovec iov = {kww.kww_buf, kww.kww_len};
+    ret = kwei_writev_all(fd, &iov, 1);
+  }
+  return ret;
+}
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include "../include/kwordexp.h"
+#include <gc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wordexp.h>
+
+// Benchmark kwordexp against glibc wordexp over a fixed corpus. Every case
+// runs in its own child process so that the peak RSS is its own, and the
+// results go to stdout as one JSON object per line.
+
+#ifndef REPLACE_SYSTEM_ALLOC
+// Count system allocations. The benchmark is single threaded.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static size_t kb_allocs;
+
+void *malloc(size_t size) {
+  kb_allocs++;
+  return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size) {
+  kb_allocs++;
+  return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size) {
+  kb_allocs++;
+  return __libc_realloc(ptr, size);
+}
+void free(void *ptr) { __libc_free(ptr); }
+#else
+static size_t kb_allocs;
+#endif
+
+#define KB_WORDEXP 0x01
+#define KB_KWORDEXP 0x02
+
+typedef struct kb_case {
+  const char *kbc_name;
+  const char *kbc_input;
+  // the number of iterations is divided by this for slow cases
+  int kbc_scale;
+  int kbc_impls;
+} kb_case_t;
+
+static char **kb_argv;
+static size_t kb_argc;
+
+static uint64_t kb_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int kb_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static char *kb_repeat(const char *head, const char *unit, size_t count,
+                       const char *tail) {
+  size_t unitlen = strlen(unit);
+  char *buf = malloc(strlen(head) + unitlen * count + strlen(tail) + 1);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  char *p = stpcpy(buf, head);
+  for (size_t i = 0; i < count; i++)
+    p = stpcpy(p, unit);
+  stpcpy(p, tail);
+  return buf;
+}
+
+// open repeated depth times, then inner, then close repeated depth times
+static char *kb_nest(const char *open, const char *inner, const char *close,
+                     size_t depth) {
+  char *head = kb_repeat("", open, depth, inner);
+  char *buf = kb_repeat(head, close, depth, "");
+  free(head);
+  return buf;
+}
+
+static char *kb_printf(const char *format, const char *arg) {
+  char *buf;
+  if (asprintf(&buf, format, arg, arg, arg) == -1) {
+    perror("asprintf");
+    exit(EXIT_FAILURE);
+  }
+  return buf;
+}
+
+static int kb_run_one(int impl, const char *input) {
+  if (impl == KB_WORDEXP) {
+    wordexp_t we;
+    int ret = wordexp(input, &we, 0);
+    if (ret != 0)
+      return -1;
+    wordfree(&we);
+    return 0;
+  }
+  kwordexp_t kwe;
+  kwordexp_init(&kwe, kb_argv, kb_argc);
+  int ret = kwordexp(input, &kwe, 0);
+  if (ret != 0)
+    return -1;
+  kwordfree(&kwe);
+  return 0;
+}
+
+static void kb_run(const kb_case_t *pcase, int impl, size_t iters) {
+  const char *implname = impl == KB_WORDEXP ? "wordexp" : "kwordexp";
+  iters = iters / pcase->kbc_scale > 0 ? iters / pcase->kbc_scale : 1;
+  uint64_t *lat = malloc(iters * sizeof(uint64_t));
+  if (lat == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  // warm up caches and lazily built state first
+  if (kb_run_one(impl, pcase->kbc_input) != 0) {
+    printf("{\"case\":\"%s\",\"impl\":\"%s\",\"error\":true}\n",
+           pcase->kbc_name, implname);
+    free(lat);
+    return;
+  }
+  size_t allocs = kb_allocs;
+  size_t gcbytes = GC_get_total_bytes();
+  uint64_t total = 0;
+  for (size_t i = 0; i < iters; i++) {
+    uint64_t start = kb_now();
+    int ret = kb_run_one(impl, pcase->kbc_input);
+    lat[i] = kb_now() - start;
+    total += lat[i];
+    (void)ret;
+  }
+  allocs = kb_allocs - allocs;
+  gcbytes = GC_get_total_bytes() - gcbytes;
+  qsort(lat, iters, sizeof(uint64_t), kb_cmp);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("{\"case\":\"%s\",\"impl\":\"%s\",\"iters\":%zu,"
+         "\"ns_per_op\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+         "\"allocs_per_op\":%.2f,\"gc_bytes_per_op\":%.1f,"
+         "\"peak_rss_kb\":%ld}\n",
+         pcase->kbc_name, implname, iters, (double)total / iters,
+         (unsigned long long)lat[iters / 2],
+         (unsigned long long)lat[iters * 99 / 100], (double)allocs / iters,
+         (double)gcbytes / iters, ru.ru_maxrss);
+  free(lat);
+}
+
+static char *kb_mkglobdir(size_t nfiles) {
+  static char dir[] = "/tmp/kbenchXXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < nfiles; i++) {
+    char path[sizeof(dir) + 32];
+    snprintf(path, sizeof(path), "%s/file%zu.%s", dir, i, i % 4 ? "c" : "h");
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+  }
+  return dir;
+}
+
+static void kb_rmglobdir(const char *dir, size_t nfiles) {
+  for (size_t i = 0; i < nfiles; i++) {
+    char path[strlen(dir) + 32];
+    snprintf(path, sizeof(path), "%s/file%zu.%s", dir, i, i % 4 ? "c" : "h");
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+int main(int argc, char **argv) {
+#ifdef REPLACE_SYSTEM_ALLOC
+  GC_INIT();
+#endif
+  size_t iters = 10000;
+  const char *filter = NULL;
+  int impls = KB_WORDEXP | KB_KWORDEXP;
+  while (1) {
+    int opt = getopt(argc, argv, "n:c:kwh");
+    if (opt == -1)
+      break;
+    switch (opt) {
+    case 'n':
+      iters = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      filter = optarg;
+      break;
+    case 'k':
+      impls = KB_KWORDEXP;
+      break;
+    case 'w':
+      impls = KB_WORDEXP;
+      break;
+    case 'h':
+      printf("Usage: %s [-n iters] [-c case] [-k|-w] [-h]\n", argv[0]);
+      printf("  -n: iterations per case (default 10000)\n");
+      printf("  -c: run only the named case\n");
+      printf("  -k: run kwordexp only\n");
+      printf("  -w: run wordexp only\n");
+      printf("  -h: show this help\n");
+      return 0;
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (iters == 0)
+    iters = 1;
+
+  // a large $@
+  kb_argc = 1001;
+  kb_argv = malloc((kb_argc + 1) * sizeof(char *));
+  if (kb_argv == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  kb_argv[0] = argv[0];
+  for (size_t i = 1; i < kb_argc; i++)
+    kb_argv[i] = "argument";
+  kb_argv[kb_argc] = NULL;
+
+  char name[16];
+  for (int i = 0; i < 64; i++) {
+    snprintf(name, sizeof(name), "KBVAR%d", i);
+    setenv(name, i % 2 ? "value" : "two words", 1);
+  }
+  setenv("KBNEST", "KBNEST", 1);
+
+  size_t nfiles = 1000;
+  char *dir = kb_mkglobdir(nfiles);
+  int both = KB_WORDEXP | KB_KWORDEXP;
+  kb_case_t cases[] = {
+      {"literal", kb_repeat("", "word ", 200, ""), 1, both},
+      {"quote", kb_repeat("", "'single q' \"double q\" esc\\ aped ", 50, ""),
+       1, both},
+      {"vars",
+       kb_repeat("", "$KBVAR1 ${KBVAR2} \"$KBVAR3\" x${KBVAR4}y ", 50, ""), 1,
+       both},
+      // wordexp has no positional parameters to expand
+      {"args", "\"$@\" $*", 1, KB_KWORDEXP},
+      // wordexp rejects parentheses inside $((...)), so keep this one flat
+      {"arith", kb_repeat("$((0", "+1*2-3", 100, "))"), 1, both},
+      // ${${...}} is an extension; KBNEST names itself at every level
+      {"nesting", kb_nest("${", "KBNEST", "}", 64), 1, KB_KWORDEXP},
+      {"glob", kb_printf("%s/*.c %s/file1*.h %s/file[0-9].?", dir), 10, both},
+      {"cmdsub", "$(echo a) \"$(echo b c)\"", 1000, both},
+  };
+  int status = EXIT_SUCCESS;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const kb_case_t *pcase = &cases[i];
+    if (filter != NULL && strcmp(filter, pcase->kbc_name) != 0)
+      continue;
+    for (int impl = KB_WORDEXP; impl <= KB_KWORDEXP; impl <<= 1) {
+      if (!(pcase->kbc_impls & impls & impl))
+        continue;
+      pid_t pid = fork();
+      if (pid == -1) {
+        perror("fork");
+        status = EXIT_FAILURE;
+        break;
+      }
+      if (pid == 0) {
+        kb_run(pcase, impl, iters);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+      }
+      int wstatus;
+      if (waitpid(pid, &wstatus, 0) == -1 || !WIFEXITED(wstatus) ||
+          WEXITSTATUS(wstatus) != 0)
+        status = EXIT_FAILURE;
+    }
+  }
+  kb_rmglobdir(dir, nfiles);
+  exit(status);
+}
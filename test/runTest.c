@@ -1,12 +1,1275 @@
+#define _GNU_SOURCE
 #include "../src/kwordexp_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <wordexp.h>
 #ifdef REPLACE_SYSTEM_ALLOC
 #include <gc.h>
 #endif
 
+// ----------------------------------------------------------------
+// Built-in cases, run when no words are given
+// ----------------------------------------------------------------
+
+typedef struct test_case {
+  const char *tc_input;
+  int tc_flags;
+  // the expected words separated by '|', or NULL when expansion must fail
+  const char *tc_words;
+} test_case_t;
+
+#define COUNTOF(a) (sizeof(a) / sizeof((a)[0]))
+
+// $1 is 5 and $# is 2 in every case
+static char *test_argv[] = {"runTest", "5", "x", NULL};
+
+// set in the environment before the cases run
+static const char *const test_vars[][2] = {
+    {"KWT_PATH", "/x/y.z"},
+    {"KWT_EMPTY", ""},
+    {"KWT_SPLIT", " a  b "},
+    {"KWT_SELF", "KWT_SELF"},
+};
+
+static void test_init(kwordexp_t *pkwe) {
+  kwordexp_init(pkwe, test_argv, 3);
+}
+
+static int test_words(const char *name, const char *input, int ret,
+                      kwordexp_t *pkwe, const char *words) {
+  if (words == NULL) {
+    if (ret == 0) {
+      printf("FAIL %s: %s: expanded, expected an error\n", name, input);
+      return 1;
+    }
+    return 0;
+  }
+  if (ret != 0) {
+    printf("FAIL %s: %s: failed\n", name, input);
+    return 1;
+  }
+  char **wordv = pkwe->kwe_words != NULL ? kwordexp_wordv(pkwe)
+                                         : pkwe->kwe_wordv;
+  const char *p = words;
+  for (size_t i = 0; i < pkwe->kwe_wordc; i++) {
+    size_t n = p != NULL ? strcspn(p, "|") : 0;
+    if (p == NULL || strlen(wordv[i]) != n || strncmp(wordv[i], p, n) != 0) {
+      printf("FAIL %s: %s: word %zu is \"%s\"\n", name, input, i, wordv[i]);
+      return 1;
+    }
+    p = p[n] == '|' ? p + n + 1 : NULL;
+  }
+  if (p != NULL) {
+    printf("FAIL %s: %s: %zu words, expected \"%s\"\n", name, input,
+           pkwe->kwe_wordc, words);
+    return 1;
+  }
+  return 0;
+}
+
+// Run the cases with the variables in env, or in the process environment
+// when env is NULL
+static int test_cases_env(const char *name, const test_case_t *cases,
+                          size_t count, kwordexp_env_t *env) {
+  int failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    kwordexp_t kwe;
+    test_init(&kwe);
+    kwe.kwe_env = env;
+    int ret = kwordexp(cases[i].tc_input, &kwe, cases[i].tc_flags);
+    failed += test_words(name, cases[i].tc_input, ret, &kwe,
+                         cases[i].tc_words);
+    if (ret == 0)
+      kwordfree(&kwe);
+  }
+  return failed;
+}
+
+static int test_cases(const char *name, const test_case_t *cases,
+                      size_t count) {
+  return test_cases_env(name, cases, count, NULL);
+}
+
+// Expand head, n copies of open, then mid, n copies of close and tail.
+static int test_repeat(const char *name, const char *head, const char *open,
+                       const char *mid, const char *close, size_t n,
+                       const char *tail, const char *words) {
+  size_t size = strlen(head) + n * (strlen(open) + strlen(close)) +
+                strlen(mid) + strlen(tail) + 1;
+  char *input = malloc(size);
+  if (input == NULL)
+    return 1;
+  char *p = stpcpy(input, head);
+  for (size_t i = 0; i < n; i++)
+    p = stpcpy(p, open);
+  p = stpcpy(p, mid);
+  for (size_t i = 0; i < n; i++)
+    p = stpcpy(p, close);
+  strcpy(p, tail);
+  kwordexp_t kwe;
+  test_init(&kwe);
+  int ret = kwordexp(input, &kwe, 0);
+  int failed = test_words(name, open, ret, &kwe, words);
+  if (ret == 0)
+    kwordfree(&kwe);
+  free(input);
+  return failed;
+}
+
+static const test_case_t arith_cases[] = {
+    {"$((1+2*3))", 0, "7"},
+    {"$(( (1+2) * 3 )) $(( ((((1)))) ))", 0, "9|1"},
+    {"$((7/2)) $((7%3)) $((-7/2))", 0, "3|1|-3"},
+    {"$((1<<4|1)) $((0x10+010)) $((~0))", 0, "17|24|-1"},
+    {"$((2>1 && 0 || 3)) $((1?2:3)) $((0?2:3))", 0, "1|2|3"},
+    {"$((kwt_x=3, kwt_x*kwt_x)) $((kwt_x+=1))", 0, "9|4"},
+    {"$(($1*2)) $((${1}+$#))", 0, "10|7"},
+    {"$((0 && 1/0))", 0, "0"},
+    {"$(( $((2+3)) * 2 ))", 0, "10"},
+    {"$(( $(echo 1)+1 ))", 0, "2"},
+    {"$((1/0))", 0, NULL},
+    {"$((1+))", 0, NULL},
+    {"$((1", 0, NULL},
+    {"$((1)", 0, NULL},
+    {"$(( $(echo 1)+1 ))", KWRDE_NOCMD, NULL},
+};
+
+static int test_arith(void) {
+  int failed = test_cases("arith", arith_cases, COUNTOF(arith_cases));
+  failed += test_repeat("arith", "$((", "(", "1", ")", 100, "))", "1");
+  failed += test_repeat("arith", "$((", "-", "1", "", 100, "))", "1");
+  // nesting past the depth limit fails instead of overflowing the stack
+  failed += test_repeat("arith", "$((", "(", "1", ")", 200000, "))", NULL);
+  failed += test_repeat("arith", "$((", "-", "1", "", 500000, "))", NULL);
+  failed +=
+      test_repeat("arith", "$((", "kwt_x=", "1", "", 200000, "))", NULL);
+  failed +=
+      test_repeat("arith", "$((", "1?", "1", ":1", 200000, "))", NULL);
+  failed +=
+      test_repeat("arith", "$((", "$((", "1", "))", 200000, "))", NULL);
+  return failed;
+}
+
+static const test_case_t nest_cases[] = {
+    {"a$(echo b $(echo c))d", 0, "ab|cd"},
+    {"\"$(echo a  b)\"x", 0, "a bx"},
+    {"\"<${KWT_PATH%.*}>\" ${KWT_PATH#\"/x\"}", 0, "</x/y>|/y.z"},
+    {"${KWT_PATH#$(echo /x)} $(echo ${KWT_PATH##*/})", 0, "/y.z|y.z"},
+    {"${${KWT_SELF}}", 0, "KWT_SELF"},
+    {"$(echo a", 0, NULL},
+    {"${KWT_PATH#/", 0, NULL},
+};
+
+// Expand input with kwe_depth_max set; words NULL expects ELOOP.
+static int test_depth_run(const char *input, size_t depth_max,
+                          const char *words) {
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_depth_max = depth_max;
+  errno = 0;
+  int ret = kwordexp(input, &kwe, 0);
+  if (ret != 0 && words == NULL && errno != ELOOP) {
+    printf("FAIL depth: %.40s: errno %d, expected ELOOP\n", input, errno);
+    return 1;
+  }
+  int failed = test_words("depth", input, ret, &kwe, words);
+  if (ret == 0)
+    kwordfree(&kwe);
+  return failed;
+}
+
+static int test_depth(void) {
+  int failed = test_cases("nest", nest_cases, COUNTOF(nest_cases));
+  failed += test_depth_run("$(echo $(echo $(echo $(echo x))))", 4, "x");
+  failed +=
+      test_depth_run("$(echo $(echo $(echo $(echo $(echo x)))))", 4, NULL);
+  failed += test_depth_run("${${${${${KWT_SELF}}}}}", 4, NULL);
+  failed += test_depth_run("\"${KWT_PATH#${${${${KWT_SELF}}}}}\"", 4, NULL);
+  // nesting takes pooled frames rather than C stack
+  size_t n = 20000;
+  char *input = malloc(n * 3 + sizeof("KWT_SELF"));
+  if (input == NULL)
+    return failed + 1;
+  char *p = input;
+  for (size_t i = 0; i < n; i++)
+    p = stpcpy(p, "${");
+  p = stpcpy(p, "KWT_SELF");
+  for (size_t i = 0; i < n; i++)
+    *p++ = '}';
+  *p = '\0';
+  failed += test_depth_run(input, n, "KWT_SELF");
+  failed += test_depth_run(input, n - 1, NULL);
+  free(input);
+  return failed;
+}
+
+static const test_case_t brace_cases[] = {
+    {"a{b,c}d", 0, "abd|acd"},
+    {"{a,b}{1,2}", 0, "a1|a2|b1|b2"},
+    {"{a,{b,c}}x", 0, "ax|bx|cx"},
+    {"{1..3} {3..1} {01..03}", 0, "1|2|3|3|2|1|01|02|03"},
+    {"{1..10..4} {-1..1}", 0, "1|5|9|-1|0|1"},
+    {"{a..c} {Y..b}", 0, "a|b|c|Y|Z|[|\\|]|^|_|`|a|b"},
+    {"{a} {} {a..} \\{a,b} '{a,b}'", 0, "{a}|{}|{a..}|{a,b}|{a,b}"},
+    {"x{$1,y}", 0, "x5|xy"},
+    // ranges and steps at the ends of intmax_t
+    {"{-9223372036854775807..-9223372036854775808}", 0,
+     "-9223372036854775807|-9223372036854775808"},
+    {"{9223372036854775806..9223372036854775807}", 0,
+     "9223372036854775806|9223372036854775807"},
+    {"{0..9223372036854775807..9223372036854775807}", 0,
+     "0|9223372036854775807"},
+    {"{1..-1..-9223372036854775808}", 0, "1"},
+    {"{-9223372036854775808..9223372036854775807..-9223372036854775808}", 0,
+     "-9223372036854775808|0"},
+    {"{9223372036854775807..-9223372036854775808..9223372036854775807}", 0,
+     "9223372036854775807|0|-9223372036854775807"},
+    {"{1..2000000}", 0, NULL},
+};
+
+static int test_brace(void) {
+  int failed = test_cases("brace", brace_cases, COUNTOF(brace_cases));
+  // too many groups fail before any word is produced
+  failed += test_repeat("brace", "", "{a,b}", "", "", 20000, "", NULL);
+  failed += test_repeat("brace", "", "{a,", "b", "}", 20000, "", NULL);
+  return failed;
+}
+
+static const struct {
+  const char *pattern;
+  int flags;
+  const char *subject;
+  int match;
+} pattern_cases[] = {
+    {"*.c", 0, "a.c", 1},
+    {"*.c", 0, "a.h", 0},
+    {"a?c", 0, "abc", 1},
+    {"a?c", 0, "ac", 0},
+    {"a*b*c", 0, "aXbYbZc", 1},
+    {"a*b*c", 0, "aXbYc-", 0},
+    {"[a-c]x [!a-c]x", 0, "bx dx", 1},
+    {"[[:digit:]]*", 0, "7up", 1},
+    {"\\*", 0, "*", 1},
+    {"\\*", 0, "x", 0},
+    {"*", 0, ".h", 1},
+    {"*", KWRDE_PATTERN_PERIOD, ".h", 0},
+    {"?h", KWRDE_PATTERN_PERIOD, ".h", 0},
+    {".*", KWRDE_PATTERN_PERIOD, ".h", 1},
+};
+
+// KWT_PATH is /x/y.z
+static const test_case_t strip_cases[] = {
+    {"${KWT_PATH#*/} ${KWT_PATH##*/}", 0, "x/y.z|y.z"},
+    {"${KWT_PATH%/*} \"<${KWT_PATH%%/*}>\"", 0, "/x|<>"},
+    {"${KWT_PATH%.?} ${KWT_PATH#/[a-x]}", 0, "/x/y|/y.z"},
+    {"${KWT_PATH#nomatch} ${KWT_PATH%%}", 0, "/x/y.z|/x/y.z"},
+    {"a ${KWT_UNSET#*} b", 0, "a|b"},
+    {"${KWT_UNSET#*}", KWRDE_UNDEF, NULL},
+    {"${KWT_PATH#*/", 0, NULL},
+};
+
+static int test_pattern(void) {
+  int failed = 0;
+  for (size_t i = 0; i < COUNTOF(pattern_cases); i++) {
+    kwordexp_pattern_t *pkp = kwordexp_pattern_compile(
+        pattern_cases[i].pattern, pattern_cases[i].flags);
+    const char *subject = pattern_cases[i].subject;
+    if (pkp == NULL || kwordexp_pattern_match(pkp, subject, strlen(subject)) !=
+                           pattern_cases[i].match) {
+      printf("FAIL pattern: %s against %s\n", pattern_cases[i].pattern,
+             subject);
+      failed++;
+    }
+    if (pkp != NULL)
+      kwordexp_pattern_free(pkp);
+  }
+  return failed + test_cases("strip", strip_cases, COUNTOF(strip_cases));
+}
+
+// ~ is $HOME; ~user comes from the password database through the cache
+static int test_tilde(void) {
+  struct passwd *ppw = getpwnam("root");
+  kwordexp_env_t *pke = kwordexp_env_new(NULL);
+  if (ppw == NULL || pke == NULL ||
+      kwordexp_env_set(pke, "HOME", "/h/o me*") != 0) {
+    printf("FAIL tilde: setup\n");
+    if (pke != NULL)
+      kwordexp_env_free(pke);
+    return 1;
+  }
+  char words[256];
+  snprintf(words, sizeof(words), "/h/o me*|/h/o me*/a|~|~/a|%s|%s/x|%s",
+           ppw->pw_dir, ppw->pw_dir, "~kwt_nosuchuser/x");
+  const test_case_t cases[] = {
+      {"~ ~/a \"~\" \\~/a ~root ~root/x ~kwt_nosuchuser/x", 0, words},
+  };
+  int failed = test_cases_env("tilde", cases, COUNTOF(cases), pke);
+  // the same answers once the cached ones are gone
+  kwordexp_homecache_flush();
+  failed += test_cases_env("tilde", cases, COUNTOF(cases), pke);
+  kwordexp_env_free(pke);
+  return failed;
+}
+
+static int test_env_is(const kwordexp_env_t *pke, const char *key,
+                       const char *want) {
+  const char *value = kwordexp_env_get(pke, key);
+  if (want == NULL ? value == NULL
+                   : value != NULL && strcmp(value, want) == 0)
+    return 0;
+  printf("FAIL env: %s is %s, expected %s\n", key,
+         value != NULL ? value : "unset", want != NULL ? want : "unset");
+  return 1;
+}
+
+// An overlay sees through to its base, which it freezes
+static int test_env(void) {
+  kwordexp_env_t *base = kwordexp_env_new(NULL);
+  if (base == NULL || kwordexp_env_set(base, "A", "base") != 0 ||
+      kwordexp_env_set(base, "B", "base") != 0) {
+    printf("FAIL env: setup\n");
+    return 1;
+  }
+  kwordexp_env_t *over = kwordexp_env_new(base);
+  if (over == NULL || kwordexp_env_set(over, "A", "over") != 0 ||
+      kwordexp_env_unset(over, "B") != 0 ||
+      kwordexp_env_set(over, "C", "new") != 0) {
+    printf("FAIL env: overlay setup\n");
+    kwordexp_env_free(base);
+    return 1;
+  }
+  int failed = 0;
+  failed += test_env_is(over, "A", "over");
+  failed += test_env_is(over, "B", NULL);
+  failed += test_env_is(over, "C", "new");
+  failed += test_env_is(base, "A", "base");
+  failed += test_env_is(base, "B", "base");
+  failed += test_env_is(base, "C", NULL);
+  errno = 0;
+  if (kwordexp_env_set(base, "A", "x") != -1 || errno != EROFS) {
+    printf("FAIL env: a frozen base accepted a change\n");
+    failed++;
+  }
+
+  const test_case_t over_cases[] = {
+      {"$A ${B} $C", 0, "over|new"},
+      // assignments land in the overlay
+      {"$((D=2)) $D", 0, "2|2"},
+  };
+  const test_case_t base_cases[] = {
+      {"$A $B $C $D", 0, "base|base"},
+  };
+  failed += test_cases_env("env", over_cases, COUNTOF(over_cases), over);
+  failed += test_cases_env("env", base_cases, COUNTOF(base_cases), base);
+
+  // the overlay keeps its base alive
+  kwordexp_env_free(base);
+  failed += test_env_is(over, "A", "over");
+  kwordexp_env_free(over);
+
+  kwordexp_env_t *snap = kwordexp_env_snapshot();
+  if (snap == NULL) {
+    printf("FAIL env: snapshot\n");
+    return failed + 1;
+  }
+  failed += test_env_is(snap, "KWT_PATH", "/x/y.z");
+  if (kwordexp_env_set(snap, "KWT_PATH", "x") != -1 || errno != EROFS) {
+    printf("FAIL env: a snapshot accepted a change\n");
+    failed++;
+  }
+  kwordexp_env_free(snap);
+  return failed;
+}
+
+typedef struct test_lookups {
+  int tl_batches;
+  int tl_singles;
+  char tl_keys[64];
+} test_lookups_t;
+
+// Joins the names asked for with '|'; only A is set
+static int test_getenvv(void *data, const char **keys, char **values,
+                        size_t count) {
+  test_lookups_t *ptl = data;
+  ptl->tl_batches++;
+  char *p = ptl->tl_keys;
+  for (size_t i = 0; i < count; i++) {
+    p += snprintf(p, ptl->tl_keys + sizeof(ptl->tl_keys) - p, "%s%s",
+                  i > 0 ? "|" : "", keys[i]);
+    values[i] = strcmp(keys[i], "A") == 0 ? "a" : NULL;
+  }
+  return 0;
+}
+
+static int test_getenv_one(void *data, const char *key, char **pvalue) {
+  (void)key;
+  ((test_lookups_t *)data)->tl_singles++;
+  *pvalue = NULL;
+  return 0;
+}
+
+// Every $NAME and ${NAME is resolved in one kwe_getenvv call; bare names in
+// arithmetic fall back to kwe_getenv.
+static int test_getenvv_batch(void) {
+  test_lookups_t tl = {0, 0, ""};
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_getenvv = test_getenvv;
+  kwe.kwe_getenv = test_getenv_one;
+  kwe.kwe_data = &tl;
+  const char *input = "$B ${A}x $B ${A%a} \"$A\" $((N+1))";
+  int ret = kwordexp(input, &kwe, 0);
+  int failed = test_words("getenvv", input, ret, &kwe, "ax|a|1");
+  if (ret == 0)
+    kwordfree(&kwe);
+  if (tl.tl_batches != 1 || strcmp(tl.tl_keys, "A|B|IFS") != 0 ||
+      tl.tl_singles != 1) {
+    printf("FAIL getenvv: %d calls for %s, %d single lookups\n",
+           tl.tl_batches, tl.tl_keys, tl.tl_singles);
+    failed++;
+  }
+  return failed;
+}
+
+// A listing served by test_readdir; names ending in '/' are directories
+static const struct {
+  const char *path;
+  const char *names[4];
+} test_listings[] = {
+    {".", {"etc/", "usr/", ".hidden"}},
+    {"etc", {"passwd", "hosts", "conf.d/"}},
+    {"etc/conf.d", {"b.conf", "a.conf", "x.txt"}},
+    {"usr", {"bin/"}},
+};
+
+static int test_readdir(void *data, const char *path, const char *prefix,
+                        kwordexp_dir_t *dir) {
+  (void)prefix;
+  ++*(int *)data;
+  for (size_t i = 0; i < COUNTOF(test_listings); i++) {
+    if (strcmp(test_listings[i].path, path) != 0)
+      continue;
+    for (size_t j = 0; j < 4 && test_listings[i].names[j] != NULL; j++) {
+      const char *name = test_listings[i].names[j];
+      size_t len = strcspn(name, "/");
+      char copy[16];
+      snprintf(copy, sizeof(copy), "%.*s", (int)len, name);
+      if (kwordexp_dir_add(dir, copy, name[len] == '/') != 0)
+        return -1;
+    }
+    return 0;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+// None of these exist in the working directory; the provider supplies them
+static const test_case_t readdir_cases[] = {
+    {"*", 0, "etc|usr"},
+    {"etc/*", 0, "etc/conf.d|etc/hosts|etc/passwd"},
+    {"etc/*/*.conf e*/h*", 0, "etc/conf.d/a.conf|etc/conf.d/b.conf|etc/hosts"},
+    {"*/b?n", 0, "usr/bin"},
+    {"nope/* etc/*.x", 0, "nope/*|etc/*.x"},
+};
+
+static int test_provider(void) {
+  int failed = 0;
+  for (size_t i = 0; i < COUNTOF(readdir_cases); i++) {
+    int calls = 0;
+    kwordexp_t kwe;
+    test_init(&kwe);
+    kwe.kwe_readdir = test_readdir;
+    kwe.kwe_data = &calls;
+    int ret = kwordexp(readdir_cases[i].tc_input, &kwe, 0);
+    failed += test_words("readdir", readdir_cases[i].tc_input, ret, &kwe,
+                         readdir_cases[i].tc_words);
+    if (ret == 0)
+      kwordfree(&kwe);
+    if (calls == 0) {
+      printf("FAIL readdir: %s: provider not called\n",
+             readdir_cases[i].tc_input);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+typedef struct test_slow {
+  int ts_calls;
+  char ts_input[32];
+  uint64_t ts_ns;
+  const kwordexp_stats_t *ts_stats;
+} test_slow_t;
+
+static void test_slow_cb(void *data, const char *input, size_t len,
+                         const kwordexp_stats_t *stats) {
+  test_slow_t *pts = data;
+  pts->ts_calls++;
+  snprintf(pts->ts_input, sizeof(pts->ts_input), "%.*s", (int)len, input);
+  pts->ts_ns = stats->kws_total_ns;
+  pts->ts_stats = stats;
+}
+
+// Expand input with kwe_slow set and the threshold ns; pstats is the
+// caller's kwe_stats.
+static test_slow_t test_slow_run(const char *input, uint64_t ns,
+                                 kwordexp_stats_t *pstats) {
+  test_slow_t ts = {0, "", 0, NULL};
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_slow = test_slow_cb;
+  kwe.kwe_slow_ns = ns;
+  kwe.kwe_stats = pstats;
+  kwe.kwe_data = &ts;
+  if (kwordexp(input, &kwe, 0) == 0)
+    kwordfree(&kwe);
+  if (kwe.kwe_stats != pstats) {
+    printf("FAIL slow: kwe_stats left changed\n");
+    ts.ts_calls = -1;
+  }
+  return ts;
+}
+
+static int test_slow(void) {
+  int failed = 0;
+  test_slow_t ts = test_slow_run("$1 $(echo x)", 1, NULL);
+  if (ts.ts_calls != 1 || strcmp(ts.ts_input, "$1 $(echo x)") != 0 ||
+      ts.ts_ns == 0) {
+    printf("FAIL slow: %d calls over 1ns\n", ts.ts_calls);
+    failed++;
+  }
+  ts = test_slow_run("$1", UINT64_MAX, NULL);
+  if (ts.ts_calls != 0) {
+    printf("FAIL slow: %d calls under the threshold\n", ts.ts_calls);
+    failed++;
+  }
+  // the caller's own kwe_stats is what the callback sees
+  kwordexp_stats_t stats;
+  ts = test_slow_run("$1", 1, &stats);
+  if (ts.ts_calls != 1 || ts.ts_stats != &stats) {
+    printf("FAIL slow: callback did not get kwe_stats\n");
+    failed++;
+  }
+  return failed;
+}
+
+// d/a.c d/b.c d/.h.c d/x.txt d/sub/c.c d/sub/deep/e.c and d/link -> sub,
+// under a fresh directory that becomes the working directory
+static char test_dir[] = "/tmp/kwordexp-test.XXXXXX";
+
+static int test_mktree(void) {
+  static const char *const dirs[] = {"d", "d/sub", "d/sub/deep"};
+  static const char *const files[] = {"d/a.c", "d/b.c", "d/.h.c", "d/x.txt",
+                                      "d/sub/c.c", "d/sub/deep/e.c"};
+  if (mkdtemp(test_dir) == NULL || chdir(test_dir) != 0)
+    return -1;
+  for (size_t i = 0; i < COUNTOF(dirs); i++)
+    if (mkdir(dirs[i], 0700) != 0)
+      return -1;
+  for (size_t i = 0; i < COUNTOF(files); i++) {
+    FILE *fp = fopen(files[i], "w");
+    if (fp == NULL || fclose(fp) != 0)
+      return -1;
+  }
+  return symlink("sub", "d/link");
+}
+
+static int test_rmentry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw) {
+  (void)st, (void)type, (void)ftw;
+  return remove(path);
+}
+
+static void test_rmtree(void) {
+  if (chdir("/") == 0)
+    nftw(test_dir, test_rmentry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int test_strcmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static const test_case_t glob_cases[] = {
+    {"d/*.c", 0, "d/a.c|d/b.c"},
+    {"d/.*.c", 0, "d/.h.c"},
+    {"d/[ab].c d/?.txt", 0, "d/a.c|d/b.c|d/x.txt"},
+    {"d/*/", 0, "d/link/|d/sub/"},
+    {"d/*/*.c", 0, "d/link/c.c|d/sub/c.c"},
+    {"d/su?/deep/*", 0, "d/sub/deep/e.c"},
+    {"d/*/deep/e.c", 0, "d/link/deep/e.c|d/sub/deep/e.c"},
+    {"'*' d/\\*.c d/*.none", 0, "*|d/*.c|d/*.none"},
+    {"d/**/*.c", 0, "d/link/c.c|d/sub/c.c"},
+};
+
+// as bash lists them: "**" enters d/link but does not recurse through it
+static const test_case_t globstar_cases[] = {
+    {"d/**/*.c", 0, "d/a.c|d/b.c|d/link/c.c|d/sub/c.c|d/sub/deep/e.c"},
+    {"d/**", 0,
+     "d/|d/a.c|d/b.c|d/link|d/sub|d/sub/c.c|d/sub/deep|d/sub/deep/e.c|"
+     "d/x.txt"},
+    {"d/**/", 0, "d/|d/link/|d/sub/|d/sub/deep/"},
+};
+
+// Every mode walks the same tree, so all of them must agree.
+static int test_glob_modes(const test_case_t *cases, size_t count,
+                           int flags) {
+  static const int modes[] = {
+      0, KWRDE_NOSORT, KWRDE_GLOBCACHE, KWRDE_PARALLEL,
+      KWRDE_GLOBCACHE | KWRDE_PARALLEL, KWRDE_NOSORT | KWRDE_PARALLEL,
+      KWRDE_COMPACT, KWRDE_COMPACT | KWRDE_PARALLEL};
+  int failed = 0;
+  for (size_t m = 0; m < COUNTOF(modes); m++) {
+    for (size_t i = 0; i < count; i++) {
+      kwordexp_t kwe;
+      test_init(&kwe);
+      int ret = kwordexp(cases[i].tc_input, &kwe, flags | modes[m]);
+      // unsorted output follows the directory order
+      if (ret == 0 && (modes[m] & KWRDE_NOSORT))
+        qsort(kwe.kwe_wordv, kwe.kwe_wordc, sizeof(char *), test_strcmp);
+      if (test_words("glob", cases[i].tc_input, ret, &kwe,
+                     cases[i].tc_words) != 0) {
+        printf("     in mode %#x\n", flags | modes[m]);
+        failed++;
+      }
+      if (ret == 0)
+        kwordfree(&kwe);
+    }
+  }
+  return failed;
+}
+
+static int test_glob_count(void *data, const char *path) {
+  (void)path;
+  return ++*(int *)data == 2;
+}
+
+static int test_glob(void) {
+  int failed = test_glob_modes(glob_cases, COUNTOF(glob_cases), 0);
+  failed += test_glob_modes(globstar_cases, COUNTOF(globstar_cases),
+                            KWRDE_GLOBSTAR);
+
+  // kwe_glob_max truncates the sorted result
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_glob_max = 1;
+  int ret = kwordexp("d/*.c", &kwe, 0);
+  failed += test_words("glob", "d/*.c, at most 1", ret, &kwe, "d/a.c");
+  if (ret == 0)
+    kwordfree(&kwe);
+
+  // a kwe_glob callback gets the matches and stops the walk
+  int calls = 0;
+  test_init(&kwe);
+  kwe.kwe_glob = test_glob_count;
+  kwe.kwe_data = &calls;
+  ret = kwordexp("d/**", &kwe, KWRDE_GLOBSTAR);
+  if (ret != 0 || calls != 2) {
+    printf("FAIL glob: d/**: %d callbacks, expected 2\n", calls);
+    failed++;
+  }
+  if (ret == 0)
+    kwordfree(&kwe);
+
+  // absolute patterns are resolved from the root
+  char input[sizeof(test_dir) + 16], words[2 * sizeof(test_dir) + 32];
+  snprintf(input, sizeof(input), "%s/d/*.c", test_dir);
+  snprintf(words, sizeof(words), "%s/d/a.c|%s/d/b.c", test_dir, test_dir);
+  test_init(&kwe);
+  ret = kwordexp(input, &kwe, 0);
+  failed += test_words("glob", input, ret, &kwe, words);
+  if (ret == 0)
+    kwordfree(&kwe);
+  return failed;
+}
+
+static char *test_value = "a";
+
+static int test_getenv(void *data, const char *key, char **pvalue) {
+  (void)data;
+  *pvalue = strcmp(key, "V") == 0 ? test_value : getenv(key);
+  return 0;
+}
+
+static int test_cached(kwordexp_t *pkwe, const char *input,
+                       const char *words) {
+  int ret = kwordexp(input, pkwe, 0);
+  int failed = test_words("cache", input, ret, pkwe, words);
+  if (ret == 0)
+    kwordfree(pkwe);
+  // kwordfree leaves kwe_wordc alone and the next call would append
+  pkwe->kwe_wordc = 0;
+  return failed;
+}
+
+static int test_cache(void) {
+  kwordexp_cache_t *pkc = kwordexp_cache_new(0);
+  kwordexp_env_t *pke = kwordexp_env_new(NULL);
+  if (pkc == NULL || pke == NULL || kwordexp_env_set(pke, "V", "a") != 0) {
+    printf("FAIL cache: setup\n");
+    return 1;
+  }
+  // changing kwe_env drops the results that looked it up
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_cache = pkc;
+  kwe.kwe_env = pke;
+  int failed = test_cached(&kwe, "$V$1", "a5");
+  failed += test_cached(&kwe, "$V$1", "a5");
+  if (kwordexp_env_set(pke, "V", "b") != 0)
+    failed++;
+  failed += test_cached(&kwe, "$V$1", "b5");
+  if (kwordexp_env_unset(pke, "V") != 0)
+    failed++;
+  failed += test_cached(&kwe, "x$V", "x");
+
+  // a kwe_getenv callback is not tracked; invalidating the name is needed
+  test_init(&kwe);
+  kwe.kwe_cache = pkc;
+  kwe.kwe_getenv = test_getenv;
+  failed += test_cached(&kwe, "$V", "a");
+  test_value = "b";
+  failed += test_cached(&kwe, "$V", "a");
+  kwordexp_cache_invalidate(pkc, "V");
+  failed += test_cached(&kwe, "$V", "b");
+  test_value = "c";
+  kwordexp_cache_invalidate(pkc, NULL);
+  failed += test_cached(&kwe, "$V", "c");
+  kwordexp_env_free(pke);
+  kwordexp_cache_free(pkc);
+  return failed;
+}
+
+// with the default IFS
+static const test_case_t split_cases[] = {
+    {"$KWT_SPLIT", 0, "a|b"},
+    {"\"$KWT_SPLIT\"", 0, " a  b "},
+    {"x${KWT_SPLIT}y", 0, "x|a|b|y"},
+    {"$* $@", 0, "5|x|5|x"},
+    {"\"$*\" \"$@\"", 0, "5 x|5|x"},
+    {"\"<$@>\"", 0, "<5|x>"},
+    {"$(printf 'a b\\n\\n\\n')", 0, "a|b"},
+    {"\"$(printf 'a\\n\\n')\"x", 0, "ax"},
+    {"'' \"\" $KWT_EMPTY \"$KWT_EMPTY\"", 0, "||"},
+    {"x $KWT_EMPTY $KWT_UNSET y", 0, "x|y"},
+};
+
+// IFS=: where whitespace is no delimiter; IFS also separates the words of
+// the input itself, so each case is a single word
+static const test_case_t split_colon_cases[] = {
+    {"$V", 0, "a||b"},
+    {"$W", 0, " a| b "},
+    {"\"$*\"", 0, "5:x"},
+    {"$*", 0, "5|x"},
+    {"\"$@\"", 0, "5|x"},
+};
+
+// IFS= splits nothing
+static const test_case_t split_none_cases[] = {
+    {"$KWT_SPLIT", 0, " a  b "},
+    {"$V", 0, "a::b"},
+    {"\"$*\"", 0, "5x"},
+    {"$*", 0, "5|x"},
+};
+
+static int test_split(void) {
+  int failed = test_cases("split", split_cases, COUNTOF(split_cases));
+  kwordexp_env_t *colon = kwordexp_env_new(NULL);
+  kwordexp_env_t *none = kwordexp_env_new(NULL);
+  if (colon == NULL || none == NULL || kwordexp_env_set(colon, "IFS", ":") ||
+      kwordexp_env_set(colon, "V", "a::b") ||
+      kwordexp_env_set(colon, "W", " a: b ") ||
+      kwordexp_env_set(none, "IFS", "") ||
+      kwordexp_env_set(none, "KWT_SPLIT", " a  b ") ||
+      kwordexp_env_set(none, "V", "a::b")) {
+    printf("FAIL split: setup\n");
+    return failed + 1;
+  }
+  failed += test_cases_env("split IFS=:", split_colon_cases,
+                           COUNTOF(split_colon_cases), colon);
+  failed += test_cases_env("split IFS=", split_none_cases,
+                           COUNTOF(split_none_cases), none);
+  kwordexp_env_free(colon);
+  kwordexp_env_free(none);
+  return failed;
+}
+
+// "ab $1 c" needs 7 bytes and 3 offsets
+static int test_into_run(size_t cap, size_t maxwords, int want) {
+  char buf[16];
+  size_t offv[4] = {99, 99, 99, 99}, size = 0, wordc = 0;
+  memset(buf, '#', sizeof(buf));
+  kwordexp_t kwe;
+  test_init(&kwe);
+  int ret = kwordexp_into("ab $1 c", cap > 0 ? buf : NULL, cap,
+                          maxwords > 0 ? offv : NULL, maxwords, &kwe, 0,
+                          &size, &wordc);
+  kwordfree(&kwe);
+  if (ret != want || size != 7 || wordc != 3 || buf[cap] != '#' ||
+      offv[maxwords] != 99) {
+    printf("FAIL into: cap %zu, %zu offsets: %d, size %zu, %zu words\n", cap,
+           maxwords, ret, size, wordc);
+    return 1;
+  }
+  if (ret == 0 && (memcmp(buf, "ab\0005\0c", 7) != 0 || offv[0] != 0 ||
+                   offv[1] != 3 || offv[2] != 5)) {
+    printf("FAIL into: cap %zu: wrong words\n", cap);
+    return 1;
+  }
+  return 0;
+}
+
+static int test_into(void) {
+  // an exact fit, then too little room for the bytes, the offsets or both
+  int failed = test_into_run(7, 3, 0);
+  failed += test_into_run(6, 3, 1);
+  failed += test_into_run(7, 2, 1);
+  failed += test_into_run(0, 0, 1);
+  return failed;
+}
+
+typedef struct test_sink {
+  char ts_buf[64];
+  size_t ts_len;
+  size_t ts_words;
+  size_t ts_stop;
+  int ts_execs;
+} test_sink_t;
+
+// Collects the words separated by '|' and stops after ts_stop of them
+static int test_sink_word(void *data, const char *word, size_t len) {
+  test_sink_t *pts = data;
+  if (pts->ts_words > 0 && pts->ts_len < sizeof(pts->ts_buf) - 1)
+    pts->ts_buf[pts->ts_len++] = '|';
+  for (size_t i = 0; i < len && pts->ts_len < sizeof(pts->ts_buf) - 1; i++)
+    pts->ts_buf[pts->ts_len++] = word[i];
+  pts->ts_buf[pts->ts_len] = '\0';
+  return ++pts->ts_words == pts->ts_stop;
+}
+
+static int test_sink_exec(void *data, char **argv, FILE *ofp) {
+  ((test_sink_t *)data)->ts_execs++;
+  fprintf(ofp, "%s\n", argv[1] != NULL ? argv[1] : "");
+  return 0;
+}
+
+static int test_sink_run(const char *input, size_t stop, const char *words,
+                         int execs) {
+  test_sink_t ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.ts_stop = stop;
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_word = test_sink_word;
+  kwe.kwe_exec = test_sink_exec;
+  kwe.kwe_data = &ts;
+  int ret = kwordexp(input, &kwe, 0);
+  size_t wordc = kwe.kwe_wordc;
+  if (ret == 0)
+    kwordfree(&kwe);
+  if (ret != 0 || wordc != 0 || strcmp(ts.ts_buf, words) != 0 ||
+      ts.ts_execs != execs) {
+    printf("FAIL word: %s, stop after %zu: \"%s\", %d commands\n", input,
+           stop, ts.ts_buf, ts.ts_execs);
+    return 1;
+  }
+  return 0;
+}
+
+static int test_sink(void) {
+  // every word in order, none left in kwe_wordv
+  int failed = test_sink_run("a $1 x{b,c} \"d e\" $(c f)", 0,
+                             "a|5|xb|xc|d e|f", 1);
+  // a nonzero return ends the expansion before the rest is expanded
+  failed += test_sink_run("a $1 x{b,c} \"d e\" $(c f)", 3, "a|5|xb", 0);
+  failed += test_sink_run("a $(c f) b", 1, "a", 0);
+  return failed;
+}
+
+// Expand into a temporary file and compare what was written
+static int test_write_run(const char *input, int sep, const char *want,
+                          size_t len) {
+  FILE *fp = tmpfile();
+  if (fp == NULL) {
+    printf("FAIL write: tmpfile\n");
+    return 1;
+  }
+  kwordexp_t kwe;
+  test_init(&kwe);
+  int ret = kwordexp_write(fileno(fp), input, sep, &kwe, 0);
+  char *buf = malloc(len + 2);
+  size_t n = 0;
+  if (ret == 0 && buf != NULL && fseek(fp, 0, SEEK_SET) == 0)
+    n = fread(buf, 1, len + 2, fp);
+  fclose(fp);
+  int failed = ret != 0 || buf == NULL || n != len || memcmp(buf, want, len);
+  if (failed)
+    printf("FAIL write: %s: %d, %zu bytes\n", input, ret, n);
+  free(buf);
+  return failed;
+}
+
+static int test_write(void) {
+  int failed = test_write_run("a $1 'b c' x{d,e}", '\n', "a\n5\nb c\nxd\nxe\n",
+                              14);
+  failed += test_write_run("a $1 'b c'", '\0', "a\0005\0b c", 8);
+  failed += test_write_run("$KWT_EMPTY", '\n', "", 0);
+
+  // a word larger than the batch goes out on its own
+  size_t biglen = 40000;
+  char *big = malloc(biglen + 1), *want = malloc(biglen + 6);
+  if (big == NULL || want == NULL) {
+    free(big);
+    free(want);
+    return failed + 1;
+  }
+  memset(big, 'w', biglen);
+  big[biglen] = '\0';
+  snprintf(want, biglen + 6, "x:%s:y:", big);
+  if (setenv("KWT_BIG", big, 1) == 0)
+    failed += test_write_run("x $KWT_BIG y", ':', want, biglen + 5);
+  else
+    failed++;
+  unsetenv("KWT_BIG");
+  free(big);
+  free(want);
+
+  kwordexp_t kwe;
+  test_init(&kwe);
+  if (kwordexp_write(-1, "a", '\n', &kwe, 0) == 0) {
+    printf("FAIL write: a bad fd went unnoticed\n");
+    failed++;
+  }
+  return failed;
+}
+
+typedef struct test_info {
+  const char *ti_input;
+  int ti_flags;
+  unsigned ti_argmask;
+} test_info_t;
+
+static const test_info_t info_cases[] = {
+    {"$1 $2", 0, 0x6},
+    {"$(($1))", KWRDI_ARITH, 0x2},
+    {"$(($2+1))", KWRDI_ARITH, 0x4},
+    {"$((${3} ? $1 : 0))", KWRDI_ARITH, 0xa},
+    {"$(($#))", KWRDI_ARITH | KWRDI_ARGS, 0},
+    {"$(($(echo 1)+$1))", KWRDI_ARITH | KWRDI_CMDSUB, 0x2},
+};
+
+static int test_analyze(void) {
+  int failed = 0;
+  for (size_t i = 0; i < COUNTOF(info_cases); i++) {
+    const test_info_t *pti = &info_cases[i];
+    kwordexp_info_t info;
+    if (kwordexp_analyze(pti->ti_input, &info) != 0) {
+      printf("FAIL analyze: %s: failed\n", pti->ti_input);
+      failed++;
+      continue;
+    }
+    int flags = info.kwi_flags & (KWRDI_ARITH | KWRDI_ARGS | KWRDI_CMDSUB);
+    if (flags != pti->ti_flags || info.kwi_argmask != pti->ti_argmask) {
+      printf("FAIL analyze: %s: flags %#x, argmask %#x\n", pti->ti_input,
+             (unsigned)info.kwi_flags, info.kwi_argmask);
+      failed++;
+    }
+    kwordexp_info_free(&info);
+  }
+  return failed;
+}
+
+// The number of expansions kwordexp_metrics_dump() reports
+static long test_expansions(void) {
+  FILE *fp = tmpfile();
+  if (fp == NULL || kwordexp_metrics_dump(fp) != 0)
+    return -1;
+  rewind(fp);
+  long count = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), fp) != NULL)
+    if (sscanf(line, "kwordexp_expansion_seconds_count %ld", &count) == 1)
+      break;
+  fclose(fp);
+  return count;
+}
+
+static int test_metrics(void) {
+  int failed = 0;
+  kwordexp_t kwe;
+  // recorded by default
+  long before = test_expansions();
+  test_init(&kwe);
+  if (kwordexp("$1", &kwe, 0) == 0)
+    kwordfree(&kwe);
+  if (before < 0 || test_expansions() != before + 1) {
+    printf("FAIL metrics: expansion not recorded\n");
+    failed++;
+  }
+  kwordexp_metrics_enable(0);
+  test_init(&kwe);
+  if (kwordexp("$1", &kwe, 0) == 0)
+    kwordfree(&kwe);
+  if (test_expansions() != before + 1) {
+    printf("FAIL metrics: recorded while disabled\n");
+    failed++;
+  }
+
+  // kwe_stats times the expansion with the metrics off
+  kwordexp_stats_t stats;
+  test_init(&kwe);
+  kwe.kwe_stats = &stats;
+  if (kwordexp("$(echo 1)", &kwe, 0) == 0)
+    kwordfree(&kwe);
+  if (stats.kws_total_ns == 0 || stats.kws_exec_ns == 0) {
+    printf("FAIL metrics: kwe_stats not timed\n");
+    failed++;
+  }
+  kwordexp_metrics_enable(1);
+  return failed;
+}
+
+// flags that turn expansions off, run in the test tree
+static const test_case_t mode_cases[] = {
+    {"d/*.c", 0, "d/a.c|d/b.c"},
+    {"d/*.c d/[ab].c", KWRDE_NOGLOB, "d/*.c|d/[ab].c"},
+    {"$1{a,b} d/?.c", KWRDE_NOGLOB, "5a|5b|d/?.c"},
+    {"$1 $KWT_PATH ${KWT_PATH} $(echo x) $((1+1))", KWRDE_SPLITONLY,
+     "$1|$KWT_PATH|${KWT_PATH}|$(echo|x)|$((1+1))"},
+    {"~ ~root a{b,c} {1..2} d/*.c", KWRDE_SPLITONLY,
+     "~|~root|a{b,c}|{1..2}|d/*.c"},
+    {"'a b' \"c $1\" d\\ e", KWRDE_SPLITONLY, "a b|c $1|d e"},
+    {"$(echo x)", KWRDE_NOCMD, NULL},
+    {"x$((1+$(echo 1)))", KWRDE_NOCMD, NULL},
+};
+
+// ${...} parses its parts apart from the caller's compact words
+static const test_case_t compact_cases[] = {
+    {"${KWT_PATH}", KWRDE_COMPACT, "/x/y.z"},
+    {"a ${KWT_PATH} b", KWRDE_COMPACT, "a|/x/y.z|b"},
+    {"${KWT_PATH#/}", KWRDE_COMPACT, "x/y.z"},
+    {"${KWT_PATH##*/} ${KWT_PATH%.*}", KWRDE_COMPACT, "y.z|/x/y"},
+    {"${KWT_PATH#/x/}/d/*.c", KWRDE_COMPACT, "y.z/d/*.c"},
+    {"$(echo ${KWT_PATH})", KWRDE_COMPACT, "/x/y.z"},
+};
+
+// KWRDE_COMPACT keeps each directory prefix once
+static int test_compact(void) {
+  static const struct {
+    const char *name;
+    const char *prefix;
+  } want[] = {{"a.c", "d/"}, {"b.c", "d/"}, {"c.c", "d/sub/"}, {"y z", ""}};
+  kwordexp_t kwe;
+  test_init(&kwe);
+  int ret = kwordexp("d/*.c d/sub/*.c 'y z'", &kwe, KWRDE_COMPACT);
+  if (ret != 0 || kwe.kwe_wordv != NULL || kwe.kwe_wordc != COUNTOF(want)) {
+    printf("FAIL compact: %zu words\n", kwe.kwe_wordc);
+    if (ret == 0)
+      kwordfree(&kwe);
+    return 1;
+  }
+  int failed = 0;
+  for (size_t i = 0; i < COUNTOF(want); i++) {
+    size_t prefix, len;
+    const char *name = kwordexp_word_name(&kwe, i, &prefix);
+    const char *dir = kwordexp_word_prefix(&kwe, prefix, &len);
+    char path[5];
+    size_t pathlen = kwordexp_word_path(&kwe, i, path, sizeof(path));
+    size_t full = strlen(want[i].prefix) + strlen(want[i].name);
+    if (strcmp(name, want[i].name) != 0 || len != strlen(want[i].prefix) ||
+        strncmp(dir, want[i].prefix, len) != 0 || pathlen != full ||
+        strlen(path) != (full < sizeof(path) ? full : sizeof(path) - 1)) {
+      printf("FAIL compact: word %zu is \"%.*s\" + \"%s\"\n", i, (int)len,
+             dir, name);
+      failed++;
+    }
+  }
+  // kwordexp_wordv builds the plain vector on demand
+  failed += test_words("compact", "d/*.c d/sub/*.c 'y z'", 0, &kwe,
+                       "d/a.c|d/b.c|d/sub/c.c|y z");
+  kwordfree(&kwe);
+  return failed +
+         test_cases("compact", compact_cases, COUNTOF(compact_cases));
+}
+
+// Counts its calls in *data, prints its last argument and exits with 3.
+static int test_exec(void *data, char **argv, FILE *ofp) {
+  ++*(int *)data;
+  while (argv[1] != NULL)
+    argv++;
+  fprintf(ofp, "%s\n\n", argv[0]);
+  return 3;
+}
+
+static int test_shexpand(kwordexp_shcache_t *pshc, const char *input,
+                         int *pexecs, const char *words) {
+  kwordexp_t kwe;
+  test_init(&kwe);
+  kwe.kwe_exec = test_exec;
+  kwe.kwe_data = pexecs;
+  kwe.kwe_shcache = pshc;
+  int ret = kwordexp(input, &kwe, 0);
+  int failed = test_words("shcache", input, ret, &kwe, words);
+  if (ret == 0 && strstr(input, "$(") != NULL && kwe.kwe_last_status != 3) {
+    printf("FAIL shcache: %s: status %d\n", input, kwe.kwe_last_status);
+    failed++;
+  }
+  if (ret == 0)
+    kwordfree(&kwe);
+  return failed;
+}
+
+static int test_shexecs(const char *what, int execs, int want) {
+  if (execs == want)
+    return 0;
+  printf("FAIL shcache: %s: %d commands run, expected %d\n", what, execs,
+         want);
+  return 1;
+}
+
+static int test_shcache(void) {
+  int failed = 0, execs = 0;
+  kwordexp_shcache_t *pshc = kwordexp_shcache_open(NULL, 0, 0);
+  if (pshc == NULL) {
+    printf("FAIL shcache: open\n");
+    return 1;
+  }
+  // output and status come back from the cache
+  failed += test_shexpand(pshc, "$(c 1)", &execs, "1");
+  failed += test_shexpand(pshc, "$(c 1)", &execs, "1");
+  failed += test_shexecs("hit", execs, 1);
+
+  // a child process attached by fork() sees the parent's entries
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int n = 0;
+    int bad = test_shexpand(pshc, "$(c 1)", &n, "1");
+    bad += test_shexpand(pshc, "$(c 2)", &n, "2");
+    _exit(bad != 0 ? 255 : n);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    printf("FAIL shcache: fork\n");
+    failed++;
+  } else {
+    failed += test_shexecs("fork", WEXITSTATUS(status), 1);
+  }
+  // and the parent what the child added
+  failed += test_shexpand(pshc, "$(c 2)", &execs, "2");
+  failed += test_shexecs("from the child", execs, 1);
+
+  // a listing is shared by every path reaching the directory and dropped
+  // once the directory changes
+  failed += test_shexpand(pshc, "d/sub/*.c", &execs, "d/sub/c.c");
+  failed += test_shexpand(pshc, "d/link/*.c", &execs, "d/link/c.c");
+  FILE *fp = fopen("d/sub/f.c", "w");
+  if (fp == NULL || fclose(fp) != 0)
+    failed++;
+  failed += test_shexpand(pshc, "d/link/*.c", &execs, "d/link/c.c|d/link/f.c");
+  if (unlink("d/sub/f.c") != 0)
+    failed++;
+  failed += test_shexpand(pshc, "d/sub/*.c", &execs, "d/sub/c.c");
+  // the same relative path from another directory with the same mtime is
+  // another listing
+  struct stat st;
+  struct timespec times[2];
+  if (stat("d", &st) != 0 || chdir("d") != 0) {
+    printf("FAIL shcache: chdir d\n");
+    kwordexp_shcache_close(pshc);
+    return failed + 1;
+  }
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  failed += test_shexpand(pshc, "*.c", &execs, "a.c|b.c");
+  if (utimensat(AT_FDCWD, "sub", times, 0) != 0 || chdir("sub") != 0)
+    failed++;
+  failed += test_shexpand(pshc, "*.c", &execs, "c.c");
+  if (chdir(test_dir) != 0)
+    failed++;
+  kwordexp_shcache_close(pshc);
+
+  // entries expire after the ttl
+  execs = 0;
+  pshc = kwordexp_shcache_open(NULL, 0, 1000000);
+  if (pshc == NULL) {
+    printf("FAIL shcache: open with a ttl\n");
+    return failed + 1;
+  }
+  failed += test_shexpand(pshc, "$(c 1)", &execs, "1");
+  usleep(10000);
+  failed += test_shexpand(pshc, "$(c 1)", &execs, "1");
+  failed += test_shexecs("ttl", execs, 2);
+  kwordexp_shcache_close(pshc);
+
+  // a named cache is attached to by opening the same name again
+  execs = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/kwordexp-test.%ld", (long)getpid());
+  kwordexp_shcache_t *pshc1 = kwordexp_shcache_open(name, 1 << 20, 0);
+  kwordexp_shcache_t *pshc2 = kwordexp_shcache_open(name, 1 << 20, 0);
+  if (pshc1 == NULL || pshc2 == NULL) {
+    printf("FAIL shcache: open %s\n", name);
+    failed++;
+  } else {
+    failed += test_shexpand(pshc1, "$(c 1)", &execs, "1");
+    failed += test_shexpand(pshc2, "$(c 1)", &execs, "1");
+    failed += test_shexecs("attach", execs, 1);
+  }
+  if (pshc1 != NULL)
+    kwordexp_shcache_close(pshc1);
+  if (pshc2 != NULL)
+    kwordexp_shcache_close(pshc2);
+  shm_unlink(name);
+  return failed;
+}
+
+static int test_all(void) {
+  int failed = 0;
+  for (size_t i = 0; i < COUNTOF(test_vars); i++)
+    if (setenv(test_vars[i][0], test_vars[i][1], 1) != 0) {
+      perror(test_vars[i][0]);
+      return 1;
+    }
+  unsetenv("IFS");
+  failed += test_arith();
+  failed += test_brace();
+  failed += test_depth();
+  failed += test_pattern();
+  failed += test_tilde();
+  failed += test_env();
+  failed += test_getenvv_batch();
+  failed += test_provider();
+  failed += test_slow();
+  failed += test_split();
+  failed += test_into();
+  failed += test_sink();
+  failed += test_write();
+  failed += test_analyze();
+  failed += test_cache();
+  failed += test_metrics();
+  if (test_mktree() != 0) {
+    perror(test_dir);
+    return 1;
+  }
+  failed += test_glob();
+  failed += test_cases("mode", mode_cases, COUNTOF(mode_cases));
+  failed += test_compact();
+  failed += test_shcache();
+  test_rmtree();
+  if (failed == 0)
+    printf("all tests passed\n");
+  return failed;
+}
+
 int main(int argc, char **argv) {
 #ifdef REPLACE_SYSTEM_ALLOC
   GC_INIT();
@@ -22,6 +1285,7 @@ int main(int argc, char **argv) {
       break;
     case 'h':
       printf("Usage: %s [-w] [-h] [-v] [word ...]\n", argv[0]);
+      printf("  without words, run the built-in tests\n");
       printf("  -w: use wordexp\n");
       printf("  -h: show this help\n");
       printf("  -v: show version\n");
@@ -36,6 +1300,9 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (optind == argc)
+    exit(test_all() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
   if (mode_we) {
     for (int i = optind; i < argc; i++) {
       printf("argv[%d]=%s\n", i, argv[i]);
@@ -51,17 +1318,7 @@ int main(int argc, char **argv) {
     for (int i = optind; i < argc; i++) {
       printf("argv[%d]=%s\n", i, argv[i]);
       kwordexp_t kwe;
-      kwe.kwe_argc = argc;
-      kwe.kwe_argv = argv;
-      kwe.kwe_data = NULL;
-      kwe.kwe_wordc = 0;
-      kwe.kwe_wordv = NULL;
-      kwe.kwe_last_arg = NULL;
-      kwe.kwe_last_bgpid = 0;
-      kwe.kwe_last_status = 0;
-      kwe.kwe_exec = NULL;
-      kwe.kwe_getenv = NULL;
-      kwe.kwe_setenv = NULL;
+      kwordexp_init(&kwe, argv, argc);
 
       int ret = kwordexp(argv[i], &kwe, 0);
       if (ret != 0) {
@@ -0,0 +1,127 @@
+// Builds and exercises the C++20 wrapper in kwordexp.hpp.
+#include "../include/kwordexp.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <stdexcept>
+#include <string_view>
+#ifdef REPLACE_SYSTEM_ALLOC
+#include <gc.h>
+#endif
+
+namespace {
+
+// Counts what the words take from it
+class counting_resource : public std::pmr::memory_resource {
+public:
+  std::size_t bytes = 0;
+
+private:
+  void *do_allocate(std::size_t n, std::size_t align) override {
+    bytes += n;
+    return std::pmr::new_delete_resource()->allocate(n, align);
+  }
+  void do_deallocate(void *p, std::size_t n, std::size_t align) override {
+    std::pmr::new_delete_resource()->deallocate(p, n, align);
+  }
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+int failed = 0;
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    std::printf("FAIL c++: %s\n", what);
+    failed++;
+  }
+}
+
+bool same(const kwe::words &w, std::initializer_list<std::string_view> want) {
+  if (w.size() != want.size())
+    return false;
+  auto it = w.begin();
+  for (std::string_view s : want)
+    if (*it++ != s)
+      return false;
+  return true;
+}
+
+char *argv[] = {const_cast<char *>("runTestCxx"), const_cast<char *>("5"),
+                nullptr};
+
+void test_expander() {
+  counting_resource mr;
+  kwe::words w(&mr);
+  kwe::expander ex(argv, 2);
+
+  int lookups = 0;
+  char value[] = "v w";
+  auto getenv = [&](const char *key, char **pvalue) {
+    lookups++;
+    *pvalue = std::strcmp(key, "V") == 0 ? value : nullptr;
+    return 0;
+  };
+  auto exec = [](char **av, FILE *ofp) {
+    std::fprintf(ofp, "ran-%s\n", av[1] != nullptr ? av[1] : "");
+    return 0;
+  };
+  ex.on_getenv(getenv).on_exec(exec);
+
+  // only the first len bytes are input; no NUL follows them
+  const char input[] = {'$', 'V', ' ', '$', '1', ' ', '$', '(', 'c',
+                        ' ', 'x', ')', ' ', '$', 'V', 'X'};
+  check(ex.expand(std::string_view(input, 15), w) == 0, "expand");
+  check(same(w, {"v", "w", "5", "ran-x", "v", "w"}), "words");
+  // IFS is looked up as well
+  check(lookups == 3, "getenv callback");
+  check(mr.bytes > 0 && w.resource() == &mr, "memory resource");
+  check(w[2].data()[w[2].size()] == '\0', "NUL after each word");
+  check(w.end() - w.begin() == 6 && w.begin()[3] == "ran-x", "iterator");
+
+  kwe::words moved = std::move(w);
+  check(moved.size() == 6 && moved.resource() == &mr, "move");
+
+  // an exception from a callback comes back out of expand()
+  auto thrower = [](const char *, char **) -> int {
+    throw std::runtime_error("getenv");
+  };
+  ex.on_getenv(thrower);
+  bool caught = false;
+  try {
+    int ret = ex.expand("$V", moved);
+    (void)ret;
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  check(caught, "exception from a callback");
+}
+
+void test_kwordexp_n() {
+  // kwordexp_n stops at len even where no NUL follows
+  const char input[] = {'a', ' ', '$', '1', 'b', 'c'};
+  kwordexp_t we;
+  kwordexp_init(&we, argv, 2);
+  int ret = kwordexp_n(input, 4, &we, 0);
+  check(ret == 0 && we.kwe_wordc == 2 &&
+            std::strcmp(we.kwe_wordv[0], "a") == 0 &&
+            std::strcmp(we.kwe_wordv[1], "5") == 0,
+        "kwordexp_n");
+  if (ret == 0)
+    kwordfree(&we);
+}
+
+} // namespace
+
+int main() {
+#ifdef REPLACE_SYSTEM_ALLOC
+  GC_INIT();
+#endif
+  test_expander();
+  test_kwordexp_n();
+  if (failed == 0)
+    std::printf("all tests passed\n");
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}